@@ -0,0 +1,619 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "batch.h"
+#include "device.h"
+#include "device_io.h"
+#include "plugin_manager.h"
+#include "simulator.h"
+#include "list.h"
+#include "lockstep.h"
+#include "util.h"
+
+#define BATCH_MAX_LINE           4096
+#define BATCH_MAX_INSTRUCTIONS   100000000LL
+#define BATCH_MAX_OUTPUT         (1 << 20)
+#define BATCH_BUFFER_SIZE_INIT   256
+#define BATCH_NO_INPUT           "-"
+/* get_char calls before a character is handed over even though the program isn't polling
+ * for it, so programs that only take keyboard interrupts still get their input */
+#define BATCH_INPUT_PATIENCE     64
+
+struct batch_job {
+    size_t line;
+    char *programs;
+    char *input; /* NULL if the job has no input */
+    char *expected;
+};
+
+/* Jobs are dealt out in order to one deque per worker. A worker takes from the top of its
+ * own deque and when that runs dry steals from the bottom of the others. */
+struct batch_deque {
+    pthread_mutex_t lock;
+    size_t *jobs;
+    size_t top;
+    size_t bottom;
+};
+
+struct batch_buffer {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+struct batch_io_data {
+    struct batch_buffer input;
+    size_t input_pos;
+    struct batch_buffer output;
+    int output_overflow;
+    int waiting; /* the program is polling for input */
+    int starved; /* it polled with no input left */
+    int calls;   /* get_char calls since the last character was handed over */
+};
+
+struct batch {
+    struct batch_job *jobs;
+    size_t num_jobs;
+    struct batch_deque *deques;
+    int num_workers;
+    int num_lanes; /* jobs a worker runs in lockstep */
+    List *device_inits;
+    enum simulator_engine engine;
+    int fast_traps;
+    pthread_mutex_t report_lock;
+    size_t num_passed;
+    size_t num_failed;
+    int engine_failed;
+};
+
+/* What a worker needs to run one job */
+struct batch_lane {
+    Simulator *simulator;
+    struct device_io io;
+    struct batch_io_data io_data;
+    struct batch_buffer expected;
+    List *devices; /* attached to simulator */
+    const char *baseline_programs; /* what the simulator's baseline has loaded, NULL if none */
+    struct batch_job *job;
+};
+
+struct batch_worker {
+    struct batch *batch;
+    int id;
+    pthread_t thread;
+};
+
+static void batch_buffer_init(struct batch_buffer *buffer) {
+    buffer->data = safe_malloc(BATCH_BUFFER_SIZE_INIT);
+    buffer->len = 0;
+    buffer->size = BATCH_BUFFER_SIZE_INIT;
+}
+
+static void batch_buffer_add(struct batch_buffer *buffer, const char *data, size_t len) {
+    if (buffer->len + len > buffer->size) {
+        while (buffer->len + len > buffer->size) {
+            buffer->size *= 2;
+        }
+        buffer->data = safe_realloc(buffer->data, buffer->size);
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+}
+
+/* Replaces the contents of buffer with the file at path */
+static int batch_buffer_read_file(struct batch_buffer *buffer, const char *path) {
+    FILE *file;
+    char chunk[BUFSIZ];
+    size_t amt;
+    int result;
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    buffer->len = 0;
+    while ((amt = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        batch_buffer_add(buffer, chunk, amt);
+    }
+    result = ferror(file) ? -1 : 0;
+    fclose(file);
+    return result;
+}
+
+static int batch_io_get_char(struct device_io *io, char *c) {
+    struct batch_io_data *data;
+    data = io->data;
+    if (data->input_pos == data->input.len) {
+        if (data->waiting) {
+            data->starved = 1;
+            return -1;
+        }
+        return 0;
+    }
+    if (!data->waiting && ++data->calls < BATCH_INPUT_PATIENCE) {
+        return 0;
+    }
+    *c = data->input.data[data->input_pos++];
+    data->waiting = 0;
+    data->calls = 0;
+    return 1;
+}
+
+static int batch_io_write_char(struct device_io *io, char c) {
+    struct batch_io_data *data;
+    data = io->data;
+    if (data->output.len == BATCH_MAX_OUTPUT) {
+        data->output_overflow = 1;
+        return 1;
+    }
+    batch_buffer_add(&data->output, &c, 1);
+    return 1;
+}
+
+static int batch_io_write_buf(struct device_io *io, const char *buf, size_t len) {
+    struct batch_io_data *data;
+    size_t room;
+    data = io->data;
+    room = BATCH_MAX_OUTPUT - data->output.len;
+    if (len > room) {
+        data->output_overflow = 1;
+        len = room;
+    }
+    batch_buffer_add(&data->output, buf, len);
+    return len;
+}
+
+static int batch_io_wait_input(struct device_io *io) {
+    struct batch_io_data *data;
+    data = io->data;
+    data->waiting = 1;
+    return 1;
+}
+
+static int batch_io_nop(struct device_io *io) {
+    return 0;
+}
+
+static void init_batch_io(struct device_io *io, struct batch_io_data *data) {
+    batch_buffer_init(&data->input);
+    batch_buffer_init(&data->output);
+    io->data = data;
+    io->get_char = batch_io_get_char;
+    io->write_char = batch_io_write_char;
+    io->write_buf = batch_io_write_buf;
+    io->start = batch_io_nop;
+    io->end = batch_io_nop;
+    io->wait_input = batch_io_wait_input;
+}
+
+static void batch_io_new_job(struct batch_io_data *data) {
+    data->input.len = 0;
+    data->input_pos = 0;
+    data->output.len = 0;
+    data->output_overflow = 0;
+    data->waiting = 0;
+    data->starved = 0;
+    data->calls = 0;
+}
+
+static int program_reader(void *data, uint16_t *program_word) {
+    FILE *program_file = data;
+    int result;
+    result = fread(program_word, sizeof(uint16_t), 1, program_file);
+    if (result == 0 && ferror(program_file)) {
+        return -1;
+    } else if (result == 0) {
+        return 0;
+    }
+    *program_word = ntohs(*program_word);
+    return result;
+}
+
+static int batch_load_program(Simulator *simulator, const char *path) {
+    FILE *program_file;
+    int result;
+    program_file = fopen(path, "r");
+    if (program_file == NULL) {
+        return -1;
+    }
+    result = simulator_load_program(simulator, program_reader, program_file);
+    fclose(program_file);
+    return result;
+}
+
+static void batch_report(struct batch *batch, struct batch_job *job, int passed, const char *why) {
+    pthread_mutex_lock(&batch->report_lock);
+    if (passed) {
+        ++batch->num_passed;
+        printf("PASS %s:%zu %s\n", job->programs, job->line, job->input == NULL ? BATCH_NO_INPUT : job->input);
+    } else {
+        ++batch->num_failed;
+        printf("FAIL %s:%zu %s: %s\n", job->programs, job->line, job->input == NULL ? BATCH_NO_INPUT : job->input, why);
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&batch->report_lock);
+}
+
+static void batch_attach_devices(struct batch *batch, Simulator *simulator, List *devices) {
+    size_t i, num_inits;
+    num_inits = list_num_elements(batch->device_inits);
+    for (i = 0; i < num_inits; ++i) {
+        struct device *(*init)(void);
+        struct device *device;
+        init = *(struct device *(**)(void))list_get(batch->device_inits, i);
+        device = init();
+        if (device == NULL) {
+            continue;
+        }
+        if (simulator_attach_device(simulator, device) < 0) {
+            device->free(device);
+            continue;
+        }
+        list_add(devices, &device);
+    }
+}
+
+static void batch_free_devices(List *devices) {
+    size_t i, num_devices;
+    num_devices = list_num_elements(devices);
+    for (i = 0; i < num_devices; ++i) {
+        struct device *device;
+        device = *(struct device **)list_get(devices, i);
+        device->free(device);
+    }
+    list_clear(devices);
+}
+
+/* Loads every program of the job, returns the one that failed or NULL */
+static const char *batch_load_programs(Simulator *simulator, struct batch_job *job, char *programs_copy) {
+    char *path, *save;
+    strcpy(programs_copy, job->programs);
+    for (path = strtok_r(programs_copy, ",", &save); path != NULL; path = strtok_r(NULL, ",", &save)) {
+        if (batch_load_program(simulator, path) < 0) {
+            return path;
+        }
+    }
+    return NULL;
+}
+
+static size_t batch_first_difference(struct batch_buffer *output, struct batch_buffer *expected) {
+    size_t i;
+    for (i = 0; i < output->len && i < expected->len; ++i) {
+        if (output->data[i] != expected->data[i]) {
+            break;
+        }
+    }
+    return i;
+}
+
+/* Puts the job's programs in the lane's simulator, just by going back to the baseline when the
+ * lane's last job loaded the same ones. Devices a baseline can't hold get no baseline, so every
+ * job has them attached fresh. Returns the program that failed to load or NULL. */
+static const char *batch_load_job(struct batch *batch, struct batch_lane *lane, char *programs_copy) {
+    const char *failed_program;
+    if (lane->baseline_programs != NULL && strcmp(lane->baseline_programs, lane->job->programs) == 0 &&
+        simulator_reset_to_baseline(lane->simulator) == 0) {
+        return NULL;
+    }
+    lane->baseline_programs = NULL;
+    simulator_reset(lane->simulator);
+    batch_free_devices(lane->devices);
+    batch_attach_devices(batch, lane->simulator, lane->devices);
+    failed_program = batch_load_programs(lane->simulator, lane->job, programs_copy);
+    if (failed_program == NULL && simulator_set_baseline(lane->simulator) == 0) {
+        lane->baseline_programs = lane->job->programs;
+    }
+    return failed_program;
+}
+
+/* Gets the lane ready to run its job. Returns 0 if the job already failed. */
+static int batch_prepare_job(struct batch *batch, struct batch_lane *lane) {
+    char why[BATCH_MAX_LINE + 64];
+    char programs_copy[BATCH_MAX_LINE];
+    const char *failed_program;
+    struct batch_job *job;
+    job = lane->job;
+    batch_io_new_job(&lane->io_data);
+    if ((failed_program = batch_load_job(batch, lane, programs_copy)) != NULL) {
+        snprintf(why, sizeof(why), "can't load %s: %s", failed_program, strerror(errno));
+    } else if (job->input != NULL && batch_buffer_read_file(&lane->io_data.input, job->input) < 0) {
+        snprintf(why, sizeof(why), "can't read %s: %s", job->input, strerror(errno));
+    } else if (batch_buffer_read_file(&lane->expected, job->expected) < 0) {
+        snprintf(why, sizeof(why), "can't read %s: %s", job->expected, strerror(errno));
+    } else {
+        return 1;
+    }
+    batch_report(batch, job, 0, why);
+    return 0;
+}
+
+static void batch_finish_job(struct batch *batch, struct batch_lane *lane, enum simulator_stop_reason reason) {
+    char why[BATCH_MAX_LINE + 64];
+    struct batch_io_data *io_data;
+    size_t difference;
+    io_data = &lane->io_data;
+    switch (reason) {
+    case SIMULATOR_STOP_HALTED:
+        difference = batch_first_difference(&io_data->output, &lane->expected);
+        if (io_data->output_overflow) {
+            snprintf(why, sizeof(why), "more than %d bytes of output", BATCH_MAX_OUTPUT);
+        } else if (difference == io_data->output.len && difference == lane->expected.len) {
+            batch_report(batch, lane->job, 1, NULL);
+            return;
+        } else {
+            snprintf(why, sizeof(why), "output differs at byte %zu", difference);
+        }
+        break;
+    case SIMULATOR_STOP_BUDGET:
+        snprintf(why, sizeof(why), "still running after %lld instructions", BATCH_MAX_INSTRUCTIONS);
+        break;
+    case SIMULATOR_STOP_ILLEGAL_OPCODE:
+        snprintf(why, sizeof(why), "illegal opcode at 0X%04X", simulator_read_register(lane->simulator, REG_PC));
+        break;
+    default:
+        snprintf(why, sizeof(why), io_data->starved ? "waiting for input after the end of the input" : "io error");
+        break;
+    }
+    batch_report(batch, lane->job, 0, why);
+}
+
+/* Runs the jobs of the lanes, together when there are several */
+static void batch_run_jobs(struct batch *batch, struct batch_lane *lanes, int num_jobs) {
+    Simulator *simulators[LOCKSTEP_MAX_LANES];
+    enum simulator_stop_reason reasons[LOCKSTEP_MAX_LANES];
+    struct batch_lane *ready[LOCKSTEP_MAX_LANES];
+    int i, num_ready;
+    num_ready = 0;
+    for (i = 0; i < num_jobs; ++i) {
+        if (batch_prepare_job(batch, &lanes[i])) {
+            ready[num_ready] = &lanes[i];
+            simulators[num_ready++] = lanes[i].simulator;
+        }
+    }
+    if (num_ready == 1) {
+        simulator_run(simulators[0], BATCH_MAX_INSTRUCTIONS, &reasons[0]);
+    } else if (num_ready > 1) {
+        simulator_run_lockstep(simulators, num_ready, BATCH_MAX_INSTRUCTIONS, reasons);
+    }
+    for (i = 0; i < num_ready; ++i) {
+        batch_finish_job(batch, ready[i], reasons[i]);
+    }
+}
+
+static int batch_same_programs(struct batch *batch, size_t job_index, size_t other_index) {
+    return strcmp(batch->jobs[job_index].programs, batch->jobs[other_index].programs) == 0;
+}
+
+/* Takes up to max jobs that load the same programs, first from the front of the worker's own
+ * deque, then from the back of the others. Returns how many were taken. */
+static int batch_take_jobs(struct batch *batch, int worker_id, size_t *job_indices, int max) {
+    struct batch_deque *deque;
+    int i, num_taken;
+    deque = &batch->deques[worker_id];
+    num_taken = 0;
+    pthread_mutex_lock(&deque->lock);
+    while (num_taken < max && deque->top < deque->bottom &&
+           (num_taken == 0 || batch_same_programs(batch, job_indices[0], deque->jobs[deque->top]))) {
+        job_indices[num_taken++] = deque->jobs[deque->top++];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    for (i = 1; num_taken == 0 && i < batch->num_workers; ++i) {
+        deque = &batch->deques[(worker_id + i) % batch->num_workers];
+        pthread_mutex_lock(&deque->lock);
+        while (num_taken < max && deque->top < deque->bottom &&
+               (num_taken == 0 || batch_same_programs(batch, job_indices[0], deque->jobs[deque->bottom - 1]))) {
+            job_indices[num_taken++] = deque->jobs[--deque->bottom];
+        }
+        pthread_mutex_unlock(&deque->lock);
+    }
+    return num_taken;
+}
+
+static void init_batch_lane(struct batch *batch, struct batch_lane *lane) {
+    init_batch_io(&lane->io, &lane->io_data);
+    batch_buffer_init(&lane->expected);
+    lane->simulator = simulator_new(&lane->io);
+    if (simulator_set_engine(lane->simulator, batch->engine) < 0) {
+        pthread_mutex_lock(&batch->report_lock);
+        batch->engine_failed = 1;
+        pthread_mutex_unlock(&batch->report_lock);
+    }
+    simulator_set_trap_acceleration(lane->simulator, batch->fast_traps);
+    lane->devices = list_new(sizeof(struct device *), 2, 2.0, &util_list_allocator);
+    lane->baseline_programs = NULL;
+    lane->job = NULL;
+}
+
+static void free_batch_lane(struct batch_lane *lane) {
+    simulator_free(lane->simulator);
+    batch_free_devices(lane->devices);
+    list_free(lane->devices);
+    free(lane->expected.data);
+    free(lane->io_data.input.data);
+    free(lane->io_data.output.data);
+}
+
+/* One simulator, device_io and set of buffers per lane, reused for every job the worker runs */
+static void *batch_worker_main(void *arg) {
+    struct batch_worker *worker;
+    struct batch *batch;
+    struct batch_lane *lanes;
+    size_t job_indices[LOCKSTEP_MAX_LANES];
+    int i, num_jobs;
+    worker = arg;
+    batch = worker->batch;
+    lanes = safe_malloc(sizeof(struct batch_lane) * batch->num_lanes);
+    for (i = 0; i < batch->num_lanes; ++i) {
+        init_batch_lane(batch, &lanes[i]);
+    }
+    while ((num_jobs = batch_take_jobs(batch, worker->id, job_indices, batch->num_lanes)) > 0) {
+        for (i = 0; i < num_jobs; ++i) {
+            lanes[i].job = &batch->jobs[job_indices[i]];
+        }
+        batch_run_jobs(batch, lanes, num_jobs);
+    }
+    for (i = 0; i < batch->num_lanes; ++i) {
+        free_batch_lane(&lanes[i]);
+    }
+    free(lanes);
+    return NULL;
+}
+
+static void batch_free_jobs(struct batch *batch) {
+    size_t i;
+    for (i = 0; i < batch->num_jobs; ++i) {
+        free(batch->jobs[i].programs);
+        free(batch->jobs[i].input);
+        free(batch->jobs[i].expected);
+    }
+    free(batch->jobs);
+}
+
+static int batch_parse_jobs(struct batch *batch, const char *jobs_path) {
+    FILE *jobs_file;
+    char line[BATCH_MAX_LINE];
+    size_t line_num, jobs_size;
+    int result;
+    jobs_file = fopen(jobs_path, "r");
+    if (jobs_file == NULL) {
+        fprintf(stderr, "Can't open %s: %s\n", jobs_path, strerror(errno));
+        return -1;
+    }
+    jobs_size = BATCH_BUFFER_SIZE_INIT;
+    batch->jobs = safe_malloc(sizeof(struct batch_job) * jobs_size);
+    batch->num_jobs = 0;
+    line_num = 0;
+    result = 0;
+    while (fgets(line, sizeof(line), jobs_file) != NULL) {
+        char *tokens[3], *save, *extra;
+        struct batch_job *job;
+        ++line_num;
+        tokens[0] = strtok_r(line, " \t\r\n", &save);
+        if (tokens[0] == NULL || tokens[0][0] == '#') {
+            continue;
+        }
+        tokens[1] = strtok_r(NULL, " \t\r\n", &save);
+        tokens[2] = tokens[1] == NULL ? NULL : strtok_r(NULL, " \t\r\n", &save);
+        extra = tokens[2] == NULL ? NULL : strtok_r(NULL, " \t\r\n", &save);
+        if (tokens[2] == NULL || extra != NULL) {
+            fprintf(stderr, "%s:%zu: expected \"programs input expected_output\"\n", jobs_path, line_num);
+            result = -1;
+            break;
+        }
+        if (batch->num_jobs == jobs_size) {
+            jobs_size *= 2;
+            batch->jobs = safe_realloc(batch->jobs, sizeof(struct batch_job) * jobs_size);
+        }
+        job = &batch->jobs[batch->num_jobs++];
+        job->line = line_num;
+        job->programs = alloc_strcpy(tokens[0]);
+        job->input = strcmp(tokens[1], BATCH_NO_INPUT) == 0 ? NULL : alloc_strcpy(tokens[1]);
+        job->expected = alloc_strcpy(tokens[2]);
+    }
+    if (ferror(jobs_file)) {
+        fprintf(stderr, "Can't read %s: %s\n", jobs_path, strerror(errno));
+        result = -1;
+    }
+    fclose(jobs_file);
+    if (result < 0) {
+        batch_free_jobs(batch);
+    }
+    return result;
+}
+
+static void batch_deal_jobs(struct batch *batch) {
+    size_t per_worker, i;
+    int worker_i;
+    batch->deques = safe_malloc(sizeof(struct batch_deque) * batch->num_workers);
+    per_worker = (batch->num_jobs + batch->num_workers - 1) / batch->num_workers;
+    for (worker_i = 0; worker_i < batch->num_workers; ++worker_i) {
+        struct batch_deque *deque;
+        deque = &batch->deques[worker_i];
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->jobs = safe_malloc(sizeof(size_t) * (per_worker + 1));
+        deque->top = 0;
+        deque->bottom = 0;
+    }
+    for (i = 0; i < batch->num_jobs; ++i) {
+        struct batch_deque *deque;
+        deque = &batch->deques[i / per_worker];
+        deque->jobs[deque->bottom++] = i;
+    }
+}
+
+static List *batch_device_inits(PluginManager *plugin_manager) {
+    PluginManagerIterator *iterator;
+    struct pm_device_data device_data;
+    List *device_inits;
+    device_inits = list_new(sizeof(struct device *(*)(void)), 2, 2.0, &util_list_allocator);
+    iterator = pm_get_iterator(plugin_manager);
+    while (pm_iterator_next(iterator, &device_data)) {
+        list_add(device_inits, &device_data.init);
+    }
+    pm_iterator_free(iterator);
+    return device_inits;
+}
+
+/* Runs the jobs in jobs_path on num_threads threads, one per online cpu when it is less
+ * than 1. With num_lanes above 1 each thread runs up to that many jobs of the same programs
+ * in lockstep. fast_traps turns on trap acceleration. Each result is printed when its job
+ * finishes. Returns the number of failed jobs, or -1 if the jobs file can't be read. */
+int batch_run(const char *jobs_path, PluginManager *plugin_manager, enum simulator_engine engine, int fast_traps,
+              int num_threads, int num_lanes) {
+    struct batch batch;
+    struct batch_worker *workers;
+    int i, num_started;
+    if (batch_parse_jobs(&batch, jobs_path) < 0) {
+        return -1;
+    }
+    if (num_threads < 1) {
+        long num_cpus;
+        num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = num_cpus < 1 ? 1 : num_cpus;
+    }
+    if ((size_t)num_threads > batch.num_jobs) {
+        num_threads = batch.num_jobs == 0 ? 1 : batch.num_jobs;
+    }
+    batch.num_workers = num_threads;
+    batch.num_lanes = num_lanes < 1 ? 1 : num_lanes > LOCKSTEP_MAX_LANES ? LOCKSTEP_MAX_LANES : num_lanes;
+    batch.device_inits = batch_device_inits(plugin_manager);
+    batch.engine = engine;
+    batch.fast_traps = fast_traps;
+    batch.num_passed = 0;
+    batch.num_failed = 0;
+    batch.engine_failed = 0;
+    pthread_mutex_init(&batch.report_lock, NULL);
+    batch_deal_jobs(&batch);
+    workers = safe_malloc(sizeof(struct batch_worker) * batch.num_workers);
+    for (num_started = 0; num_started < batch.num_workers; ++num_started) {
+        workers[num_started].batch = &batch;
+        workers[num_started].id = num_started;
+        if (pthread_create(&workers[num_started].thread, NULL, batch_worker_main, &workers[num_started]) != 0) {
+            /* this thread takes the worker's place and steals whatever is left */
+            batch_worker_main(&workers[num_started]);
+            break;
+        }
+    }
+    for (i = 0; i < num_started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    if (batch.engine_failed) {
+        fprintf(stderr, "Can't start the jit engine, some jobs used the interpreter.\n");
+    }
+    printf("%zu passed, %zu failed\n", batch.num_passed, batch.num_failed);
+    for (i = 0; i < batch.num_workers; ++i) {
+        pthread_mutex_destroy(&batch.deques[i].lock);
+        free(batch.deques[i].jobs);
+    }
+    free(batch.deques);
+    free(workers);
+    pthread_mutex_destroy(&batch.report_lock);
+    list_free(batch.device_inits);
+    batch_free_jobs(&batch);
+    return batch.num_failed;
+}
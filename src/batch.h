@@ -0,0 +1,13 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "plugin_manager.h"
+#include "simulator.h"
+
+/* Each line of a jobs file is a job, "programs input expected_output". programs is a comma
+ * separated list of .obj files loaded in order and input is - when the job reads nothing.
+ * Blank lines and lines starting with # are skipped. */
+int batch_run(const char *jobs_path, PluginManager *, enum simulator_engine, int fast_traps, int num_threads,
+              int num_lanes);
+
+#endif
@@ -1,7 +1,14 @@
+#ifdef __linux__
+#define _GNU_SOURCE /* memfd_create */
+#endif
+
 #include <stdlib.h>
 #include <stdint.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include <stdio.h>
 
@@ -13,6 +20,20 @@
 #define ATTACHMENT_SIZE_INIT       5
 #define ATTACHMENT_SIZE_MULTIPLIER 2
 
+#define BUS_PAGE_BITS  8
+#define BUS_PAGE_SIZE  (1 << BUS_PAGE_BITS)
+#define BUS_NUM_PAGES  (BUS_NUM_ADDRESSES / BUS_PAGE_SIZE)
+#define BUS_PAGE(address) ((address) >> BUS_PAGE_BITS)
+#define BUS_SLOT(address) ((address) & (BUS_PAGE_SIZE - 1))
+
+#define BUS_MEMORY_SIZE (sizeof(uint16_t) * BUS_NUM_ADDRESSES)
+
+/* attachment_flag bits */
+#define ATTACHMENT_DEVICE       0x1
+#define ATTACHMENT_WRITE_HOOK   0x2
+#define ATTACHMENT_DIRECT_READ  0x4 /* device register read from value without calling the device */
+#define ATTACHMENT_DIRECT_WRITE 0x8
+
 struct interval {
     uint16_t low;
     uint16_t high;
@@ -23,27 +44,86 @@ struct bus_attachment {
     struct interval range;
 };
 
-struct mem {
-    uint16_t value;
+/* Where an access to a device register or hooked address goes, filled in at attach time */
+struct bus_slot {
+    struct device *device;
+    uint16_t (*read_register)(struct device *, uint16_t);
+    void (*write_register)(struct device *, uint16_t, uint16_t);
+    uint16_t *value; /* a REGISTERS device's storage for the register */
     char attachment_flag;
 };
 
+/* Memory contents kept in a file so that buses can map them copy on write */
+struct bus_image {
+    int fd;
+    int refs; /* the creator's and one per bus mapping it */
+};
+
+struct bus_write_hook {
+    uint16_t address;
+    void (*func)(void *, uint16_t, uint16_t);
+    void *data;
+};
+
+/* Plain memory is only the value array. Everything else about an address lives in the
+ * page table, which only has pages where there is a device register or write hook, so
+ * ordinary reads and writes don't touch it past the page pointer. The bus is mapped
+ * rather than allocated, memory takes no space until it is touched. */
 struct bus_impl {
+    uint16_t memory[BUS_NUM_ADDRESSES]; /* first, so it starts on a page an image can be mapped over */
+    unsigned char special_pages[BUS_NUM_PAGES]; /* nonzero where pages is not NULL */
+    /* 1 where memory was written since the baseline was set, a byte rather than a bit so
+     * translated stores can mark it with one plain store */
+    unsigned char dirty_pages[BUS_NUM_PAGES];
+    /* NULL until bus_set_baseline, then a copy of each page, NULL for pages that were zeroes */
+    uint16_t **baseline;
+    BusImage *image; /* what memory is mapped from, NULL for anonymous memory */
+    struct bus_slot *pages[BUS_NUM_PAGES];
     List *attachments;
-    struct mem memory[BUS_NUM_ADDRESSES];
+    List *write_hooks;
+    void (*write_log)(void *, uint16_t, uint16_t); /* NULL unless set with bus_set_write_log */
+    void *write_log_data;
 };
 
 Bus *bus_new(void) {
     Bus *bus;
-    bus = safe_malloc(sizeof(Bus));
+    bus = mmap(NULL, sizeof(Bus), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bus == MAP_FAILED) {
+        perror(NULL);
+        abort();
+    }
     bus->attachments = list_new(sizeof(struct bus_attachment), ATTACHMENT_SIZE_INIT, ATTACHMENT_SIZE_MULTIPLIER, &util_list_allocator);
-    memset(bus->memory, 0, sizeof(struct mem) * BUS_NUM_ADDRESSES);
+    bus->write_hooks = NULL;
+    memset(bus->pages, 0, sizeof(bus->pages));
+    memset(bus->special_pages, 0, sizeof(bus->special_pages));
+    memset(bus->dirty_pages, 0, sizeof(bus->dirty_pages));
+    bus->baseline = NULL;
+    bus->image = NULL;
+    bus->write_log = NULL;
+    bus->write_log_data = NULL;
     return bus;
 }
 
+static void bus_image_release(BusImage *image) {
+    if (image != NULL && __atomic_sub_fetch(&image->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(image->fd);
+        free(image);
+    }
+}
+
 void bus_free(Bus *bus) {
+    int i;
+    for (i = 0; i < BUS_NUM_PAGES; ++i) {
+        free(bus->pages[i]);
+        if (bus->baseline != NULL) {
+            free(bus->baseline[i]);
+        }
+    }
     list_free(bus->attachments);
-    free(bus);
+    list_free(bus->write_hooks);
+    free(bus->baseline);
+    bus_image_release(bus->image);
+    munmap(bus, sizeof(Bus));
 }
 
 static int attachment_comparator(const void *first, const void *second) {
@@ -53,103 +133,407 @@ static int attachment_comparator(const void *first, const void *second) {
     return first_attachment->range.low - second_attachment->range.low;
 }
 
-static int bsearch_attachment_comparator(const void *key, const void *element) {
-    const struct bus_attachment *attachment;
-    const struct interval *range;
-    int result;
-    uint16_t point;
-    point = *(const uint16_t *)key;
-    attachment = element;
-    range = &attachment->range;
-    result = 0;
-    if (point < range->low) {
-        result = -1;
-    } else if (point > range->high) {
-        result = 1;
-    }  
-    return result;
+/* The slot for address, making its page if there isn't one */
+static struct bus_slot *bus_new_slot(Bus *bus, uint16_t address) {
+    struct bus_slot *page;
+    page = bus->pages[BUS_PAGE(address)];
+    if (page == NULL) {
+        page = safe_malloc(sizeof(struct bus_slot) * BUS_PAGE_SIZE);
+        memset(page, 0, sizeof(struct bus_slot) * BUS_PAGE_SIZE);
+        bus->pages[BUS_PAGE(address)] = page;
+        bus->special_pages[BUS_PAGE(address)] = 1;
+    }
+    return &page[BUS_SLOT(address)];
 }
 
-static int intervals_overlap(struct interval interval1, struct interval interval2) {
-    return (interval2.low <= interval1.high) && (interval2.high >= interval1.low);
+static void bus_fill_slots(Bus *bus, const struct bus_attachment *attachment) {
+    int i;
+    for (i = attachment->range.low; i <= attachment->range.high; ++i) {
+        struct bus_slot *slot;
+        slot = bus_new_slot(bus, i);
+        slot->device = attachment->device;
+        slot->read_register = attachment->device->read_register;
+        slot->write_register = attachment->device->write_register;
+        slot->attachment_flag |= ATTACHMENT_DEVICE;
+    }
 }
 
-static int bus_contains_interval(Bus *bus, struct interval interval) {
-    int i, num_attachments;
-    int status = 0;
-    num_attachments = list_num_elements(bus->attachments);
-    for (i = 0; i < num_attachments; ++i) {
-        struct bus_attachment *cur_attachment;
-        cur_attachment = list_get(bus->attachments, i);
-        if (cur_attachment->range.low > interval.high) {
-            break;
+/* Adds the device's intervals to added, -1 if its addresses make no sense */
+static int bus_collect_intervals(struct device *device, List *added) {
+    const uint16_t *addresses;
+    const struct device_register *registers;
+    size_t num_addresses, i;
+    struct bus_attachment attachment;
+    attachment.device = device;
+    switch (device->get_address_method(device)) {
+    case RANGE:
+        addresses = device->get_addresses(device, &num_addresses);
+        if (num_addresses < 2 || num_addresses % 2 != 0) {
+            errno = EINVAL;
+            return -1;
         }
-        if (intervals_overlap(cur_attachment->range, interval)) {
-            status = 1;
-            break;
+        for (i = 0; i < num_addresses; i += 2) {
+            if (addresses[i] > addresses[i + 1]) {
+                errno = EINVAL;
+                return -1;
+            }
+            attachment.range.low = addresses[i];
+            attachment.range.high = addresses[i + 1];
+            list_add(added, &attachment);
         }
+        break;
+    case SEPERATE:
+        addresses = device->get_addresses(device, &num_addresses);
+        for (i = 0; i < num_addresses; ++i) {
+            attachment.range.low = addresses[i];
+            attachment.range.high = addresses[i];
+            list_add(added, &attachment);
+        }
+        break;
+    case REGISTERS:
+        registers = device->get_registers(device, &num_addresses);
+        for (i = 0; i < num_addresses; ++i) {
+            attachment.range.low = registers[i].address;
+            attachment.range.high = registers[i].address;
+            list_add(added, &attachment);
+        }
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
     }
-    return status;
+    return 0;
 }
 
-static int bus_add_attachment(Bus *bus, struct device *device, struct interval interval) {
-    struct bus_attachment attachment;
-    int i;
-    if (bus_contains_interval(bus, interval)) {
-        errno = EINVAL;
-        return -1;
+/* Sorts added and joins neighbouring intervals of the same device */
+static void bus_coalesce_intervals(List *added) {
+    struct bus_attachment *attachments;
+    size_t num_attachments, i, j;
+    list_sort(added, attachment_comparator);
+    attachments = list_get_array(added);
+    num_attachments = list_num_elements(added);
+    for (i = 0, j = 0; i < num_attachments; ++i) {
+        if (j > 0 && attachments[j - 1].device == attachments[i].device &&
+                attachments[j - 1].range.high + 1 == attachments[i].range.low) {
+            attachments[j - 1].range.high = attachments[i].range.high;
+        } else {
+            attachments[j++] = attachments[i];
+        }
     }
-    attachment.range = interval;
-    attachment.device = device;
-    list_add(bus->attachments, &attachment);
-    list_sort(bus->attachments, attachment_comparator);
-    for (i = interval.low; i <= interval.high; ++i) {
-        bus->memory[i].attachment_flag = 1;
+    while (list_num_elements(added) > j) {
+        list_remove(added, list_num_elements(added) - 1);
     }
-    return 0;
+}
 
+/* Lets the bus access a REGISTERS device's plain data registers in place */
+static void bus_map_registers(Bus *bus, struct device *device) {
+    const struct device_register *registers;
+    size_t num_registers, i;
+    registers = device->get_registers(device, &num_registers);
+    for (i = 0; i < num_registers; ++i) {
+        struct bus_slot *slot;
+        slot = bus_new_slot(bus, registers[i].address);
+        slot->value = registers[i].value;
+        if (!(registers[i].flags & DEVICE_REGISTER_READ_HOOK)) {
+            slot->attachment_flag |= ATTACHMENT_DIRECT_READ;
+        }
+        if (!(registers[i].flags & DEVICE_REGISTER_WRITE_HOOK)) {
+            slot->attachment_flag |= ATTACHMENT_DIRECT_WRITE;
+        }
+    }
 }
 
-static int bus_add_attachment_seperate(Bus *bus, struct device *device) {
-    const uint16_t *addresses;
-    size_t num_addresses, i;
-    addresses = device->get_addresses(device, &num_addresses);
-    for (i = 0; i < num_addresses; ++i) {
-        struct interval interval;
-        interval.low = addresses[i];
-        interval.high = addresses[i];
-        if (bus_add_attachment(bus, device, interval) < 0) {
+/* Merges the sorted added intervals into the sorted attachments in one pass. Fails without
+ * changing anything if any two intervals overlap. */
+static int bus_merge_attachments(Bus *bus, List *added) {
+    struct bus_attachment *old, *new, *next, *prev;
+    size_t num_old, num_new, i, j;
+    List *merged;
+    old = list_get_array(bus->attachments);
+    num_old = list_num_elements(bus->attachments);
+    new = list_get_array(added);
+    num_new = list_num_elements(added);
+    merged = list_new(sizeof(struct bus_attachment), num_old + num_new + 1, ATTACHMENT_SIZE_MULTIPLIER, &util_list_allocator);
+    prev = NULL;
+    for (i = 0, j = 0; i < num_old || j < num_new; prev = next) {
+        if (j == num_new || (i < num_old && old[i].range.low < new[j].range.low)) {
+            next = &old[i++];
+        } else {
+            next = &new[j++];
+        }
+        if (prev != NULL && prev->range.high >= next->range.low) {
+            list_free(merged);
+            errno = EINVAL;
             return -1;
         }
+        list_add(merged, next);
+    }
+    list_free(bus->attachments);
+    bus->attachments = merged;
+    for (j = 0; j < num_new; ++j) {
+        bus_fill_slots(bus, &new[j]);
     }
     return 0;
 }
 
-static int bus_add_attachment_range(Bus *bus, struct device *device) {
-    const uint16_t *addresses;
-    size_t num_addresses;
-    struct interval interval;
-    addresses = device->get_addresses(device, &num_addresses);
-    interval.low = addresses[0];
-    interval.high = addresses[1];
-    return bus_add_attachment(bus, device, interval);
+/* Attaches every device or none of them. The devices' register handlers are looked up
+ * once, here. */
+int bus_attach_many(Bus *bus, struct device **devices, size_t num_devices) {
+    List *added;
+    size_t i;
+    int status;
+    added = list_new(sizeof(struct bus_attachment), ATTACHMENT_SIZE_INIT, ATTACHMENT_SIZE_MULTIPLIER, &util_list_allocator);
+    status = 0;
+    for (i = 0; i < num_devices && status == 0; ++i) {
+        status = bus_collect_intervals(devices[i], added);
+    }
+    if (status == 0) {
+        bus_coalesce_intervals(added);
+        status = bus_merge_attachments(bus, added);
+    }
+    for (i = 0; i < num_devices && status == 0; ++i) {
+        if (devices[i]->get_address_method(devices[i]) == REGISTERS) {
+            bus_map_registers(bus, devices[i]);
+        }
+    }
+    list_free(added);
+    return status;
 }
 
 int bus_attach(Bus *bus, struct device *device) {
-    int status = -1;
-    switch (device->get_address_method(device)) {
-    case RANGE:
-        status = bus_add_attachment_range(bus, device);
-        break;
-    case SEPERATE:
-        status = bus_add_attachment_seperate(bus, device);
-        break;        
+    return bus_attach_many(bus, &device, 1);
+}
+
+/* Write hooks stay */
+void bus_remove_all_attachments(Bus *bus) {
+    int i, j, in_use;
+    list_clear(bus->attachments);
+    for (i = 0; i < BUS_NUM_PAGES; ++i) {
+        struct bus_slot *page;
+        page = bus->pages[i];
+        if (page == NULL) {
+            continue;
+        }
+        in_use = 0;
+        for (j = 0; j < BUS_PAGE_SIZE; ++j) {
+            page[j].device = NULL;
+            page[j].value = NULL;
+            page[j].attachment_flag &= ~(ATTACHMENT_DEVICE | ATTACHMENT_DIRECT_READ | ATTACHMENT_DIRECT_WRITE);
+            in_use |= page[j].attachment_flag;
+        }
+        if (!in_use) {
+            free(page);
+            bus->pages[i] = NULL;
+            bus->special_pages[i] = 0;
+        }
     }
-    return status;
 }
 
-static struct bus_attachment *bus_search(Bus *bus, uint16_t address) {
-    return list_bsearch(bus->attachments, &address, bsearch_attachment_comparator);
+static int bus_page_is_zero(const uint16_t *page) {
+    static const uint16_t zero_page[BUS_PAGE_SIZE];
+    return memcmp(page, zero_page, sizeof(zero_page)) == 0;
+}
+
+/* A clean page is as it was at the baseline, or when the bus was made if there is none, and
+ * baseline only keeps pages that weren't zeroes. So the rest are zeroes without looking. */
+static int bus_page_may_be_nonzero(Bus *bus, int page) {
+    return bus->dirty_pages[page] || (bus->baseline != NULL && bus->baseline[page] != NULL);
+}
+
+/* Zeroes every memory address, attachments and write hooks stay. Only pages that may hold
+ * something are written, and they are the ones left dirty. */
+void bus_clear_memory(Bus *bus) {
+    int page, remapped;
+    /* writing zeroes over an image would copy every page of it */
+    remapped = bus->image != NULL && mmap(bus->memory, BUS_MEMORY_SIZE, PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED;
+    if (remapped) {
+        bus_image_release(bus->image);
+        bus->image = NULL;
+    }
+    for (page = 0; page < BUS_NUM_PAGES; ++page) {
+        if (!bus_page_may_be_nonzero(bus, page)) {
+            continue;
+        }
+        if (!remapped) {
+            memset(&bus->memory[page * BUS_PAGE_SIZE], 0, sizeof(uint16_t) * BUS_PAGE_SIZE);
+        }
+        bus->dirty_pages[page] = 1;
+    }
+}
+
+static int bus_image_open(void) {
+#ifdef __linux__
+    return memfd_create("lc3-bus-image", MFD_CLOEXEC);
+#else
+    char path[] = "/tmp/lc3-bus-image-XXXXXX";
+    int fd;
+    fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+    }
+    return fd;
+#endif
+}
+
+/* Copies memory into an image other buses can share with bus_map_image. The image
+ * belongs to the caller, who gives it back with bus_image_free. Returns NULL with errno
+ * set on failure. */
+BusImage *bus_image_new(Bus *bus) {
+    BusImage *image;
+    int fd, saved_errno, page;
+    fd = bus_image_open();
+    if (fd < 0) {
+        return NULL;
+    }
+    /* pages left out read as zeroes and take no space */
+    if (ftruncate(fd, BUS_MEMORY_SIZE) < 0) {
+        goto fail;
+    }
+    for (page = 0; page < BUS_NUM_PAGES; ++page) {
+        if (bus_page_may_be_nonzero(bus, page) && !bus_page_is_zero(&bus->memory[page * BUS_PAGE_SIZE]) &&
+            pwrite(fd, &bus->memory[page * BUS_PAGE_SIZE], sizeof(uint16_t) * BUS_PAGE_SIZE,
+                   sizeof(uint16_t) * page * BUS_PAGE_SIZE) != sizeof(uint16_t) * BUS_PAGE_SIZE) {
+            goto fail;
+        }
+    }
+    image = safe_malloc(sizeof(BusImage));
+    image->fd = fd;
+    image->refs = 1;
+    return image;
+fail:
+    saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return NULL;
+}
+
+/* The image lives on until every bus mapping it is freed or cleared */
+void bus_image_free(BusImage *image) {
+    bus_image_release(image);
+}
+
+/* Replaces memory with a copy on write mapping of image. Pages the bus doesn't write stay
+ * shared with every other bus mapping the image. Write hooks aren't called. Returns -1
+ * with errno set on failure. */
+int bus_map_image(Bus *bus, BusImage *image) {
+    long page_size;
+    page_size = sysconf(_SC_PAGESIZE);
+    if (page_size <= 0 || BUS_MEMORY_SIZE % page_size != 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (mmap(bus->memory, BUS_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+             image->fd, 0) == MAP_FAILED) {
+        return -1;
+    }
+    __atomic_add_fetch(&image->refs, 1, __ATOMIC_RELAXED);
+    bus_image_release(bus->image);
+    bus->image = image;
+    memset(bus->dirty_pages, 1, sizeof(bus->dirty_pages));
+    return 0;
+}
+
+/* memory gets BUS_NUM_ADDRESSES words, device registers read as whatever is under them */
+void bus_copy_memory(Bus *bus, uint16_t *memory) {
+    memcpy(memory, bus->memory, sizeof(bus->memory));
+}
+
+/* Replaces every memory address, without calling write hooks. Pages of memory that are all
+ * zeroes aren't copied and take no space. */
+void bus_set_memory(Bus *bus, const uint16_t *memory) {
+    int page;
+    bus_clear_memory(bus);
+    for (page = 0; page < BUS_NUM_PAGES; ++page) {
+        if (!bus_page_is_zero(&memory[page * BUS_PAGE_SIZE])) {
+            memcpy(&bus->memory[page * BUS_PAGE_SIZE], &memory[page * BUS_PAGE_SIZE],
+                   sizeof(uint16_t) * BUS_PAGE_SIZE);
+            bus->dirty_pages[page] = 1;
+        }
+    }
+}
+
+/* Remembers memory as it is now for bus_restore_baseline, no page is dirty after it. Only
+ * pages with something other than zeroes are kept, and only dirty pages are looked at. */
+void bus_set_baseline(Bus *bus) {
+    int page;
+    if (bus->baseline == NULL) {
+        bus->baseline = safe_malloc(sizeof(uint16_t *) * BUS_NUM_PAGES);
+        memset(bus->baseline, 0, sizeof(uint16_t *) * BUS_NUM_PAGES);
+    }
+    for (page = 0; page < BUS_NUM_PAGES; ++page) {
+        const uint16_t *words;
+        if (!bus->dirty_pages[page]) {
+            continue;
+        }
+        words = &bus->memory[page * BUS_PAGE_SIZE];
+        if (bus_page_is_zero(words)) {
+            free(bus->baseline[page]);
+            bus->baseline[page] = NULL;
+            continue;
+        }
+        if (bus->baseline[page] == NULL) {
+            bus->baseline[page] = safe_malloc(sizeof(uint16_t) * BUS_PAGE_SIZE);
+        }
+        memcpy(bus->baseline[page], words, sizeof(uint16_t) * BUS_PAGE_SIZE);
+    }
+    memset(bus->dirty_pages, 0, sizeof(bus->dirty_pages));
+}
+
+/* Copies the baseline back over every dirty page, without calling write hooks, and calls
+ * restored with data, the first address and the number of words of each one. Only the dirty
+ * pages are touched. */
+void bus_restore_baseline(Bus *bus, void (*restored)(void *, uint16_t, size_t), void *data) {
+    int page;
+    if (bus->baseline == NULL) {
+        return;
+    }
+    for (page = 0; page < BUS_NUM_PAGES; ++page) {
+        uint16_t *words;
+        if (!bus->dirty_pages[page]) {
+            continue;
+        }
+        words = &bus->memory[page * BUS_PAGE_SIZE];
+        if (bus->baseline[page] != NULL) {
+            memcpy(words, bus->baseline[page], sizeof(uint16_t) * BUS_PAGE_SIZE);
+        } else if (!bus_page_is_zero(words)) {
+            memset(words, 0, sizeof(uint16_t) * BUS_PAGE_SIZE);
+        }
+        bus->dirty_pages[page] = 0;
+        restored(data, page * BUS_PAGE_SIZE, BUS_PAGE_SIZE);
+    }
+}
+
+/* func is called with data, the address and the value after every write to a plain memory address */
+void bus_add_write_hook(Bus *bus, uint16_t address, void (*func)(void *, uint16_t, uint16_t), void *data) {
+    struct bus_write_hook hook;
+    if (bus->write_hooks == NULL) {
+        bus->write_hooks = list_new(sizeof(struct bus_write_hook), 1, ATTACHMENT_SIZE_MULTIPLIER, &util_list_allocator);
+    }
+    hook.address = address;
+    hook.func = func;
+    hook.data = data;
+    list_add(bus->write_hooks, &hook);
+    bus_new_slot(bus, address)->attachment_flag |= ATTACHMENT_WRITE_HOOK;
+}
+
+static void bus_call_write_hooks(Bus *bus, uint16_t address, uint16_t value) {
+    size_t num_hooks, i;
+    num_hooks = list_num_elements(bus->write_hooks);
+    for (i = 0; i < num_hooks; ++i) {
+        struct bus_write_hook *hook;
+        hook = list_get(bus->write_hooks, i);
+        if (hook->address == address) {
+            hook->func(hook->data, address, value);
+        }
+    }
+}
+
+/* 0 for plain memory */
+static char bus_attachment_flag(Bus *bus, uint16_t address) {
+    struct bus_slot *page;
+    page = bus->pages[BUS_PAGE(address)];
+    return page == NULL ? 0 : page[BUS_SLOT(address)].attachment_flag;
 }
 
 void bus_print(Bus *bus) {
@@ -164,35 +548,72 @@ void bus_print(Bus *bus) {
 }
 
 int bus_is_device_register(Bus *bus, uint16_t address) {
-    return bus->memory[address].attachment_flag;
+    return (bus_attachment_flag(bus, address) & ATTACHMENT_DEVICE) != 0;
 }
 
 uint16_t bus_read_memory(Bus *bus, uint16_t address) {
-    return bus->memory[address].value;
+    return bus->memory[address];
+}
+
+/* Stores to plain memory without calling write hooks or the write log */
+void bus_write_memory(Bus *bus, uint16_t address, uint16_t value) {
+    bus->memory[address] = value;
+    bus->dirty_pages[BUS_PAGE(address)] = 1;
+}
+
+/* log is called with data, the address and the word there before each bus_write to plain
+ * memory. NULL stops it. */
+void bus_set_write_log(Bus *bus, void (*log)(void *, uint16_t, uint16_t), void *data) {
+    bus->write_log = log;
+    bus->write_log_data = data;
+}
+
+/* Word a is memory[a]. Accesses to any address in a page (a >> page_bits) whose
+ * special_pages byte is set have to go through bus_read and bus_write. Stores that don't
+ * set the page's dirty_pages byte to 1. special_pages and dirty_pages sit right after
+ * memory. */
+void bus_get_direct_map(Bus *bus, uint16_t **memory, const unsigned char **special_pages,
+                        unsigned char **dirty_pages, unsigned *page_bits) {
+    *memory = bus->memory;
+    *special_pages = bus->special_pages;
+    *dirty_pages = bus->dirty_pages;
+    *page_bits = BUS_PAGE_BITS;
 }
 
 uint16_t bus_read(Bus *bus, uint16_t address) {
-    struct mem *mem_val;
+    struct bus_slot *page;
     uint16_t value;
-    mem_val = &bus->memory[address];
-    if (mem_val->attachment_flag) {
-        struct bus_attachment *attachment;
-        attachment = bus_search(bus, address);
-        value = attachment->device->read_register(attachment->device, address);
+    page = bus->pages[BUS_PAGE(address)];
+    if (page != NULL && (page[BUS_SLOT(address)].attachment_flag & ATTACHMENT_DEVICE)) {
+        struct bus_slot *slot;
+        slot = &page[BUS_SLOT(address)];
+        if (slot->attachment_flag & ATTACHMENT_DIRECT_READ) {
+            value = *slot->value;
+        } else {
+            value = slot->read_register(slot->device, address);
+        }
     } else {
-        value = mem_val->value;
+        value = bus->memory[address];
     }
     return value;
 }
 
 void bus_write(Bus *bus, uint16_t address, uint16_t value) {
-    struct mem *mem_val;
-    mem_val = &bus->memory[address];
-    if (mem_val->attachment_flag) {
-        struct bus_attachment *attachment;
-        attachment = bus_search(bus, address);
-        attachment->device->write_register(attachment->device, address, value);
+    struct bus_slot *page, *slot;
+    page = bus->pages[BUS_PAGE(address)];
+    slot = page == NULL ? NULL : &page[BUS_SLOT(address)];
+    if (slot != NULL && (slot->attachment_flag & ATTACHMENT_DIRECT_WRITE)) {
+        *slot->value = value;
+    } else if (slot != NULL && (slot->attachment_flag & ATTACHMENT_DEVICE)) {
+        slot->write_register(slot->device, address, value);
     } else {
-        mem_val->value = value;
+        if (bus->write_log != NULL) {
+            bus->write_log(bus->write_log_data, address, bus->memory[address]);
+        }
+        bus->memory[address] = value;
+        bus->dirty_pages[BUS_PAGE(address)] = 1;
+        if (slot != NULL && (slot->attachment_flag & ATTACHMENT_WRITE_HOOK)) {
+            bus_call_write_hooks(bus, address, value);
+        }
     }
-}
\ No newline at end of file
+}
@@ -10,17 +10,33 @@
 struct bus_impl;
 typedef struct bus_impl Bus;
 
+struct bus_image;
+typedef struct bus_image BusImage;
+
 Bus *bus_new(void);
 void bus_free(Bus *);
 
 void bus_print(Bus *);
 
 int bus_attach(Bus *, struct device *);
+int bus_attach_many(Bus *, struct device **, size_t);
 
-/*void bus_remove_all_attachments(Bus *bus);*/
+void bus_remove_all_attachments(Bus *bus);
+void bus_clear_memory(Bus *);
+BusImage *bus_image_new(Bus *);
+void bus_image_free(BusImage *);
+int bus_map_image(Bus *, BusImage *);
+void bus_copy_memory(Bus *, uint16_t *);
+void bus_set_memory(Bus *, const uint16_t *);
 
 int bus_is_device_register(Bus *, uint16_t);
 uint16_t bus_read_memory(Bus *, uint16_t);
+void bus_write_memory(Bus *, uint16_t, uint16_t);
+void bus_set_write_log(Bus *, void (*)(void *, uint16_t, uint16_t), void *);
+void bus_get_direct_map(Bus *, uint16_t **, const unsigned char **, unsigned char **, unsigned *);
+void bus_set_baseline(Bus *);
+void bus_restore_baseline(Bus *, void (*)(void *, uint16_t, size_t), void *);
+void bus_add_write_hook(Bus *, uint16_t, void (*)(void *, uint16_t, uint16_t), void *);
 
 uint16_t bus_read(Bus *, uint16_t);
 void bus_write(Bus *, uint16_t, uint16_t);
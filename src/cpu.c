@@ -13,40 +13,12 @@
 #include <time.h>
 
 #include "cpu.h"
+#include "jit.h"
+#include "lc3_instruction.h"
 #include "lc3_reg.h"
 #include "util.h"
 
-#define ADD      0x1
-#define AND      0x5
-#define BR       0x0
-#define JMP_RET  0xC
-#define JSR_JSRR 0x4
-#define LD       0x2
-#define LDI      0xA
-#define LDR      0x6
-#define LEA      0xE
-#define NOT      0x9
-#define RTI      0x8
-#define ST       0x3
-#define STI      0xB
-#define STR      0x7
-#define TRAP     0xF
-
-#define OPCODE(instruction)      ((instruction) >> 12)
-#define REG1_INSTRU(instruction) (((instruction) >> 9) & 0x0007)
-#define REG2_INSTRU(instruction) (((instruction) >> 6) & 0x0007)
-#define REG3_INSTRU(instruction) ((instruction) & 0x0007)
-#define IMM5(instruction)        ((instruction) & 0x001F)
-#define PCOFFSET9(instruction)   ((instruction) & 0x01FF)
-#define PCOFFSET11(instruction)  ((instruction) & 0x07FF)
-#define OFFSET6(instruction)     ((instruction) & 0x003F)
-#define N_INSTRU(instruction)    ((instruction) & 0x0800)
-#define Z_INSTRU(instruction)    ((instruction) & 0x0400)
-#define P_INSTRU(instruction)    ((instruction) & 0x0200)
-#define NZP_INSTRU(instruction)  ((instruction) >> 9)
 #define NZP_PSR(value)           ((value) & 0x0007)
-#define TRAPVECT8(instruction)   ((instruction) & 0x00FF)
-
 #define NZP_PSR_CLEAR_MASK       0xFFF8
 #define SET_PSR_P_MASK           0x0001
 #define SET_PSR_Z_MASK           0x0002
@@ -61,20 +33,80 @@
 #define INTERRUPT_VECTOR_TABLE 0x0100
 #define SUPERVISOR_STACK_HIGH  0x2FFF
 
-#define IS_IMM5(instruction) (((instruction) >> 5) & 0x0001)
-#define IS_JSR(instruction)  (((instruction) >> 11) & 0x0001)
-
 #define PRIORITY_CMP(psr, priority) ((0x0007 & ((psr) >> 8)) > priority)
 #define PSR_PRIORITY(psr) (0x0007 & ((psr) >> 8))
 
 #define PRIV_MODE_VIOLATION_EXCEPTION_VECTOR 0x00
 #define ILLEGAL_OPCODE_EXCEPTION_VECTOR      0x01
 
-#define MCR_ADDR 0xFFFE
+/* sign extended PCoffset9 of a branch back to the instruction before it */
+#define POLL_BRANCH_OFFSET     0xFFFE
+/* unchanged reads of the same device register before a polling loop counts as idle */
+#define POLL_IDLE_ITERATIONS   16
+
+/* os service routines run natively, see struct fast_trap */
+#define FAST_TRAP_LOW_VECTOR 0x20
+#define FAST_TRAP_MAX_CHARS  0x10000
+
+#define BREAKPOINT_BYTE(address) ((address) >> 3)
+#define BREAKPOINT_BIT(address)  (1 << ((address) & 0x0007))
+
+#define DECODE_PAGE_SIZE  256
+#define DECODE_NUM_PAGES  (UINT16_MAX / DECODE_PAGE_SIZE + 1)
+#define DECODE_PAGE(address)   ((address) >> 8)
+#define DECODE_OFFSET(address) ((address) & 0x00FF)
+
+/* Dispatch through label addresses where the compiler supports it, a switch otherwise */
+#if defined(__GNUC__) && !defined(CPU_NO_COMPUTED_GOTO)
+#define CPU_COMPUTED_GOTO
+#endif
 
-typedef void (*instru_func)(Cpu *, uint16_t);
 typedef int (*exception_line)(uint8_t *); 
 
+enum cpu_op {
+   OP_NONE,
+   OP_ADD_REG,
+   OP_ADD_IMM,
+   OP_AND_REG,
+   OP_AND_IMM,
+   OP_BR,
+   OP_JMP_RET,
+   OP_JSR,
+   OP_JSRR,
+   OP_LD,
+   OP_LDI,
+   OP_LDR,
+   OP_LEA,
+   OP_NOT,
+   OP_RTI,
+   OP_ST,
+   OP_STI,
+   OP_STR,
+   OP_TRAP,
+   OP_ILLEGAL,
+   OP_BREAKPOINT,
+   num_cpu_ops
+};
+
+/* An instruction with its operand fields already extracted. op is OP_NONE while the slot is empty */
+struct decoded_instruction {
+#ifdef CPU_COMPUTED_GOTO
+   const void *handler; /* the op's label in cpu_interpret */
+#endif
+   uint16_t offset; /* sign extended imm5, offset6, PCoffset9 or PCoffset11, or trapvect8 */
+   uint8_t op;
+   uint8_t dr;
+   uint8_t sr1;
+   uint8_t sr2;
+   uint8_t nzp;
+};
+
+struct cpu_poll {
+   uint16_t pc;
+   uint16_t value;
+   int count;
+};
+
 struct cpu_exception {
    int toggle;
    uint8_t vec_location;
@@ -85,10 +117,43 @@ struct cpu {
    struct cpu_exception priv_mode_violation_exception_line;
    struct cpu_exception illegal_opcode_exception_line;
    uint16_t registers[num_registers];
+   /* While cc_lazy is set the NZP bits in the psr are stale and follow from cc_result */
+   uint16_t cc_result;
+   int cc_lazy;
+   /* decode cache, one lazily allocated page of entries per 256 addresses */
+   struct decoded_instruction *decode_pages[DECODE_NUM_PAGES];
+   /* used for instructions fetched from device registers, which are never cached */
+   struct decoded_instruction uncached;
+   int clock_enabled; /* bit 15 of the mcr, kept current through cpu_write_mcr */
+   struct cpu_poll poll; /* the polling loop seen last */
+   uint8_t *breakpoints; /* bitmap, NULL until the first breakpoint is set */
+   int breakpoint_hit; /* the last run stopped at the breakpoint at pc, the next one passes it */
+   unsigned long long retired; /* instructions executed so far */
+   int trap_acceleration;
+   unsigned long long accelerated_traps; /* each counted as the one trap instruction retired */
+   Jit *jit; /* NULL unless the jit engine is selected */
+   void (*recorder)(void *, const struct cpu_state *); /* NULL unless recording */
+   void *recorder_data;
 };
 
-static instru_func instru_func_vec[16];
-static int instructions_loaded = 0;
+static const uint8_t opcode_ops[16] = {
+   [ADD]      = OP_ADD_REG,
+   [AND]      = OP_AND_REG,
+   [BR]       = OP_BR,
+   [JMP_RET]  = OP_JMP_RET,
+   [JSR_JSRR] = OP_JSRR,
+   [LD]       = OP_LD,
+   [LDI]      = OP_LDI,
+   [LDR]      = OP_LDR,
+   [LEA]      = OP_LEA,
+   [NOT]      = OP_NOT,
+   [RTI]      = OP_RTI,
+   [RESERVED] = OP_ILLEGAL,
+   [ST]       = OP_ST,
+   [STI]      = OP_STI,
+   [STR]      = OP_STR,
+   [TRAP]     = OP_TRAP
+};
 
 static void setup_exceptions(Cpu *cpu) {
    cpu->priv_mode_violation_exception_line.vec_location = PRIV_MODE_VIOLATION_EXCEPTION_VECTOR;
@@ -97,9 +162,30 @@ static void setup_exceptions(Cpu *cpu) {
    cpu->illegal_opcode_exception_line.toggle = 0;
 }
 
+static int cpu_has_breakpoint(Cpu *cpu, uint16_t address) {
+   return cpu->breakpoints != NULL && (cpu->breakpoints[BREAKPOINT_BYTE(address)] & BREAKPOINT_BIT(address));
+}
+
+static void cpu_invalidate_decoded(Cpu *cpu, uint16_t address) {
+   struct decoded_instruction *page;
+   page = cpu->decode_pages[DECODE_PAGE(address)];
+   if (page != NULL) {
+      page[DECODE_OFFSET(address)].op = OP_NONE;
+   }
+   if (cpu->jit != NULL) {
+      jit_invalidate(cpu->jit, address);
+   }
+}
+
+/* Every store the cpu makes goes through here so the decode cache never goes stale */
+static void cpu_bus_write(Cpu *cpu, uint16_t address, uint16_t value) {
+   cpu_invalidate_decoded(cpu, address);
+   cpu->bus_access->write(cpu->bus_access, address, value);
+}
+
 static void supervisor_stack_push(Cpu *cpu, uint16_t data) {
    cpu->registers[REG_R6] -= 1;
-   cpu->bus_access->write(cpu->bus_access, cpu->registers[REG_R6], data);
+   cpu_bus_write(cpu, cpu->registers[REG_R6], data);
 }
 
 static uint16_t supervisor_stack_pop(Cpu *cpu) {
@@ -119,166 +205,448 @@ static uint16_t sign_extend(uint16_t value, int num_bits) {
 }
 
 static void set_condition_code(Cpu *cpu, int reg) {
-   int16_t val = cpu->registers[reg];
-   cpu->registers[REG_PSR] &= NZP_PSR_CLEAR_MASK;
+   cpu->cc_result = cpu->registers[reg];
+   cpu->cc_lazy = 1;
+}
+
+static unsigned condition_code(uint16_t result) {
+   int16_t val = result;
    if (val > 0) {
-      cpu->registers[REG_PSR] |= SET_PSR_P_MASK;
+      return SET_PSR_P_MASK;
    } else if (val < 0) {
-      cpu->registers[REG_PSR] |= SET_PSR_N_MASK;
-   } else {
-      cpu->registers[REG_PSR] |= SET_PSR_Z_MASK;
+      return SET_PSR_N_MASK;
    }
+   return SET_PSR_Z_MASK;
 }
 
-static void add_and(Cpu *cpu, uint16_t instruction) {
-   int dest = REG1_INSTRU(instruction);
-   uint16_t sr1_val = cpu->registers[REG2_INSTRU(instruction)];
-   uint16_t sr2_val;
-   if (IS_IMM5(instruction)) {
-      sr2_val = sign_extend(IMM5(instruction), 5);
-   } else {
-      sr2_val = cpu->registers[REG3_INSTRU(instruction)];
+static unsigned cpu_nzp(Cpu *cpu) {
+   if (cpu->cc_lazy) {
+      return condition_code(cpu->cc_result);
    }
-   if (OPCODE(instruction) == ADD) { 
-      cpu->registers[dest] = sr1_val + sr2_val;
-   } else if (OPCODE(instruction) == AND) {
-      cpu->registers[dest] = sr1_val & sr2_val;
+   return NZP_PSR(cpu->registers[REG_PSR]);
+}
+
+/* Brings the NZP bits in the psr up to date before anything outside the alu looks at it */
+static void cpu_sync_psr(Cpu *cpu) {
+   if (cpu->cc_lazy) {
+      cpu->registers[REG_PSR] &= NZP_PSR_CLEAR_MASK;
+      cpu->registers[REG_PSR] |= condition_code(cpu->cc_result);
+      cpu->cc_lazy = 0;
    }
-   set_condition_code(cpu, dest);
 }
 
-static void br(Cpu *cpu, uint16_t instruction) {
-   uint16_t pc_offset;
-   unsigned nzp_instru = NZP_INSTRU(instruction);
-   unsigned nzp_psr    = NZP_PSR(cpu->registers[REG_PSR]);
-   if (nzp_instru & nzp_psr) {
-      pc_offset = sign_extend(PCOFFSET9(instruction), 9);
-      cpu->registers[REG_PC] += pc_offset;
+static void add_reg(Cpu *cpu, const struct decoded_instruction *decoded) {
+   cpu->registers[decoded->dr] = cpu->registers[decoded->sr1] + cpu->registers[decoded->sr2];
+   set_condition_code(cpu, decoded->dr);
+}
+
+static void add_imm(Cpu *cpu, const struct decoded_instruction *decoded) {
+   cpu->registers[decoded->dr] = cpu->registers[decoded->sr1] + decoded->offset;
+   set_condition_code(cpu, decoded->dr);
+}
+
+static void and_reg(Cpu *cpu, const struct decoded_instruction *decoded) {
+   cpu->registers[decoded->dr] = cpu->registers[decoded->sr1] & cpu->registers[decoded->sr2];
+   set_condition_code(cpu, decoded->dr);
+}
+
+static void and_imm(Cpu *cpu, const struct decoded_instruction *decoded) {
+   cpu->registers[decoded->dr] = cpu->registers[decoded->sr1] & decoded->offset;
+   set_condition_code(cpu, decoded->dr);
+}
+
+static int br(Cpu *cpu, const struct decoded_instruction *decoded) {
+   if (decoded->nzp & cpu_nzp(cpu)) {
+      cpu->registers[REG_PC] += decoded->offset;
+      return 1;
    }
+   return 0;
 }
 
-static void jmp_ret(Cpu *cpu, uint16_t instruction) {
-   cpu->registers[REG_PC] = cpu->registers[REG2_INSTRU(instruction)];
+static void jmp_ret(Cpu *cpu, const struct decoded_instruction *decoded) {
+   cpu->registers[REG_PC] = cpu->registers[decoded->sr1];
 }
 
-static void jsr_jsrr(Cpu *cpu, uint16_t instruction) {
+static void jsr(Cpu *cpu, const struct decoded_instruction *decoded) {
+   cpu->registers[REG_R7] = cpu->registers[REG_PC];
+   cpu->registers[REG_PC] += decoded->offset;
+}
+
+static void jsrr(Cpu *cpu, const struct decoded_instruction *decoded) {
    uint16_t new_pc;
+   new_pc = cpu->registers[REG_PC] + cpu->registers[decoded->sr1];
    cpu->registers[REG_R7] = cpu->registers[REG_PC];
-   if (IS_JSR(instruction)) {
-      new_pc = cpu->registers[REG_PC] + sign_extend(PCOFFSET11(instruction), 11);
-   } else {
-      new_pc = cpu->registers[REG_PC] + cpu->registers[REG2_INSTRU(instruction)];
-   }
    cpu->registers[REG_PC] = new_pc;
 }
 
-static uint16_t compute_direct_address(Cpu *cpu, uint16_t instruction) {
-   return cpu->registers[REG_PC] + sign_extend(PCOFFSET9(instruction), 9);
+static uint16_t compute_direct_address(Cpu *cpu, const struct decoded_instruction *decoded) {
+   return cpu->registers[REG_PC] + decoded->offset;
 }
 
-static uint16_t compute_indirect_address(Cpu *cpu, uint16_t instruction) {
-   uint16_t pc_offset;
-   pc_offset = sign_extend(PCOFFSET9(instruction), 9);
-   return cpu->bus_access->read(cpu->bus_access, cpu->registers[REG_PC] + pc_offset);
+static uint16_t compute_indirect_address(Cpu *cpu, const struct decoded_instruction *decoded) {
+   return cpu->bus_access->read(cpu->bus_access, cpu->registers[REG_PC] + decoded->offset);
 }
 
-static uint16_t compute_base_plus_offset(Cpu *cpu, uint16_t instruction) {
-   uint16_t off_set = sign_extend(OFFSET6(instruction), 6);
-   return cpu->registers[REG2_INSTRU(instruction)] + off_set;
+static uint16_t compute_base_plus_offset(Cpu *cpu, const struct decoded_instruction *decoded) {
+   return cpu->registers[decoded->sr1] + decoded->offset;
 }
 
-static void ld(Cpu *cpu, uint16_t instruction) {
-   int dr;
-   uint16_t addr;
-   dr = REG1_INSTRU(instruction);
-   addr = compute_direct_address(cpu, instruction);
-   cpu->registers[dr] = cpu->bus_access->read(cpu->bus_access, addr);
-   set_condition_code(cpu, dr);
+static void ld(Cpu *cpu, const struct decoded_instruction *decoded) {
+   uint16_t addr = compute_direct_address(cpu, decoded);
+   cpu->registers[decoded->dr] = cpu->bus_access->read(cpu->bus_access, addr);
+   set_condition_code(cpu, decoded->dr);
 }
 
-static void ldi(Cpu *cpu, uint16_t instruction) {
-   uint16_t addr = compute_indirect_address(cpu, instruction);
-   int dr = REG1_INSTRU(instruction);
-   cpu->registers[dr] = cpu->bus_access->read(cpu->bus_access, addr);
-   set_condition_code(cpu,dr);
+static void ldi(Cpu *cpu, const struct decoded_instruction *decoded) {
+   uint16_t addr = compute_indirect_address(cpu, decoded);
+   cpu->registers[decoded->dr] = cpu->bus_access->read(cpu->bus_access, addr);
+   set_condition_code(cpu, decoded->dr);
 }
 
-static void ldr(Cpu *cpu, uint16_t instruction) {
-   uint16_t addr = compute_base_plus_offset(cpu, instruction);
-   int dr = REG1_INSTRU(instruction);
-   cpu->registers[dr] = cpu->bus_access->read(cpu->bus_access, addr);
-   set_condition_code(cpu, dr);
+static void ldr(Cpu *cpu, const struct decoded_instruction *decoded) {
+   uint16_t addr = compute_base_plus_offset(cpu, decoded);
+   cpu->registers[decoded->dr] = cpu->bus_access->read(cpu->bus_access, addr);
+   set_condition_code(cpu, decoded->dr);
 }
 
-static void lea(Cpu *cpu, uint16_t instruction) {
-   int dr = REG1_INSTRU(instruction);
-   cpu->registers[dr] = compute_direct_address(cpu, instruction);
-   set_condition_code(cpu, dr);
+static void lea(Cpu *cpu, const struct decoded_instruction *decoded) {
+   cpu->registers[decoded->dr] = compute_direct_address(cpu, decoded);
+   set_condition_code(cpu, decoded->dr);
 }
 
-static void not(Cpu *cpu, uint16_t instruction) {
-   int dr = REG1_INSTRU(instruction);
-   int sr = REG2_INSTRU(instruction);
-   cpu->registers[dr] = ~(cpu->registers[sr]);
-   set_condition_code(cpu, dr);
+static void not(Cpu *cpu, const struct decoded_instruction *decoded) {
+   cpu->registers[decoded->dr] = ~(cpu->registers[decoded->sr1]);
+   set_condition_code(cpu, decoded->dr);
 }
 
-static void rti(Cpu *cpu, uint16_t instruction) {
+static void rti(Cpu *cpu, const struct decoded_instruction *decoded) {
    if (SUPERVISOR_BIT(cpu->registers[REG_PSR])) {
       cpu->priv_mode_violation_exception_line.toggle = 1;
       return;
    }
    cpu->registers[REG_PC] = supervisor_stack_pop(cpu);
    cpu->registers[REG_PSR] = supervisor_stack_pop(cpu);
+   cpu->cc_lazy = 0;
    if (!SUPERVISOR_BIT(cpu->registers[REG_PSR])) {
       cpu->registers[REG_R6] = cpu->registers[REG_USP];
    }
 }
 
-static void st(Cpu *cpu, uint16_t instruction) {
-   int sr = REG1_INSTRU(instruction);
-   uint16_t addr = compute_direct_address(cpu, instruction);
-   cpu->bus_access->write(cpu->bus_access, addr, cpu->registers[sr]);
+static void st(Cpu *cpu, const struct decoded_instruction *decoded) {
+   uint16_t addr = compute_direct_address(cpu, decoded);
+   cpu_bus_write(cpu, addr, cpu->registers[decoded->dr]);
 }
 
-static void sti(Cpu *cpu, uint16_t instruction) {
-   uint16_t addr = compute_indirect_address(cpu, instruction);
-   int sr = REG1_INSTRU(instruction);
-   cpu->bus_access->write(cpu->bus_access, addr, cpu->registers[sr]);
+static void sti(Cpu *cpu, const struct decoded_instruction *decoded) {
+   uint16_t addr = compute_indirect_address(cpu, decoded);
+   cpu_bus_write(cpu, addr, cpu->registers[decoded->dr]);
 }
 
-static void str(Cpu *cpu, uint16_t instruction) {
-   uint16_t addr = compute_base_plus_offset(cpu, instruction);
-   int sr = REG1_INSTRU(instruction);
-   cpu->bus_access->write(cpu->bus_access, addr, cpu->registers[sr]);
+static void str(Cpu *cpu, const struct decoded_instruction *decoded) {
+   uint16_t addr = compute_base_plus_offset(cpu, decoded);
+   cpu_bus_write(cpu, addr, cpu->registers[decoded->dr]);
 }
 
-static void trap(Cpu *cpu, uint16_t instruction) {
-   uint16_t trapvector = TRAPVECT8(instruction);
-   if (trapvector > 0x00FF) {
-      /* ERROR */
-   }
+static void trap(Cpu *cpu, const struct decoded_instruction *decoded) {
    cpu->registers[REG_R7] = cpu->registers[REG_PC];
-   cpu->registers[REG_PC] = cpu->bus_access->read(cpu->bus_access, trapvector);
+   cpu->registers[REG_PC] = cpu->bus_access->read(cpu->bus_access, decoded->offset);
    /*psr &= 0x7FFF; mabye*/
 }
 
-static void load_instructions(void) {
-   instru_func_vec[ADD]      = add_and;
-   instru_func_vec[AND]      = add_and;
-   instru_func_vec[BR]       = br;
-   instru_func_vec[JMP_RET]  = jmp_ret;
-   instru_func_vec[JSR_JSRR] = jsr_jsrr; 
-   instru_func_vec[LD]       = ld;
-   instru_func_vec[LDI]      = ldi;
-   instru_func_vec[LDR]      = ldr;
-   instru_func_vec[LEA]      = lea;
-   instru_func_vec[NOT]      = not;
-   instru_func_vec[RTI]      = rti;
-   instru_func_vec[ST]       = st;
-   instru_func_vec[STI]      = sti;
-   instru_func_vec[STR]      = str;
-   instru_func_vec[TRAP]     = trap;
+/* A service routine of os.obj, recognized by its exact words wherever the trap vector points.
+ * run does what executing it would, reading the addresses and saved registers it uses from
+ * memory. When a device isn't ready it leaves the pc on the routine's own polling loop, with
+ * the registers as the loop would have them, so the program waits there as before. */
+struct fast_trap {
+   const uint16_t *routine;
+   int length;
+   void (*run)(Cpu *, uint16_t);
+};
+
+/* address an LD, LDI, ST or STI at index in the routine starting at start refers to */
+static uint16_t fast_trap_operand(const uint16_t *routine, uint16_t start, int index) {
+   return start + index + 1 + sign_extend(routine[index] & 0x01FF, 9);
+}
+
+/* plain memory word, 0 if address has to go through the bus */
+static int cpu_direct_read(Cpu *cpu, uint16_t address, uint16_t *value) {
+   const struct bus_direct_map *map;
+   map = &cpu->bus_access->direct_map;
+   if (map->memory == NULL || map->special_pages[address >> map->page_bits]) {
+      return 0;
+   }
+   *value = map->memory[address];
+   return 1;
+}
+
+static uint16_t cpu_read_word(Cpu *cpu, uint16_t address) {
+   uint16_t value;
+   if (!cpu_direct_read(cpu, address, &value)) {
+      value = cpu->bus_access->read(cpu->bus_access, address);
+   }
+   return value;
+}
+
+static uint16_t cpu_read_indirect(Cpu *cpu, uint16_t address) {
+   return cpu_read_word(cpu, cpu_read_word(cpu, address));
+}
+
+static const uint16_t getc_routine[] = {0xA018, 0x07FE, 0xA017, 0xC1C0};
+static const uint16_t out_routine[] = {0x3219, 0xA215, 0x07FD, 0xB014, 0x2215, 0xC1C0};
+static const uint16_t puts_routine[] = {0x3213, 0x3413, 0x6200, 0x0405, 0xA40C, 0x07FE,
+                                        0xB20B, 0x1021, 0x0FF9, 0x220A, 0x240A, 0xC1C0};
+static const uint16_t halt_routine[] = {0x5020, 0xB005, 0xC1C0};
+
+static void fast_getc(Cpu *cpu, uint16_t start) {
+   uint16_t *registers = cpu->registers;
+   registers[REG_R0] = cpu_read_indirect(cpu, fast_trap_operand(getc_routine, start, 0));
+   set_condition_code(cpu, REG_R0);
+   if (!(registers[REG_R0] & 0x8000)) {
+      registers[REG_PC] = start + 1;
+      return;
+   }
+   registers[REG_R0] = cpu_read_indirect(cpu, fast_trap_operand(getc_routine, start, 2));
+   set_condition_code(cpu, REG_R0);
+   registers[REG_PC] = registers[REG_R7];
+}
+
+static void fast_out(Cpu *cpu, uint16_t start) {
+   uint16_t *registers = cpu->registers;
+   cpu_bus_write(cpu, fast_trap_operand(out_routine, start, 0), registers[REG_R1]);
+   registers[REG_R1] = cpu_read_indirect(cpu, fast_trap_operand(out_routine, start, 1));
+   set_condition_code(cpu, REG_R1);
+   if (!(registers[REG_R1] & 0x8000)) {
+      registers[REG_PC] = start + 2;
+      return;
+   }
+   cpu_bus_write(cpu, cpu_read_word(cpu, fast_trap_operand(out_routine, start, 3)),
+                 registers[REG_R0]);
+   if (!cpu->clock_enabled) {
+      registers[REG_PC] = start + 4;
+      return;
+   }
+   registers[REG_R1] = cpu_read_word(cpu, fast_trap_operand(out_routine, start, 4));
+   set_condition_code(cpu, REG_R1);
+   registers[REG_PC] = registers[REG_R7];
+}
+
+static void fast_puts(Cpu *cpu, uint16_t start) {
+   uint16_t *registers = cpu->registers;
+   uint16_t display_status, display_data;
+   long i;
+   cpu_bus_write(cpu, fast_trap_operand(puts_routine, start, 0), registers[REG_R1]);
+   cpu_bus_write(cpu, fast_trap_operand(puts_routine, start, 1), registers[REG_R2]);
+   display_status = fast_trap_operand(puts_routine, start, 4);
+   display_data = fast_trap_operand(puts_routine, start, 6);
+   for (i = 0; i < FAST_TRAP_MAX_CHARS; ++i) {
+      registers[REG_R1] = cpu_read_word(cpu, registers[REG_R0]);
+      set_condition_code(cpu, REG_R1);
+      if (registers[REG_R1] == 0) {
+         registers[REG_R1] = cpu_read_word(cpu, fast_trap_operand(puts_routine, start, 9));
+         registers[REG_R2] = cpu_read_word(cpu, fast_trap_operand(puts_routine, start, 10));
+         set_condition_code(cpu, REG_R2);
+         registers[REG_PC] = registers[REG_R7];
+         return;
+      }
+      registers[REG_R2] = cpu_read_indirect(cpu, display_status);
+      set_condition_code(cpu, REG_R2);
+      if (!(registers[REG_R2] & 0x8000)) {
+         registers[REG_PC] = start + 5;
+         return;
+      }
+      cpu_bus_write(cpu, cpu_read_word(cpu, display_data), registers[REG_R1]);
+      if (!cpu->clock_enabled) {
+         registers[REG_PC] = start + 7;
+         return;
+      }
+      ++registers[REG_R0];
+      set_condition_code(cpu, REG_R0);
+   }
+   /* no terminator in sight, let the routine go on from the top of its loop */
+   registers[REG_PC] = start + 2;
+}
+
+static void fast_halt(Cpu *cpu, uint16_t start) {
+   uint16_t *registers = cpu->registers;
+   registers[REG_R0] = 0;
+   set_condition_code(cpu, REG_R0);
+   cpu_bus_write(cpu, cpu_read_word(cpu, fast_trap_operand(halt_routine, start, 1)),
+                 registers[REG_R0]);
+   registers[REG_PC] = cpu->clock_enabled ? registers[REG_R7] : start + 2;
+}
+
+/* indexed by trap vector - FAST_TRAP_LOW_VECTOR, IN and PUTSP aren't in os.obj */
+static const struct fast_trap fast_traps[] = {
+   {getc_routine, sizeof(getc_routine) / sizeof(uint16_t), fast_getc},
+   {out_routine, sizeof(out_routine) / sizeof(uint16_t), fast_out},
+   {puts_routine, sizeof(puts_routine) / sizeof(uint16_t), fast_puts},
+   {NULL, 0, NULL},
+   {NULL, 0, NULL},
+   {halt_routine, sizeof(halt_routine) / sizeof(uint16_t), fast_halt}
+};
+
+/* Runs the trap's service routine natively if it is one of os.obj's and has no breakpoint in
+ * it. Returns 0, having done nothing, otherwise. */
+static int cpu_fast_trap(Cpu *cpu, uint16_t vector) {
+   const struct fast_trap *fast;
+   uint16_t start, word;
+   int i;
+   if (vector < FAST_TRAP_LOW_VECTOR ||
+       vector - FAST_TRAP_LOW_VECTOR >= (int)(sizeof(fast_traps) / sizeof(fast_traps[0]))) {
+      return 0;
+   }
+   fast = &fast_traps[vector - FAST_TRAP_LOW_VECTOR];
+   if (fast->routine == NULL || !cpu_direct_read(cpu, vector, &start)) {
+      return 0;
+   }
+   for (i = 0; i < fast->length; ++i) {
+      if (!cpu_direct_read(cpu, start + i, &word) || word != fast->routine[i] ||
+          cpu_has_breakpoint(cpu, start + i)) {
+         return 0;
+      }
+   }
+   cpu->registers[REG_R7] = cpu->registers[REG_PC];
+   fast->run(cpu, start);
+   ++cpu->accelerated_traps;
+   return 1;
+}
+
+static void illegal_opcode(Cpu *cpu, const struct decoded_instruction *decoded) {
+   cpu->illegal_opcode_exception_line.toggle = 1;
+}
+
+static void decode_instruction(uint16_t instruction, struct decoded_instruction *decoded,
+                               const void *const *handlers) {
+   int opcode;
+   opcode = OPCODE(instruction);
+   decoded->op = opcode_ops[opcode];
+   decoded->dr = REG1_INSTRU(instruction);
+   decoded->sr1 = REG2_INSTRU(instruction);
+   decoded->sr2 = REG3_INSTRU(instruction);
+   decoded->nzp = NZP_PSR(NZP_INSTRU(instruction));
+   decoded->offset = 0;
+   switch (opcode) {
+   case ADD:
+   case AND:
+      if (IS_IMM5(instruction)) {
+         decoded->op = opcode == ADD ? OP_ADD_IMM : OP_AND_IMM;
+         decoded->offset = sign_extend(IMM5(instruction), 5);
+      }
+      break;
+   case JSR_JSRR:
+      if (IS_JSR(instruction)) {
+         decoded->op = OP_JSR;
+         decoded->offset = sign_extend(PCOFFSET11(instruction), 11);
+      }
+      break;
+   case BR:
+   case LD:
+   case LDI:
+   case LEA:
+   case ST:
+   case STI:
+      decoded->offset = sign_extend(PCOFFSET9(instruction), 9);
+      break;
+   case LDR:
+   case STR:
+      decoded->offset = sign_extend(OFFSET6(instruction), 6);
+      break;
+   case TRAP:
+      decoded->offset = TRAPVECT8(instruction);
+      break;
+   }
+#ifdef CPU_COMPUTED_GOTO
+   decoded->handler = handlers[decoded->op];
+#endif
+}
+
+static const struct decoded_instruction *cpu_decode(Cpu *cpu, uint16_t address, const void *const *handlers) {
+   struct decoded_instruction *page, *decoded;
+   struct bus_accessor *bus_access;
+   bus_access = cpu->bus_access;
+   page = cpu->decode_pages[DECODE_PAGE(address)];
+   if (bus_access->is_device_register(bus_access, address)) {
+      decoded = &cpu->uncached;
+   } else {
+      if (page == NULL) {
+         page = safe_malloc(sizeof(struct decoded_instruction) * DECODE_PAGE_SIZE);
+         memset(page, 0, sizeof(struct decoded_instruction) * DECODE_PAGE_SIZE);
+         cpu->decode_pages[DECODE_PAGE(address)] = page;
+      }
+      decoded = &page[DECODE_OFFSET(address)];
+      if (cpu->jit != NULL) {
+         jit_watch(cpu->jit, address);
+      }
+   }
+   decode_instruction(bus_access->read(bus_access, address), decoded, handlers);
+   if (decoded != &cpu->uncached && cpu_has_breakpoint(cpu, address)) {
+      decoded->op = OP_BREAKPOINT;
+#ifdef CPU_COMPUTED_GOTO
+      decoded->handler = handlers[OP_BREAKPOINT];
+#endif
+   }
+   return decoded;
+}
+
+/* The instruction under a breakpoint, for when the breakpoint is being passed */
+static const struct decoded_instruction *cpu_decode_uncached(Cpu *cpu, uint16_t address,
+                                                             const void *const *handlers) {
+   decode_instruction(cpu->bus_access->read(cpu->bus_access, address), &cpu->uncached, handlers);
+   return &cpu->uncached;
+}
+
+static const struct decoded_instruction *cpu_fetch_decoded(Cpu *cpu, uint16_t address,
+                                                           const void *const *handlers) {
+   struct decoded_instruction *page;
+   page = cpu->decode_pages[DECODE_PAGE(address)];
+   if (page != NULL && page[DECODE_OFFSET(address)].op != OP_NONE) {
+      return &page[DECODE_OFFSET(address)];
+   }
+   return cpu_decode(cpu, address, handlers);
+}
+
+/* Called after a branch back to the instruction before it. When that is a load of a device
+ * register and the loop keeps reading the same value, nothing changes until a device does. */
+static int cpu_poll_idle(Cpu *cpu) {
+   const struct decoded_instruction *load;
+   struct bus_accessor *bus_access;
+   uint16_t pc, address;
+   bus_access = cpu->bus_access;
+   pc = cpu->registers[REG_PC];
+   if (cpu->decode_pages[DECODE_PAGE(pc)] == NULL) {
+      return 0;
+   }
+   load = &cpu->decode_pages[DECODE_PAGE(pc)][DECODE_OFFSET(pc)];
+   switch (load->op) {
+   case OP_LD:
+      address = pc + 1 + load->offset;
+      break;
+   case OP_LDI:
+      address = pc + 1 + load->offset;
+      if (bus_access->is_device_register(bus_access, address)) {
+         return 0;
+      }
+      address = bus_access->read(bus_access, address);
+      break;
+   case OP_LDR:
+      if (load->sr1 == load->dr) {
+         return 0;
+      }
+      address = cpu->registers[load->sr1] + load->offset;
+      break;
+   default:
+      return 0;
+   }
+   if (!bus_access->is_device_register(bus_access, address)) {
+      return 0;
+   }
+   if (cpu->poll.pc != pc || cpu->poll.value != cpu->registers[load->dr]) {
+      cpu->poll.pc = pc;
+      cpu->poll.value = cpu->registers[load->dr];
+      cpu->poll.count = 0;
+      return 0;
+   }
+   return ++cpu->poll.count >= POLL_IDLE_ITERATIONS;
 }
 
 static void cpu_execute_interrupt(Cpu *cpu, uint8_t vec_location, uint8_t priority) {
@@ -287,6 +655,7 @@ static void cpu_execute_interrupt(Cpu *cpu, uint8_t vec_location, uint8_t priori
       cpu->registers[REG_USP] = cpu->registers[REG_R6];
       cpu->registers[REG_R6] = cpu->registers[REG_SSP];
    }
+   cpu_sync_psr(cpu);
    supervisor_stack_push(cpu, cpu->registers[REG_PSR]);
    supervisor_stack_push(cpu, cpu->registers[REG_PC]);
    /* clear psr */
@@ -306,6 +675,7 @@ static void cpu_execute_exception(Cpu *cpu, uint8_t vec_location) {
       cpu->registers[REG_USP] = cpu->registers[REG_R6];
       cpu->registers[REG_R6] = cpu->registers[REG_SSP];
    }
+   cpu_sync_psr(cpu);
    supervisor_stack_push(cpu, cpu->registers[REG_PSR]);
    supervisor_stack_push(cpu, cpu->registers[REG_PC]);
    cpu->registers[REG_PSR] = 0;
@@ -332,15 +702,91 @@ int cpu_signal_interrupt(Cpu *cpu, uint8_t vec_location, uint8_t priority) {
    return 1;
 }
 
+void cpu_set_breakpoint(Cpu *cpu, uint16_t address, int set) {
+   if (cpu->breakpoints == NULL) {
+      if (!set) {
+         return;
+      }
+      cpu->breakpoints = safe_malloc(BREAKPOINT_BYTE(UINT16_MAX) + 1);
+      memset(cpu->breakpoints, 0, BREAKPOINT_BYTE(UINT16_MAX) + 1);
+   }
+   if (set) {
+      cpu->breakpoints[BREAKPOINT_BYTE(address)] |= BREAKPOINT_BIT(address);
+   } else {
+      cpu->breakpoints[BREAKPOINT_BYTE(address)] &= ~BREAKPOINT_BIT(address);
+   }
+   cpu_invalidate_decoded(cpu, address);
+   if (cpu->jit != NULL) {
+      jit_set_breakpoint(cpu->jit, address, set);
+   }
+}
+
+int cpu_breakpoint(Cpu *cpu, uint16_t address) {
+   return cpu_has_breakpoint(cpu, address);
+}
+
+/* The next run executes the instruction at pc rather than stopping at its breakpoint, as
+ * after a run that stopped there */
+void cpu_pass_breakpoint(Cpu *cpu) {
+   cpu->breakpoint_hit = cpu_has_breakpoint(cpu, cpu->registers[REG_PC]);
+}
+
+/* Whoever owns the bus has to call this whenever the MCR is written */
+void cpu_write_mcr(Cpu *cpu, uint16_t value) {
+   cpu->clock_enabled = CLOCK_ENABLED(value) != 0;
+}
+
+void cpu_invalidate(Cpu *cpu, uint16_t address) {
+   cpu_invalidate_decoded(cpu, address);
+}
+
 void free_cpu(Cpu *cpu) {
+   int i;
+   for (i = 0; i < DECODE_NUM_PAGES; ++i) {
+      free(cpu->decode_pages[i]);
+   }
+   jit_free(cpu->jit);
+   free(cpu->breakpoints);
    free(cpu);
 }
 
 uint16_t cpu_read_register(Cpu *cpu, enum lc3_reg reg) {
+   if (reg == REG_PSR) {
+      cpu_sync_psr(cpu);
+   }
    return cpu->registers[reg];
 }
 
+unsigned long long cpu_retired(Cpu *cpu) {
+   return cpu->retired;
+}
+
+/* Off by default. When on, traps to os.obj's GETC, OUT, PUTS and HALT routines are serviced
+ * natively, with the same effects on registers, memory and devices, as a single instruction. */
+void cpu_set_trap_acceleration(Cpu *cpu, int enable) {
+   cpu->trap_acceleration = enable;
+   if (cpu->jit != NULL) {
+      jit_leave_traps(cpu->jit, enable);
+   }
+}
+
+int cpu_trap_acceleration(Cpu *cpu) {
+   return cpu->trap_acceleration;
+}
+
+unsigned long long cpu_accelerated_traps(Cpu *cpu) {
+   return cpu->accelerated_traps;
+}
+
+/* Counts instructions another engine executed on the cpu's behalf */
+void cpu_retire(Cpu *cpu, unsigned long long amt) {
+   cpu->retired += amt;
+}
+
 void cpu_write_register(Cpu *cpu, enum lc3_reg reg, uint16_t value) {
+   if (reg == REG_PSR) {
+      cpu->cc_lazy = 0;
+   }
    cpu->registers[reg] = value;
 }
 
@@ -349,33 +795,360 @@ Cpu *new_Cpu(struct bus_accessor *bus_access) {
    cpu = safe_malloc(sizeof(Cpu));
    cpu->bus_access = bus_access;
    setup_exceptions(cpu);
-   if (!instructions_loaded) {
-      load_instructions();
-   }
    memset(cpu->registers, 0, sizeof(uint16_t) * num_registers);
-   bus_access->write(bus_access, MCR_ADDR, 0x8000);
+   cpu->cc_result = 0;
+   cpu->cc_lazy = 0;
+   memset(&cpu->poll, 0, sizeof(cpu->poll));
+   cpu->breakpoints = NULL;
+   cpu->breakpoint_hit = 0;
+   cpu->retired = 0;
+   cpu->trap_acceleration = 0;
+   cpu->accelerated_traps = 0;
+   memset(cpu->decode_pages, 0, sizeof(cpu->decode_pages));
+   cpu->jit = NULL;
+   cpu->recorder = NULL;
+   cpu->recorder_data = NULL;
+   cpu_bus_write(cpu, MCR_ADDR, 0x8000);
+   cpu_write_mcr(cpu, 0x8000);
    return cpu;
 }
 
+/* Puts the cpu back in the state new_Cpu leaves it in, keeping its allocations, engine and
+ * trap acceleration */
+void cpu_reset(Cpu *cpu) {
+   int i;
+   memset(cpu->registers, 0, sizeof(uint16_t) * num_registers);
+   cpu->cc_result = 0;
+   cpu->cc_lazy = 0;
+   memset(&cpu->poll, 0, sizeof(cpu->poll));
+   free(cpu->breakpoints);
+   cpu->breakpoints = NULL;
+   cpu->breakpoint_hit = 0;
+   cpu->retired = 0;
+   cpu->accelerated_traps = 0;
+   for (i = 0; i < DECODE_NUM_PAGES; ++i) {
+      if (cpu->decode_pages[i] != NULL) {
+         memset(cpu->decode_pages[i], 0, sizeof(struct decoded_instruction) * DECODE_PAGE_SIZE);
+      }
+   }
+   if (cpu->jit != NULL) {
+      jit_reset(cpu->jit);
+   }
+   cpu_bus_write(cpu, MCR_ADDR, 0x8000);
+   cpu_write_mcr(cpu, 0x8000);
+}
+
+/* The run loop. Every handler fetches and dispatches its successor itself, so with
+ * computed goto each op gets its own indirect branch. */
+static enum cpu_status cpu_interpret(Cpu *cpu, long long amt) {
+#ifdef CPU_COMPUTED_GOTO
+   static const void *const handlers[num_cpu_ops] = {
+      [OP_NONE]    = NULL,
+      [OP_ADD_REG] = &&do_add_reg,
+      [OP_ADD_IMM] = &&do_add_imm,
+      [OP_AND_REG] = &&do_and_reg,
+      [OP_AND_IMM] = &&do_and_imm,
+      [OP_BR]      = &&do_br,
+      [OP_JMP_RET] = &&do_jmp_ret,
+      [OP_JSR]     = &&do_jsr,
+      [OP_JSRR]    = &&do_jsrr,
+      [OP_LD]      = &&do_ld,
+      [OP_LDI]     = &&do_ldi,
+      [OP_LDR]     = &&do_ldr,
+      [OP_LEA]     = &&do_lea,
+      [OP_NOT]     = &&do_not,
+      [OP_RTI]     = &&do_rti,
+      [OP_ST]      = &&do_st,
+      [OP_STI]     = &&do_sti,
+      [OP_STR]     = &&do_str,
+      [OP_TRAP]    = &&do_trap,
+      [OP_ILLEGAL] = &&do_illegal,
+      [OP_BREAKPOINT] = &&do_breakpoint
+   };
+#define CPU_OP(op, label) label:
+#define CPU_DISPATCH()    goto *decoded->handler;
+#define CPU_END_OP()      CPU_FETCH(); CPU_DISPATCH()
+#else
+   const void *const *handlers = NULL;
+#define CPU_OP(op, label) case op:
+#define CPU_DISPATCH()    switch (decoded->op)
+#define CPU_END_OP()      break
+#endif
+#define CPU_FETCH()                                                       \
+   do {                                                                   \
+      if (amt <= 0) {                                                     \
+         status = CPU_BUDGET;                                             \
+         goto out;                                                        \
+      }                                                                   \
+      --amt;                                                              \
+      decoded = cpu_fetch_decoded(cpu, cpu->registers[REG_PC], handlers); \
+      ++cpu->registers[REG_PC];                                           \
+   } while (0)
+/* only a store can reach the mcr, so only ops that store check the clock */
+#define CPU_CHECK_CLOCK()          \
+   do {                            \
+      if (!cpu->clock_enabled) {   \
+         status = CPU_HALTED;      \
+         goto out;                 \
+      }                            \
+   } while (0)
+
+   const struct decoded_instruction *decoded;
+   enum cpu_status status;
+   long long start_amt;
+   start_amt = amt;
+   if (!cpu->clock_enabled) {
+      return CPU_HALTED;
+   }
+   for (;;) {
+      CPU_FETCH();
+dispatch:
+      CPU_DISPATCH() {
+      CPU_OP(OP_ADD_REG, do_add_reg)
+         add_reg(cpu, decoded);
+         CPU_END_OP();
+      CPU_OP(OP_ADD_IMM, do_add_imm)
+         add_imm(cpu, decoded);
+         CPU_END_OP();
+      CPU_OP(OP_AND_REG, do_and_reg)
+         and_reg(cpu, decoded);
+         CPU_END_OP();
+      CPU_OP(OP_AND_IMM, do_and_imm)
+         and_imm(cpu, decoded);
+         CPU_END_OP();
+      CPU_OP(OP_BR, do_br)
+         if (br(cpu, decoded) && decoded->offset == POLL_BRANCH_OFFSET && cpu_poll_idle(cpu)) {
+            status = CPU_IDLE;
+            goto out;
+         }
+         CPU_END_OP();
+      CPU_OP(OP_JMP_RET, do_jmp_ret)
+         jmp_ret(cpu, decoded);
+         CPU_END_OP();
+      CPU_OP(OP_JSR, do_jsr)
+         jsr(cpu, decoded);
+         CPU_END_OP();
+      CPU_OP(OP_JSRR, do_jsrr)
+         jsrr(cpu, decoded);
+         CPU_END_OP();
+      CPU_OP(OP_LD, do_ld)
+         ld(cpu, decoded);
+         CPU_END_OP();
+      CPU_OP(OP_LDI, do_ldi)
+         ldi(cpu, decoded);
+         CPU_END_OP();
+      CPU_OP(OP_LDR, do_ldr)
+         ldr(cpu, decoded);
+         CPU_END_OP();
+      CPU_OP(OP_LEA, do_lea)
+         lea(cpu, decoded);
+         CPU_END_OP();
+      CPU_OP(OP_NOT, do_not)
+         not(cpu, decoded);
+         CPU_END_OP();
+      CPU_OP(OP_RTI, do_rti)
+         rti(cpu, decoded);
+         cpu_check_exceptions(cpu);
+         CPU_CHECK_CLOCK();
+         CPU_END_OP();
+      CPU_OP(OP_ST, do_st)
+         st(cpu, decoded);
+         CPU_CHECK_CLOCK();
+         CPU_END_OP();
+      CPU_OP(OP_STI, do_sti)
+         sti(cpu, decoded);
+         CPU_CHECK_CLOCK();
+         CPU_END_OP();
+      CPU_OP(OP_STR, do_str)
+         str(cpu, decoded);
+         CPU_CHECK_CLOCK();
+         CPU_END_OP();
+      CPU_OP(OP_TRAP, do_trap)
+         if (!cpu->trap_acceleration || !cpu_fast_trap(cpu, decoded->offset)) {
+            trap(cpu, decoded);
+         }
+         CPU_CHECK_CLOCK();
+         CPU_END_OP();
+      CPU_OP(OP_ILLEGAL, do_illegal)
+         illegal_opcode(cpu, decoded);
+         cpu_check_exceptions(cpu);
+         CPU_CHECK_CLOCK();
+         status = CPU_ILLEGAL_OPCODE;
+         goto out;
+      CPU_OP(OP_BREAKPOINT, do_breakpoint)
+         --cpu->registers[REG_PC];
+         if (!cpu->breakpoint_hit) {
+            ++amt;
+            cpu->breakpoint_hit = 1;
+            status = CPU_BREAKPOINT;
+            goto out;
+         }
+         cpu->breakpoint_hit = 0;
+         decoded = cpu_decode_uncached(cpu, cpu->registers[REG_PC], handlers);
+         ++cpu->registers[REG_PC];
+         goto dispatch;
+      }
+   }
+out:
+   if (status != CPU_BREAKPOINT && amt != start_amt) {
+      cpu->breakpoint_hit = 0;
+   }
+   cpu->retired += start_amt - amt;
+   return status;
+#undef CPU_OP
+#undef CPU_DISPATCH
+#undef CPU_END_OP
+#undef CPU_FETCH
+#undef CPU_CHECK_CLOCK
+}
+
 int cpu_tick(Cpu *cpu) {
-   instru_func func;
-   int opcode;
-   uint16_t instruction;
-   if (!CLOCK_ENABLED(cpu->bus_access->read(cpu->bus_access, MCR_ADDR))) {
-      return 0;
+   return cpu_interpret(cpu, 1) != CPU_HALTED;
+}
+
+static uint16_t cpu_jit_read(void *data, uint16_t address) {
+   Cpu *cpu = data;
+   return cpu->bus_access->read(cpu->bus_access, address);
+}
+
+static int cpu_jit_write(void *data, uint16_t address, uint16_t value) {
+   Cpu *cpu = data;
+   cpu_bus_write(cpu, address, value);
+   return !cpu->clock_enabled;
+}
+
+/* Stores to decoded instructions have to come back through cpu_jit_write, and
+ * breakpoints are left to the interpreter */
+static void cpu_jit_watch_addresses(Cpu *cpu) {
+   int page_i, offset;
+   long address;
+   for (address = 0; address <= UINT16_MAX; ++address) {
+      if (cpu_has_breakpoint(cpu, address)) {
+         jit_set_breakpoint(cpu->jit, address, 1);
+      }
    }
-   instruction = cpu->bus_access->read(cpu->bus_access, cpu->registers[REG_PC]);
-   ++cpu->registers[REG_PC];
-   opcode = OPCODE(instruction);
-   if (opcode > 15 || opcode == 13) {
-      cpu->illegal_opcode_exception_line.toggle = 1;
-   } else {
-      func = instru_func_vec[opcode];
-      func(cpu, instruction);
+   for (page_i = 0; page_i < DECODE_NUM_PAGES; ++page_i) {
+      if (cpu->decode_pages[page_i] == NULL) {
+         continue;
+      }
+      for (offset = 0; offset < DECODE_PAGE_SIZE; ++offset) {
+         if (cpu->decode_pages[page_i][offset].op != OP_NONE) {
+            jit_watch(cpu->jit, page_i * DECODE_PAGE_SIZE + offset);
+         }
+      }
    }
-   if (!CLOCK_ENABLED(cpu->bus_access->read(cpu->bus_access, MCR_ADDR))) {
+}
+
+int cpu_set_engine(Cpu *cpu, enum cpu_engine engine) {
+   struct jit_host host;
+   jit_free(cpu->jit);
+   cpu->jit = NULL;
+   if (engine == CPU_ENGINE_INTERP) {
       return 0;
    }
-   cpu_check_exceptions(cpu);
-   return 1;
+   host.data = cpu;
+   host.read = cpu_jit_read;
+   host.write = cpu_jit_write;
+   host.memory = cpu->bus_access->direct_map.memory;
+   host.special_pages = cpu->bus_access->direct_map.special_pages;
+   host.dirty_pages = cpu->bus_access->direct_map.dirty_pages;
+   host.page_bits = cpu->bus_access->direct_map.page_bits;
+   cpu->jit = jit_new(&host);
+   if (cpu->jit == NULL) {
+      return -1;
+   }
+   cpu_jit_watch_addresses(cpu);
+   jit_leave_traps(cpu->jit, cpu->trap_acceleration);
+   return 0;
+}
+
+void cpu_get_state(Cpu *cpu, struct cpu_state *state) {
+   cpu_sync_psr(cpu);
+   memcpy(state->registers, cpu->registers, sizeof(state->registers));
+   state->retired = cpu->retired;
+   state->accelerated_traps = cpu->accelerated_traps;
+}
+
+/* Takes the clock from the mcr as well. Whatever memory was changed behind the cpu's back
+ * still has to be passed to cpu_invalidate or cpu_invalidate_all. */
+void cpu_set_state(Cpu *cpu, const struct cpu_state *state) {
+   memcpy(cpu->registers, state->registers, sizeof(cpu->registers));
+   cpu->cc_lazy = 0;
+   cpu->retired = state->retired;
+   cpu->accelerated_traps = state->accelerated_traps;
+   memset(&cpu->poll, 0, sizeof(cpu->poll));
+   cpu->breakpoint_hit = 0;
+   cpu_write_mcr(cpu, cpu->bus_access->read(cpu->bus_access, MCR_ADDR));
+}
+
+/* record is called with data and the state before each instruction the cpu executes, and
+ * the jit is left alone while it is set. NULL stops recording. */
+void cpu_set_recorder(Cpu *cpu, void (*record)(void *, const struct cpu_state *), void *data) {
+   cpu->recorder = record;
+   cpu->recorder_data = data;
+}
+
+/* Drops every decoded and translated instruction, for when all of memory was replaced.
+ * Breakpoints stay. */
+void cpu_invalidate_all(Cpu *cpu) {
+   int i;
+   for (i = 0; i < DECODE_NUM_PAGES; ++i) {
+      if (cpu->decode_pages[i] != NULL) {
+         memset(cpu->decode_pages[i], 0, sizeof(struct decoded_instruction) * DECODE_PAGE_SIZE);
+      }
+   }
+   if (cpu->jit != NULL) {
+      jit_reset(cpu->jit);
+      cpu_jit_watch_addresses(cpu);
+   }
+}
+
+/* One instruction at a time so the run loop itself doesn't pay for recording */
+static enum cpu_status cpu_run_recorded(Cpu *cpu, long long amt) {
+   struct cpu_state state;
+   enum cpu_status status;
+   for (; amt > 0; --amt) {
+      cpu_get_state(cpu, &state);
+      cpu->recorder(cpu->recorder_data, &state);
+      status = cpu_interpret(cpu, 1);
+      if (status != CPU_BUDGET) {
+         return status;
+      }
+   }
+   return CPU_BUDGET;
+}
+
+/* Runs up to amt instructions */
+enum cpu_status cpu_run(Cpu *cpu, long long amt) {
+   enum cpu_status status;
+   long long executed;
+   if (cpu->recorder != NULL) {
+      return cpu_run_recorded(cpu, amt);
+   }
+   if (cpu->jit == NULL) {
+      return cpu_interpret(cpu, amt);
+   }
+   while (amt > 0) {
+      if (!cpu->clock_enabled) {
+         return CPU_HALTED;
+      }
+      /* translated code keeps the psr itself */
+      cpu_sync_psr(cpu);
+      executed = jit_run(cpu->jit, cpu->registers, amt);
+      cpu->retired += executed;
+      amt -= executed;
+      if (executed != 0) {
+         cpu->breakpoint_hit = 0;
+      }
+      if (amt == 0) {
+         break;
+      }
+      /* whatever the jit would not translate */
+      status = cpu_interpret(cpu, 1);
+      if (status != CPU_BUDGET) {
+         return status;
+      }
+      --amt;
+   }
+   return cpu->clock_enabled ? CPU_BUDGET : CPU_HALTED;
 }
@@ -2,6 +2,7 @@
 #define CPU_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include "lc3_reg.h"
 
@@ -10,20 +11,71 @@
 
 #define INTERRUPT_VEC_SIZE UINT8_MAX
 
+/* machine control register, the clock runs while bit 15 is set */
+#define MCR_ADDR 0xFFFE
+
 struct cpu;
 typedef struct cpu Cpu;
 
+enum cpu_engine {CPU_ENGINE_INTERP, CPU_ENGINE_JIT};
+
+/* Why cpu_run returned */
+enum cpu_status {
+    CPU_HALTED, /* the clock is disabled */
+    CPU_BUDGET, /* ran every instruction it was asked to */
+    CPU_IDLE,   /* the program is spinning on a device register that isn't changing */
+    CPU_BREAKPOINT,    /* pc is at a breakpoint, the next run executes it */
+    CPU_ILLEGAL_OPCODE /* the illegal opcode exception was just taken */
+};
+
+/* Where plain memory lives, for engines that access it without calling read/write.
+ * The word for address a is memory[a]. special_pages[a >> page_bits] is nonzero when
+ * accesses to a have to go through read/write, as for device registers. Whoever stores
+ * to a directly sets dirty_pages[a >> page_bits] to 1. memory is NULL if unavailable. */
+struct bus_direct_map {
+    uint16_t *memory;
+    const unsigned char *special_pages;
+    unsigned char *dirty_pages;
+    unsigned page_bits;
+};
+
+/* What a snapshot keeps of the cpu, everything else follows from memory */
+struct cpu_state {
+    uint16_t registers[num_registers];
+    unsigned long long retired;
+    unsigned long long accelerated_traps;
+};
+
 struct bus_accessor {
     void *data;
     uint16_t (*read)(struct bus_accessor *, uint16_t);
     void (*write)(struct bus_accessor *, uint16_t, uint16_t);
+    int (*is_device_register)(struct bus_accessor *, uint16_t);
+    struct bus_direct_map direct_map;
 };
 
 Cpu *new_Cpu(struct bus_accessor *);
 int cpu_tick(Cpu *);
+enum cpu_status cpu_run(Cpu *, long long);
+int cpu_set_engine(Cpu *, enum cpu_engine);
 int cpu_signal_interrupt(Cpu *, uint8_t, uint8_t);
 uint16_t cpu_read_register(Cpu *, enum lc3_reg);
 void cpu_write_register(Cpu *, enum lc3_reg, uint16_t);
+unsigned long long cpu_retired(Cpu *);
+void cpu_retire(Cpu *, unsigned long long);
+void cpu_set_trap_acceleration(Cpu *, int);
+int cpu_trap_acceleration(Cpu *);
+unsigned long long cpu_accelerated_traps(Cpu *);
+void cpu_invalidate(Cpu *, uint16_t);
+void cpu_invalidate_all(Cpu *);
+void cpu_reset(Cpu *);
+void cpu_get_state(Cpu *, struct cpu_state *);
+void cpu_set_state(Cpu *, const struct cpu_state *);
+void cpu_set_recorder(Cpu *, void (*)(void *, const struct cpu_state *), void *);
+void cpu_write_mcr(Cpu *, uint16_t);
+void cpu_set_breakpoint(Cpu *, uint16_t, int);
+int cpu_breakpoint(Cpu *, uint16_t);
+void cpu_pass_breakpoint(Cpu *);
 void free_cpu(Cpu *);
 
 #endif
@@ -4,13 +4,50 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+struct device;
+
 struct host {
     void *data;
     void (*write_output)(struct host *, char);
     void (*alert_interrupt)(struct host *, uint8_t vec, uint8_t priority);
+    /* version 2 */
+    void (*write_output_buf)(struct host *, const char *, size_t);
+    /* Has on_tick called once, when instructions more have retired, replacing any earlier
+     * request. Asked from read_register or write_register, the count starts at the last
+     * service. A device that has never asked gets on_tick every few thousand instructions
+     * instead. */
+    void (*schedule_tick)(struct host *, struct device *, unsigned long long instructions);
+    /* For a device with state a snapshot can't see, which is anything besides the values
+     * of REGISTERS devices' registers. Called from start. save copies the state into buf
+     * if it fits in size bytes and returns the size it needs, it is called with a NULL buf
+     * first. restore is given what save wrote and returns -1 if it can't use it. */
+    void (*set_state_hooks)(struct host *, struct device *,
+                            size_t (*save)(struct device *, void *buf, size_t size),
+                            int (*restore)(struct device *, const void *buf, size_t size));
 };
 
-enum address_method {RANGE, SEPERATE};
+/* The struct device layout plugins are built against. A plugin exports
+ *     const int device_abi_version = DEVICE_ABI_VERSION;
+ * and one that doesn't is taken to be version 1, whose struct device ends at
+ * get_address_method. */
+#define DEVICE_ABI_VERSION 2
+
+/* get_addresses gives RANGE devices pairs of low, high addresses, one window per pair.
+ * SEPERATE devices list every register. REGISTERS devices (version 2) give their
+ * registers through get_registers instead. */
+enum address_method {RANGE, SEPERATE, REGISTERS};
+
+/* struct device_register flags */
+#define DEVICE_REGISTER_READ_HOOK  0x1 /* reads call read_register, for reads with side effects */
+#define DEVICE_REGISTER_WRITE_HOOK 0x2 /* writes call write_register */
+
+/* A register kept in the device's own storage, which the bus reads and writes in place
+ * unless a hook flag says otherwise */
+struct device_register {
+    uint16_t address;
+    int flags;
+    uint16_t *value;
+};
 
 struct device {
     void *data;
@@ -22,6 +59,8 @@ struct device {
     void (*free)(struct device *);
     const uint16_t *(*get_addresses)(struct device *, size_t *);
     enum address_method (*get_address_method)(struct device *);
+    /* version 2, only called when get_address_method gives REGISTERS */
+    const struct device_register *(*get_registers)(struct device *, size_t *);
 };
 
 #endif
\ No newline at end of file
@@ -1,12 +1,18 @@
 #ifndef DEVICE_IO_H
 #define DEVICE_IO_H
 
+#include <stddef.h>
+
 struct device_io {
     void *data;
     int (*get_char)(struct device_io *, char *);
     int (*write_char)(struct device_io *, char);
+    /* writes len bytes at once, may be NULL */
+    int (*write_buf)(struct device_io *, const char *, size_t);
     int (*start)(struct device_io *);
     int (*end)(struct device_io *);
+    /* blocks until get_char may have something, may be NULL */
+    int (*wait_input)(struct device_io *);
 };
 
 #endif
\ No newline at end of file
@@ -1,87 +1,198 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
 
 #include "util.h"
 #include "terminal.h"
 #include "device_io.h"
+#include "device_io_impl.h"
 
+#define IO_IMPL_MAX_SKIPPED_POLLS 64
+#define IO_IMPL_OUTPUT_SIZE       4096
+#define IO_IMPL_INPUT_SIZE        65536
+
+/* The fds are never switched to non-blocking because other simulators may share them,
+ * readiness is checked with poll() instead. Each check is a syscall, so while no input
+ * arrives get_char checks half as often each time, down to one call in
+ * IO_IMPL_MAX_SKIPPED_POLLS + 1, and goes back to every call once a character comes in or
+ * wait_input returns.
+ * A terminal is read a byte at a time so whatever the program doesn't take is left for the
+ * command line. Pipes and files are read IO_IMPL_INPUT_SIZE bytes at a time and handed out
+ * one character per get_char call as before. Read-ahead from a file is given back with lseek
+ * when the run ends. */
 struct device_io_impl_data {
     int infd;
     int outfd;
+    int raw_terminal; /* this instance holds the terminal in raw mode */
+    int skip_polls;   /* get_char calls left that return nothing without checking */
+    int backoff;
+    int flush_policy; /* IO_IMPL_FLUSH_* */
+    int input_seekable;
+    size_t input_chunk; /* bytes asked for per read */
+    size_t input_pos;
+    size_t input_len;
+    size_t output_len;
+    char output[IO_IMPL_OUTPUT_SIZE];
+    char input[IO_IMPL_INPUT_SIZE];
 };
 
-static int io_impl_get_char(struct device_io *io, char *c) {
-    struct device_io_impl_data *data;
+static int io_impl_poll(int fd, short events, int timeout) {
+    struct pollfd pollfd;
+    pollfd.fd = fd;
+    pollfd.events = events;
+    pollfd.revents = 0;
+    return poll(&pollfd, 1, timeout);
+}
+
+static int io_impl_write_all(int fd, const char *buf, size_t len) {
     ssize_t result;
-    data = io->data;
-    result = read(data->infd, c, 1);
-    if (result < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            return 0;
+    while (len > 0) {
+        result = write(fd, buf, len);
+        if (result < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                return -1;
+            }
+            io_impl_poll(fd, POLLOUT, -1);
+            continue;
         }
+        buf += result;
+        len -= result;
     }
+    return 0;
+}
+
+static int io_impl_flush(struct device_io_impl_data *data) {
+    int result;
+    result = io_impl_write_all(data->outfd, data->output, data->output_len);
+    data->output_len = 0;
     return result;
 }
 
-static int io_impl_write_char(struct device_io *io, char c) {
+static void io_impl_poll_soon(struct device_io_impl_data *data) {
+    data->skip_polls = 0;
+    data->backoff = 0;
+}
+
+static void io_impl_poll_later(struct device_io_impl_data *data) {
+    data->backoff = data->backoff == 0 ? 1 : data->backoff * 2;
+    if (data->backoff > IO_IMPL_MAX_SKIPPED_POLLS) {
+        data->backoff = IO_IMPL_MAX_SKIPPED_POLLS;
+    }
+    data->skip_polls = data->backoff;
+}
+
+static int io_impl_get_char(struct device_io *io, char *c) {
     struct device_io_impl_data *data;
     ssize_t result;
     data = io->data;
-    while ((result = write(data->outfd, &c, 1)) != 1) {
-        if (result < 0 && (errno != EAGAIN && errno != EWOULDBLOCK)) {
-            break;
-        } 
+    if (data->input_pos < data->input_len) {
+        *c = data->input[data->input_pos++];
+        return 1;
+    }
+    if (data->skip_polls > 0) {
+        --data->skip_polls;
+        return 0;
+    }
+    /* the program may be about to wait for the answer to what it just printed */
+    if ((data->flush_policy & IO_IMPL_FLUSH_INPUT) && io_impl_flush(data) < 0) {
+        return -1;
+    }
+    result = io_impl_poll(data->infd, POLLIN, 0);
+    if (result > 0) {
+        result = read(data->infd, data->input, data->input_chunk);
+    }
+    if (result > 0) {
+        data->input_len = result;
+        data->input_pos = 1;
+        *c = data->input[0];
+        result = 1;
+        io_impl_poll_soon(data);
+    } else {
+        io_impl_poll_later(data);
+    }
+    if (result < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
     }
     return result;
 }
 
-static int io_impl_start(struct device_io *io) {
+static int io_impl_write_buf(struct device_io *io, const char *buf, size_t len) {
     struct device_io_impl_data *data;
-    int infd_old_status, outfd_old_status;
+    int flush;
     data = io->data;
-    infd_old_status = set_nonblock(data->infd);
-    if (infd_old_status < 0) {
-        goto set_infd_err;
+    if (len > IO_IMPL_OUTPUT_SIZE - data->output_len) {
+        if (io_impl_flush(data) < 0) {
+            return -1;
+        }
+        if (len >= IO_IMPL_OUTPUT_SIZE) {
+            return io_impl_write_all(data->outfd, buf, len) < 0 ? -1 : (int)len;
+        }
+    }
+    memcpy(data->output + data->output_len, buf, len);
+    data->output_len += len;
+    flush = (data->flush_policy & IO_IMPL_FLUSH_EACH) || data->output_len == IO_IMPL_OUTPUT_SIZE ||
+            ((data->flush_policy & IO_IMPL_FLUSH_NEWLINE) && memchr(buf, '\n', len) != NULL);
+    if (flush && io_impl_flush(data) < 0) {
+        return -1;
     }
-    outfd_old_status = set_nonblock(data->outfd);
-    if (outfd_old_status < 0) {
-        goto set_outfd_err;
+    return len;
+}
+
+static int io_impl_write_char(struct device_io *io, char c) {
+    return io_impl_write_buf(io, &c, 1);
+}
+
+static int io_impl_wait_input(struct device_io *io) {
+    struct device_io_impl_data *data;
+    data = io->data;
+    io_impl_poll_soon(data);
+    if (data->input_pos < data->input_len) {
+        return 1;
     }
-    if (init_terminal() < 0) {
-        goto init_terminal_err;
+    if ((data->flush_policy & IO_IMPL_FLUSH_INPUT) && io_impl_flush(data) < 0) {
+        return -1;
     }
+    return io_impl_poll(data->infd, POLLIN, -1);
+}
+
+static int io_impl_start(struct device_io *io) {
+    struct device_io_impl_data *data;
+    int result;
+    data = io->data;
+    io_impl_poll_soon(data);
+    result = init_terminal();
+    if (result < 0) {
+        return -1;
+    }
+    data->raw_terminal = result;
     return 0;
+}
 
-init_terminal_err:
-    fcntl(data->outfd, F_SETFL, outfd_old_status);
-set_outfd_err:
-    fcntl(data->infd, F_SETFL, infd_old_status);
-set_infd_err:
-    return -1;            
+static void io_impl_unread_input(struct device_io_impl_data *data) {
+    off_t unread;
+    unread = data->input_len - data->input_pos;
+    if (unread > 0 && data->input_seekable && lseek(data->infd, -unread, SEEK_CUR) >= 0) {
+        data->input_pos = 0;
+        data->input_len = 0;
+    }
 }
 
 static int io_impl_end(struct device_io *io) {
     struct device_io_impl_data *data;
-    int infd_old_status, outfd_old_status;
     data = io->data;
-    infd_old_status = set_blocking(data->infd);
-    if (infd_old_status < 0) {
-        goto set_infd_err;
+    io_impl_unread_input(data);
+    if ((data->flush_policy & IO_IMPL_FLUSH_END) && io_impl_flush(data) < 0) {
+        return -1;
     }
-    outfd_old_status = set_blocking(data->outfd);
-    if (outfd_old_status < 0) {
-        goto set_outfd_err;
+    if (data->raw_terminal) {
+        reset_terminal();
+        data->raw_terminal = 0;
     }
-    reset_terminal();
-    /* TODO: Reset terminal */
     return 0;
-set_outfd_err:
-    fcntl(data->infd, F_SETFL, infd_old_status); 
-set_infd_err:
-    return -1;       
 }
 
 static void impl_init_device_io(struct device_io *io, struct device_io_impl_data *data) {
@@ -90,20 +201,43 @@ static void impl_init_device_io(struct device_io *io, struct device_io_impl_data
     io->start = io_impl_start;
     io->get_char = io_impl_get_char;
     io->write_char = io_impl_write_char;
+    io->write_buf = io_impl_write_buf;
+    io->wait_input = io_impl_wait_input;
 }
 
 struct device_io *create_device_io_impl(int infd, int outfd) {
     struct device_io *io;
     struct device_io_impl_data *data;
+    struct stat in_stat;
     io = safe_malloc(sizeof(struct device_io));
     data = safe_malloc(sizeof(struct device_io_impl_data));
+    data->input_seekable = fstat(infd, &in_stat) == 0 && S_ISREG(in_stat.st_mode);
+    data->input_chunk = isatty(infd) ? 1 : IO_IMPL_INPUT_SIZE;
+    data->input_pos = 0;
+    data->input_len = 0;
     data->infd = infd;
     data->outfd = outfd;
+    data->raw_terminal = 0;
+    data->flush_policy = IO_IMPL_FLUSH_DEFAULT;
+    data->output_len = 0;
+    io_impl_poll_soon(data);
     impl_init_device_io(io, data);
     return io;
 }
 
+/* policy is made of IO_IMPL_FLUSH_* flags. Output is written out whenever the buffer fills
+ * and, whatever the policy, when the io is freed. */
+void io_impl_set_flush_policy(struct device_io *io, int policy) {
+    struct device_io_impl_data *data;
+    data = io->data;
+    data->flush_policy = policy;
+    if (policy & IO_IMPL_FLUSH_EACH) {
+        io_impl_flush(data);
+    }
+}
+
 void free_io_impl(struct device_io *io) {
+    io_impl_flush(io->data);
     free(io->data);
     free(io);
 }
@@ -3,7 +3,15 @@
 
 #include "device_io.h"
 
+/* io_impl_set_flush_policy flags */
+#define IO_IMPL_FLUSH_EACH    0x1 /* after every write, unbuffered */
+#define IO_IMPL_FLUSH_NEWLINE 0x2
+#define IO_IMPL_FLUSH_INPUT   0x4 /* before checking for or waiting on input */
+#define IO_IMPL_FLUSH_END     0x8 /* when the simulator stops running */
+#define IO_IMPL_FLUSH_DEFAULT (IO_IMPL_FLUSH_NEWLINE | IO_IMPL_FLUSH_INPUT | IO_IMPL_FLUSH_END)
+
 struct device_io *create_device_io_impl(int, int);
+void io_impl_set_flush_policy(struct device_io *, int);
 void free_io_impl(struct device_io *);
 
 #endif
\ No newline at end of file
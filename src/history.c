@@ -0,0 +1,287 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "history.h"
+#include "util.h"
+
+#define HISTORY_PAGE_BITS 8
+#define HISTORY_PAGE_SIZE (1 << HISTORY_PAGE_BITS)
+#define HISTORY_NUM_PAGES (65536 / HISTORY_PAGE_SIZE)
+#define HISTORY_PAGE(address) ((address) >> HISTORY_PAGE_BITS)
+
+/* Room in the write log per step, older steps are dropped sooner when instructions store more */
+#define HISTORY_WRITES_PER_STEP 2
+/* of steps or checkpoints, keeps every allocation's size in range */
+#define HISTORY_MAX_SIZE ((size_t)1 << 24)
+
+/* The machine before an instruction, an interrupt or an edit, the writes it made start at first_write */
+struct history_step {
+    struct cpu_state before;
+    unsigned long long first_write;
+};
+
+struct history_write {
+    uint16_t address;
+    uint16_t old;
+};
+
+/* The cpu at a point and the pages written since the checkpoint before it, as they were at
+ * that point. The oldest checkpoint has every page. */
+struct history_checkpoint {
+    struct cpu_state cpu;
+    unsigned long long step; /* the steps before it are those numbered below this */
+    uint16_t *pages[HISTORY_NUM_PAGES]; /* NULL where not written, history_zero_page for zeroes */
+};
+
+/* steps and writes are rings indexed by counts that only grow, what is kept being from *_begin
+ * to *_end. Their capacities are powers of two. Further back the machine can only return to a
+ * checkpoint. */
+struct history {
+    const uint16_t *memory;
+    struct history_step *steps;
+    size_t steps_capacity;
+    unsigned long long steps_begin, steps_end;
+    struct history_write *writes;
+    size_t writes_capacity;
+    unsigned long long writes_begin, writes_end;
+    struct history_checkpoint **checkpoints; /* oldest first */
+    size_t num_checkpoints;
+    size_t max_checkpoints;
+    unsigned long long checkpoint_interval;
+    unsigned char written_pages[HISTORY_NUM_PAGES]; /* since the latest checkpoint */
+};
+
+static uint16_t history_zero_page[HISTORY_PAGE_SIZE];
+
+/* memory has to stay where it is for the history's lifetime. log_size is rounded up to a
+ * power of two. Sizes are kept between 1 and HISTORY_MAX_SIZE. */
+History *history_new(const uint16_t *memory, size_t log_size, unsigned long long checkpoint_interval,
+                     size_t max_checkpoints) {
+    History *history;
+    history = safe_malloc(sizeof(History));
+    history->memory = memory;
+    for (history->steps_capacity = 1;
+         history->steps_capacity < log_size && history->steps_capacity < HISTORY_MAX_SIZE;
+         history->steps_capacity *= 2);
+    history->writes_capacity = history->steps_capacity * HISTORY_WRITES_PER_STEP;
+    history->steps = safe_malloc(sizeof(struct history_step) * history->steps_capacity);
+    history->writes = safe_malloc(sizeof(struct history_write) * history->writes_capacity);
+    history->checkpoint_interval = checkpoint_interval > 0 ? checkpoint_interval : 1;
+    history->max_checkpoints = max_checkpoints == 0 ? 1 : max_checkpoints > HISTORY_MAX_SIZE ? HISTORY_MAX_SIZE
+                               : max_checkpoints;
+    /* one over, for the newest before the oldest two are folded together */
+    history->checkpoints = safe_malloc(sizeof(struct history_checkpoint *) * (history->max_checkpoints + 1));
+    history->num_checkpoints = 0;
+    history->steps_begin = history->steps_end = 0;
+    history->writes_begin = history->writes_end = 0;
+    memset(history->written_pages, 0, sizeof(history->written_pages));
+    return history;
+}
+
+static void history_free_page(uint16_t *page) {
+    if (page != history_zero_page) {
+        free(page);
+    }
+}
+
+static void history_free_checkpoint(struct history_checkpoint *checkpoint) {
+    int page;
+    for (page = 0; page < HISTORY_NUM_PAGES; ++page) {
+        if (checkpoint->pages[page] != NULL) {
+            history_free_page(checkpoint->pages[page]);
+        }
+    }
+    free(checkpoint);
+}
+
+/* Forgets everything, the next checkpoint taken holds all of memory */
+void history_clear(History *history) {
+    while (history->num_checkpoints > 0) {
+        history_free_checkpoint(history->checkpoints[--history->num_checkpoints]);
+    }
+    history->steps_begin = history->steps_end = 0;
+    history->writes_begin = history->writes_end = 0;
+    memset(history->written_pages, 0, sizeof(history->written_pages));
+}
+
+void history_free(History *history) {
+    history_clear(history);
+    free(history->checkpoints);
+    free(history->writes);
+    free(history->steps);
+    free(history);
+}
+
+/* Whether there is a checkpoint to go back to */
+int history_started(History *history) {
+    return history->num_checkpoints > 0;
+}
+
+static void history_drop_oldest_step(History *history) {
+    ++history->steps_begin;
+    history->writes_begin = history->steps_begin < history->steps_end
+                            ? history->steps[history->steps_begin & (history->steps_capacity - 1)].first_write
+                            : history->writes_end;
+}
+
+/* Starts a step, the writes logged until the next one are undone with it */
+void history_add_step(History *history, const struct cpu_state *before) {
+    struct history_step *step;
+    if (history->steps_end - history->steps_begin == history->steps_capacity) {
+        history_drop_oldest_step(history);
+    }
+    step = &history->steps[history->steps_end++ & (history->steps_capacity - 1)];
+    step->before = *before;
+    step->first_write = history->writes_end;
+}
+
+/* Called before memory at address changes from old */
+void history_log_write(History *history, uint16_t address, uint16_t old) {
+    struct history_write *write;
+    history->written_pages[HISTORY_PAGE(address)] = 1;
+    while (history->writes_end - history->writes_begin == history->writes_capacity) {
+        history_drop_oldest_step(history);
+    }
+    if (history->steps_begin == history->steps_end) {
+        return; /* the step it belongs to is gone, it can't be undone */
+    }
+    write = &history->writes[history->writes_end++ & (history->writes_capacity - 1)];
+    write->address = address;
+    write->old = old;
+}
+
+/* Drops the checkpoints from after the steps that are left, the pages they hold are then
+ * written since the latest one. The oldest is never after a step that is left. */
+static void history_drop_later_checkpoints(History *history) {
+    struct history_checkpoint *checkpoint;
+    int page;
+    while (history->checkpoints[history->num_checkpoints - 1]->step > history->steps_end) {
+        checkpoint = history->checkpoints[--history->num_checkpoints];
+        for (page = 0; page < HISTORY_NUM_PAGES; ++page) {
+            history->written_pages[page] |= checkpoint->pages[page] != NULL;
+        }
+        history_free_checkpoint(checkpoint);
+    }
+}
+
+/* Undoes the latest step, restore is called with data for every word to put back, latest
+ * first. Gives the cpu as it was before the step. Returns 0 if there are no steps left or the
+ * latest is from before the oldest checkpoint, history never goes back further than that. */
+int history_undo_step(History *history, void (*restore)(void *, uint16_t, uint16_t), void *data,
+                      struct cpu_state *before) {
+    struct history_step *step;
+    struct history_write *write;
+    if (history->steps_begin == history->steps_end || history->num_checkpoints == 0 ||
+        history->steps_end <= history->checkpoints[0]->step) {
+        return 0;
+    }
+    step = &history->steps[--history->steps_end & (history->steps_capacity - 1)];
+    while (history->writes_end > step->first_write) {
+        write = &history->writes[--history->writes_end & (history->writes_capacity - 1)];
+        restore(data, write->address, write->old);
+    }
+    *before = step->before;
+    history_drop_later_checkpoints(history);
+    return 1;
+}
+
+/* The retired instruction count at which the next checkpoint is due, 0 before the first */
+unsigned long long history_checkpoint_deadline(History *history) {
+    if (history->num_checkpoints == 0) {
+        return 0;
+    }
+    return history->checkpoints[history->num_checkpoints - 1]->cpu.retired + history->checkpoint_interval;
+}
+
+static uint16_t *history_capture_page(History *history, int page) {
+    const uint16_t *words;
+    uint16_t *copy;
+    words = history->memory + (page << HISTORY_PAGE_BITS);
+    if (memcmp(words, history_zero_page, sizeof(history_zero_page)) == 0) {
+        return history_zero_page;
+    }
+    copy = safe_malloc(sizeof(history_zero_page));
+    memcpy(copy, words, sizeof(history_zero_page));
+    return copy;
+}
+
+/* Folds the second oldest checkpoint into the oldest, which keeps holding every page */
+static void history_fold_oldest(History *history) {
+    struct history_checkpoint *oldest, *next;
+    int page;
+    oldest = history->checkpoints[0];
+    next = history->checkpoints[1];
+    for (page = 0; page < HISTORY_NUM_PAGES; ++page) {
+        if (next->pages[page] != NULL) {
+            history_free_page(oldest->pages[page]);
+            oldest->pages[page] = next->pages[page];
+        }
+    }
+    oldest->cpu = next->cpu;
+    oldest->step = next->step;
+    free(next);
+    memmove(history->checkpoints + 1, history->checkpoints + 2,
+            sizeof(struct history_checkpoint *) * (history->num_checkpoints - 2));
+    --history->num_checkpoints;
+}
+
+/* Copies the pages written since the latest checkpoint, or all of them for the first */
+void history_checkpoint(History *history, const struct cpu_state *cpu) {
+    struct history_checkpoint *checkpoint;
+    int page, first;
+    checkpoint = safe_malloc(sizeof(struct history_checkpoint));
+    checkpoint->cpu = *cpu;
+    checkpoint->step = history->steps_end;
+    first = history->num_checkpoints == 0;
+    for (page = 0; page < HISTORY_NUM_PAGES; ++page) {
+        checkpoint->pages[page] = first || history->written_pages[page] ? history_capture_page(history, page) : NULL;
+    }
+    memset(history->written_pages, 0, sizeof(history->written_pages));
+    history->checkpoints[history->num_checkpoints++] = checkpoint;
+    if (history->num_checkpoints > history->max_checkpoints) {
+        history_fold_oldest(history);
+    }
+}
+
+/* Goes back to the latest checkpoint at or before target retired instructions, or the oldest
+ * if there is none, calling restore with data for each word that differs. Every step is
+ * dropped and so are the later checkpoints. Gives the cpu at the checkpoint, returns 0 if
+ * there isn't one. */
+int history_rewind(History *history, unsigned long long target, void (*restore)(void *, uint16_t, uint16_t),
+                   void *data, struct cpu_state *cpu) {
+    size_t kept, i;
+    int page, word;
+    const uint16_t *from;
+    uint16_t address;
+    if (history->num_checkpoints == 0) {
+        return 0;
+    }
+    for (kept = history->num_checkpoints - 1; kept > 0 && history->checkpoints[kept]->cpu.retired > target; --kept);
+    for (page = 0; page < HISTORY_NUM_PAGES; ++page) {
+        int written;
+        written = history->written_pages[page];
+        for (i = kept + 1; i < history->num_checkpoints && !written; ++i) {
+            written = history->checkpoints[i]->pages[page] != NULL;
+        }
+        if (!written) {
+            continue;
+        }
+        for (i = kept; history->checkpoints[i]->pages[page] == NULL; --i);
+        from = history->checkpoints[i]->pages[page];
+        for (word = 0; word < HISTORY_PAGE_SIZE; ++word) {
+            address = (page << HISTORY_PAGE_BITS) | word;
+            if (history->memory[address] != from[word]) {
+                restore(data, address, from[word]);
+            }
+        }
+    }
+    while (history->num_checkpoints > kept + 1) {
+        history_free_checkpoint(history->checkpoints[--history->num_checkpoints]);
+    }
+    memset(history->written_pages, 0, sizeof(history->written_pages));
+    history->steps_begin = history->steps_end;
+    history->writes_begin = history->writes_end;
+    *cpu = history->checkpoints[kept]->cpu;
+    return 1;
+}
@@ -0,0 +1,22 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "cpu.h"
+
+struct history;
+typedef struct history History;
+
+History *history_new(const uint16_t *, size_t, unsigned long long, size_t);
+void history_free(History *);
+void history_clear(History *);
+int history_started(History *);
+void history_add_step(History *, const struct cpu_state *);
+void history_log_write(History *, uint16_t, uint16_t);
+int history_undo_step(History *, void (*)(void *, uint16_t, uint16_t), void *, struct cpu_state *);
+unsigned long long history_checkpoint_deadline(History *);
+void history_checkpoint(History *, const struct cpu_state *);
+int history_rewind(History *, unsigned long long, void (*)(void *, uint16_t, uint16_t), void *, struct cpu_state *);
+#endif
@@ -3,13 +3,23 @@
 
 #include<stdint.h>
 
+/* levels is what interrupt_controller_pending_levels points to, priority the PSR's */
+#define INTERRUPT_PENDING_ABOVE(levels, priority) (((levels) >> ((priority) + 1)) != 0)
+
+/* interrupt_controller_get_pending gives the priority of every vector, this where none is pending */
+#define INTERRUPT_NOT_PENDING 255
+#define INTERRUPT_NUM_VECTORS 256
+
 struct interrupt_controller;
 typedef struct interrupt_controller InterruptController;
 
 InterruptController *interrupt_controller_new(void);
 void interrupt_controller_free(InterruptController *);
+void interrupt_controller_reset(InterruptController *);
+const uint8_t *interrupt_controller_pending_levels(InterruptController *);
 void interrupt_controller_alert(InterruptController *, uint8_t, uint8_t);
 int interrupt_controller_peek(InterruptController *, uint8_t *, uint8_t *);
 void interrupt_controller_take(InterruptController *);
-int check_heap(InterruptController *);
+void interrupt_controller_get_pending(InterruptController *, uint8_t *);
+void interrupt_controller_set_pending(InterruptController *, const uint8_t *);
 #endif
\ No newline at end of file
@@ -0,0 +1,840 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+#include "jit.h"
+#include "lc3_instruction.h"
+#include "lc3_reg.h"
+#include "util.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define JIT_X86_64
+#endif
+
+#ifdef JIT_X86_64
+
+#include <sys/mman.h>
+
+#define JIT_CODE_CACHE_SIZE    (4 * 1024 * 1024)
+#define JIT_CODE_CACHE_RESERVE (16 * 1024) /* room always left for one more block */
+#define JIT_MAX_BLOCK_LEN      32
+
+#define JIT_PAGE_SIZE  256
+#define JIT_NUM_PAGES  (UINT16_MAX / JIT_PAGE_SIZE + 1)
+#define JIT_PAGE(address)   ((address) >> 8)
+#define JIT_OFFSET(address) ((address) & 0x00FF)
+
+#define JIT_WATCH_TRANSLATED 0x01
+#define JIT_WATCH_HOST       0x02
+#define JIT_WATCH_BREAKPOINT 0x04
+
+/* what translated code hands back in rax, anything else is the address of a jump to patch */
+#define JIT_EXIT_DISPATCH 0
+#define JIT_EXIT_LEAVE    1
+
+#define PSR_NZP_CLEAR_MASK 0xFFF8
+
+/* host registers. Guest R0-R7 live in r8-r15, rbx points at the struct jit and rbp at memory */
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define GUEST(reg) (8 + (reg))
+
+#define CC_NE 0x5
+#define CC_E  0x4
+#define CC_S  0x8
+#define CC_NS 0x9
+#define CC_GE 0xD
+#define CC_LE 0xE
+#define CC_G  0xF
+
+#define JIT_REG_DISP(reg) (offsetof(struct jit, regs) + sizeof(uint16_t) * (reg))
+#define JIT_BUDGET_DISP   (offsetof(struct jit, budget))
+#define JIT_MEMORY_DISP   (offsetof(struct jit, host) + offsetof(struct jit_host, memory))
+#define JIT_WATCH_DISP    (offsetof(struct jit, watch))
+
+typedef uintptr_t (*jit_entry)(struct jit *, unsigned char *);
+
+struct jit {
+    struct jit_host host;
+    uint16_t regs[num_registers];
+    long long budget;
+    int flush_pending;
+    unsigned long generation;
+    unsigned char *code;
+    size_t code_used;
+    size_t code_fixed;
+    jit_entry entry;
+    unsigned char *exit;
+    int32_t special_disp; /* special_pages - memory, in bytes */
+    int32_t dirty_disp; /* dirty_pages - memory, in bytes */
+    int leave_traps; /* traps end blocks untranslated, for the interpreter's fast traps */
+    unsigned char **blocks[JIT_NUM_PAGES];
+    unsigned char watched_pages[JIT_NUM_PAGES]; /* 1 where some address of the page has watch bits */
+    unsigned char watch[UINT16_MAX + 1];
+};
+
+struct emitter {
+    unsigned char *buf;
+    size_t pos;
+};
+
+/* translation state of the block being built */
+struct jit_block_state {
+    int cc_reg;      /* guest register holding the last condition code result, -1 if it is in the PSR */
+    int length;
+    int index;
+};
+
+static uint16_t sign_extend(uint16_t value, int num_bits) {
+    uint16_t sign_bit = 1 << (num_bits - 1);
+    value &= ~(0xFFFF << num_bits);
+    return (value ^ sign_bit) - sign_bit;
+}
+
+static void emit8(struct emitter *e, unsigned value) {
+    e->buf[e->pos++] = value;
+}
+
+static void emit16(struct emitter *e, unsigned value) {
+    emit8(e, value & 0xFF);
+    emit8(e, (value >> 8) & 0xFF);
+}
+
+static void emit32(struct emitter *e, uint32_t value) {
+    emit16(e, value & 0xFFFF);
+    emit16(e, value >> 16);
+}
+
+static void emit64(struct emitter *e, uint64_t value) {
+    emit32(e, value & 0xFFFFFFFF);
+    emit32(e, value >> 32);
+}
+
+static void emit_rex(struct emitter *e, int w, int reg, int rm) {
+    unsigned rex;
+    rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40) {
+        emit8(e, rex);
+    }
+}
+
+static void emit_modrm(struct emitter *e, int mod, int reg, int rm) {
+    emit8(e, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* [rbx + disp32] */
+static void emit_ctx_modrm(struct emitter *e, int reg, size_t disp) {
+    emit_modrm(e, 2, reg, RBX);
+    emit32(e, disp);
+}
+
+/* op r/m16, r16 */
+static void emit_op16_rr(struct emitter *e, unsigned opcode, int dst, int src) {
+    emit8(e, 0x66);
+    emit_rex(e, 0, src, dst);
+    emit8(e, opcode);
+    emit_modrm(e, 3, src, dst);
+}
+
+/* op r/m16, imm16 where ext selects the operation */
+static void emit_op16_ri(struct emitter *e, int ext, int dst, uint16_t imm) {
+    emit8(e, 0x66);
+    emit_rex(e, 0, 0, dst);
+    emit8(e, 0x81);
+    emit_modrm(e, 3, ext, dst);
+    emit16(e, imm);
+}
+
+static void emit_not16(struct emitter *e, int dst) {
+    emit8(e, 0x66);
+    emit_rex(e, 0, 0, dst);
+    emit8(e, 0xF7);
+    emit_modrm(e, 3, 2, dst);
+}
+
+static void emit_mov32_rr(struct emitter *e, int dst, int src) {
+    emit_rex(e, 0, src, dst);
+    emit8(e, 0x89);
+    emit_modrm(e, 3, src, dst);
+}
+
+static void emit_mov32_ri(struct emitter *e, int dst, uint32_t imm) {
+    emit_rex(e, 0, 0, dst);
+    emit8(e, 0xB8 + (dst & 7));
+    emit32(e, imm);
+}
+
+static void emit_ctx_load16(struct emitter *e, int dst, size_t disp) {
+    emit_rex(e, 0, dst, 0);
+    emit8(e, 0x0F);
+    emit8(e, 0xB7);
+    emit_ctx_modrm(e, dst, disp);
+}
+
+static void emit_ctx_store16_r(struct emitter *e, size_t disp, int src) {
+    emit8(e, 0x66);
+    emit_rex(e, 0, src, 0);
+    emit8(e, 0x89);
+    emit_ctx_modrm(e, src, disp);
+}
+
+static void emit_ctx_store16_i(struct emitter *e, size_t disp, uint16_t imm) {
+    emit8(e, 0x66);
+    emit8(e, 0xC7);
+    emit_ctx_modrm(e, 0, disp);
+    emit16(e, imm);
+}
+
+static void emit_ctx_op16_i(struct emitter *e, int ext, size_t disp, uint16_t imm) {
+    emit8(e, 0x66);
+    emit8(e, 0x81);
+    emit_ctx_modrm(e, ext, disp);
+    emit16(e, imm);
+}
+
+static void emit_ctx_or16_r(struct emitter *e, size_t disp, int src) {
+    emit8(e, 0x66);
+    emit_rex(e, 0, src, 0);
+    emit8(e, 0x09);
+    emit_ctx_modrm(e, src, disp);
+}
+
+static void emit_ctx_op64_i(struct emitter *e, int ext, size_t disp, int32_t imm) {
+    emit8(e, 0x48);
+    emit8(e, 0x81);
+    emit_ctx_modrm(e, ext, disp);
+    emit32(e, imm);
+}
+
+static void emit_ctx_test8_i(struct emitter *e, size_t disp, uint8_t imm) {
+    emit8(e, 0xF6);
+    emit_ctx_modrm(e, 0, disp);
+    emit8(e, imm);
+}
+
+static size_t emit_jcc(struct emitter *e, int cc) {
+    emit8(e, 0x0F);
+    emit8(e, 0x80 | cc);
+    emit32(e, 0);
+    return e->pos - 4;
+}
+
+static size_t emit_jmp(struct emitter *e) {
+    emit8(e, 0xE9);
+    emit32(e, 0);
+    return e->pos - 4;
+}
+
+static void emit_jmp_to(struct emitter *e, unsigned char *target) {
+    emit8(e, 0xE9);
+    emit32(e, (uint32_t)(target - (e->buf + e->pos + 4)));
+}
+
+static void patch_rel32(unsigned char *site, unsigned char *target) {
+    int32_t rel;
+    rel = (int32_t)(target - (site + 4));
+    memcpy(site, &rel, sizeof(rel));
+}
+
+static void patch_here(struct emitter *e, size_t site) {
+    patch_rel32(e->buf + site, e->buf + e->pos);
+}
+
+/* NZP from the guest register holding the last result, merged into the PSR */
+static void emit_materialize_cc(struct emitter *e, int cc_reg) {
+    if (cc_reg < 0) {
+        return;
+    }
+    emit8(e, 0x31); emit8(e, 0xC0);             /* xor eax, eax */
+    emit8(e, 0x31); emit8(e, 0xC9);             /* xor ecx, ecx */
+    emit_op16_rr(e, 0x85, GUEST(cc_reg), GUEST(cc_reg));
+    emit8(e, 0x0F); emit8(e, 0x9F); emit8(e, 0xC0); /* setg al */
+    emit8(e, 0x0F); emit8(e, 0x94); emit8(e, 0xC1); /* sete cl */
+    emit8(e, 0x8D); emit8(e, 0x04); emit8(e, 0x48); /* lea eax, [rax + rcx * 2] */
+    emit_mov32_rr(e, RCX, GUEST(cc_reg));
+    emit8(e, 0xC1); emit8(e, 0xE9); emit8(e, 0x0F); /* shr ecx, 15 */
+    emit8(e, 0x8D); emit8(e, 0x04); emit8(e, 0x88); /* lea eax, [rax + rcx * 4] */
+    emit_ctx_op16_i(e, 4, JIT_REG_DISP(REG_PSR), PSR_NZP_CLEAR_MASK);
+    emit_ctx_or16_r(e, JIT_REG_DISP(REG_PSR), RAX);
+}
+
+/* store the pc and ask the dispatcher to link this exit straight to the block at pc */
+static void emit_exit_chain(struct emitter *e, Jit *jit, uint16_t pc) {
+    size_t site;
+    emit_ctx_store16_i(e, JIT_REG_DISP(REG_PC), pc);
+    site = emit_jmp(e);
+    emit8(e, 0x48); emit8(e, 0xB8);               /* mov rax, site */
+    emit64(e, (uintptr_t)(e->buf + site));
+    emit_jmp_to(e, jit->exit);
+}
+
+/* the pc is already stored */
+static void emit_exit_dispatch(struct emitter *e, Jit *jit) {
+    emit8(e, 0x31); emit8(e, 0xC0);
+    emit_jmp_to(e, jit->exit);
+}
+
+static void emit_exit_leave(struct emitter *e, Jit *jit, uint16_t pc, int refund) {
+    if (refund != 0) {
+        emit_ctx_op64_i(e, 0, JIT_BUDGET_DISP, refund);
+    }
+    emit_ctx_store16_i(e, JIT_REG_DISP(REG_PC), pc);
+    emit_mov32_ri(e, RAX, JIT_EXIT_LEAVE);
+    emit_jmp_to(e, jit->exit);
+}
+
+static uint16_t jit_helper_read(Jit *jit, uint16_t address) {
+    return jit->host.read(jit->host.data, address);
+}
+
+static int jit_helper_write(Jit *jit, uint16_t address, uint16_t value) {
+    return jit->host.write(jit->host.data, address, value) || jit->flush_pending;
+}
+
+/* address in ecx, value in edx if value_reg is set. Guest registers in r8-r11 are caller saved */
+static void emit_call_helper(struct emitter *e, uintptr_t helper, int value_reg) {
+    int reg;
+    for (reg = GUEST(0); reg <= GUEST(3); ++reg) {
+        emit8(e, 0x41); emit8(e, 0x50 + (reg & 7));
+    }
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xDF); /* mov rdi, rbx */
+    emit8(e, 0x89); emit8(e, 0xCE);                 /* mov esi, ecx */
+    if (value_reg >= 0) {
+        emit_mov32_rr(e, RDX, value_reg);
+    }
+    emit8(e, 0x48); emit8(e, 0xB8);
+    emit64(e, helper);
+    emit8(e, 0xFF); emit8(e, 0xD0);                 /* call rax */
+    for (reg = GUEST(3); reg >= GUEST(0); --reg) {
+        emit8(e, 0x41); emit8(e, 0x58 + (reg & 7));
+    }
+}
+
+/* Tests whether the address in ecx is in a special page, then rdx = address of its word.
+ * For stores the page is marked dirty too. */
+static void emit_memory_lookup(struct emitter *e, Jit *jit, int store) {
+    emit8(e, 0x89); emit8(e, 0xCA);                 /* mov edx, ecx */
+    emit8(e, 0xC1); emit8(e, 0xEA);                 /* shr edx, page_bits */
+    emit8(e, jit->host.page_bits);
+    if (store) {
+        emit8(e, 0xC6);                             /* mov byte [rbp + rdx + dirty], 1 */
+        emit_modrm(e, 2, 0, 4);
+        emit8(e, (RDX << 3) | RBP);
+        emit32(e, (uint32_t)jit->dirty_disp);
+        emit8(e, 1);
+    }
+    emit8(e, 0x80);                                 /* cmp byte [rbp + rdx + special], 0 */
+    emit_modrm(e, 2, 7, 4);
+    emit8(e, (RDX << 3) | RBP);
+    emit32(e, (uint32_t)jit->special_disp);
+    emit8(e, 0);
+    emit8(e, 0x48); emit8(e, 0x8D);                 /* lea rdx, [rbp + rcx * 2] */
+    emit_modrm(e, 1, RDX, 4);
+    emit8(e, (1 << 6) | (RCX << 3) | RBP);
+    emit8(e, 0);
+}
+
+/* address in ecx, value zero extended into eax */
+static void emit_load(struct emitter *e, Jit *jit) {
+    size_t slow, done;
+    emit_memory_lookup(e, jit, 0);
+    slow = emit_jcc(e, CC_NE);
+    emit8(e, 0x0F); emit8(e, 0xB7); emit8(e, 0x02);  /* movzx eax, word [rdx] */
+    done = emit_jmp(e);
+    patch_here(e, slow);
+    emit_call_helper(e, (uintptr_t)jit_helper_read, -1);
+    emit8(e, 0x0F); emit8(e, 0xB7); emit8(e, 0xC0);  /* movzx eax, ax */
+    patch_here(e, done);
+}
+
+/* address in ecx. Leaves the block when the host asks for it */
+static void emit_store(struct emitter *e, Jit *jit, int src, uint16_t next_pc, struct jit_block_state *state) {
+    size_t watched, slow, done, resume;
+    emit8(e, 0x80);                                 /* cmp byte [rbx + rcx + watch], 0 */
+    emit_modrm(e, 2, 7, 4);
+    emit8(e, (RCX << 3) | RBX);
+    emit32(e, JIT_WATCH_DISP);
+    emit8(e, 0);
+    watched = emit_jcc(e, CC_NE);
+    emit_memory_lookup(e, jit, 1);
+    slow = emit_jcc(e, CC_NE);
+    emit8(e, 0x66);                                 /* mov word [rdx], src */
+    emit_rex(e, 0, src, 0);
+    emit8(e, 0x89);
+    emit_modrm(e, 0, src, RDX);
+    done = emit_jmp(e);
+    patch_here(e, watched);
+    patch_here(e, slow);
+    emit_call_helper(e, (uintptr_t)jit_helper_write, src);
+    emit8(e, 0x85); emit8(e, 0xC0);                 /* test eax, eax */
+    resume = emit_jcc(e, CC_E);
+    emit_materialize_cc(e, state->cc_reg);
+    emit_exit_leave(e, jit, next_pc, state->length - (state->index + 1));
+    patch_here(e, resume);
+    patch_here(e, done);
+}
+
+static int branch_condition(unsigned nzp) {
+    static const int conditions[8] = {0, CC_G, CC_E, CC_NS, CC_S, CC_NE, CC_LE, 0};
+    return conditions[nzp];
+}
+
+static void translate_br(struct emitter *e, Jit *jit, uint16_t instruction, uint16_t next_pc, struct jit_block_state *state) {
+    unsigned nzp;
+    uint16_t target;
+    size_t taken;
+    int cc;
+    nzp = NZP_INSTRU(instruction) & 0x0007;
+    target = next_pc + sign_extend(PCOFFSET9(instruction), 9);
+    emit_materialize_cc(e, state->cc_reg);
+    if (state->cc_reg >= 0 && nzp == 0x0007) {
+        emit_exit_chain(e, jit, target);
+        return;
+    }
+    if (state->cc_reg >= 0) {
+        emit_op16_rr(e, 0x85, GUEST(state->cc_reg), GUEST(state->cc_reg));
+        cc = branch_condition(nzp);
+    } else {
+        emit_ctx_test8_i(e, JIT_REG_DISP(REG_PSR), nzp);
+        cc = CC_NE;
+    }
+    taken = emit_jcc(e, cc);
+    emit_exit_chain(e, jit, next_pc);
+    patch_here(e, taken);
+    emit_exit_chain(e, jit, target);
+}
+
+static void translate_alu(struct emitter *e, uint16_t instruction, struct jit_block_state *state) {
+    int dr, sr1, sr2, ext;
+    unsigned opcode;
+    dr = GUEST(REG1_INSTRU(instruction));
+    sr1 = GUEST(REG2_INSTRU(instruction));
+    sr2 = GUEST(REG3_INSTRU(instruction));
+    ext = OPCODE(instruction) == ADD ? 0 : 4;
+    opcode = OPCODE(instruction) == ADD ? 0x01 : 0x21;
+    if (IS_IMM5(instruction)) {
+        if (dr != sr1) {
+            emit_mov32_rr(e, dr, sr1);
+        }
+        emit_op16_ri(e, ext, dr, sign_extend(IMM5(instruction), 5));
+    } else if (dr == sr1) {
+        emit_op16_rr(e, opcode, dr, sr2);
+    } else if (dr == sr2) {
+        emit_op16_rr(e, opcode, dr, sr1);
+    } else {
+        emit_mov32_rr(e, dr, sr1);
+        emit_op16_rr(e, opcode, dr, sr2);
+    }
+    state->cc_reg = REG1_INSTRU(instruction);
+}
+
+static int is_block_end(uint16_t instruction) {
+    switch (OPCODE(instruction)) {
+    case BR:
+        return (NZP_INSTRU(instruction) & 0x0007) != 0;
+    case JMP_RET:
+    case JSR_JSRR:
+    case TRAP:
+        return 1;
+    }
+    return 0;
+}
+
+static int is_translatable(uint16_t instruction) {
+    return OPCODE(instruction) != RTI && OPCODE(instruction) != RESERVED;
+}
+
+static void translate_instruction(struct emitter *e, Jit *jit, uint16_t instruction, uint16_t pc, struct jit_block_state *state) {
+    uint16_t next_pc, pc_offset9;
+    int dr, sr;
+    next_pc = pc + 1;
+    pc_offset9 = sign_extend(PCOFFSET9(instruction), 9);
+    dr = GUEST(REG1_INSTRU(instruction));
+    sr = GUEST(REG2_INSTRU(instruction));
+    switch (OPCODE(instruction)) {
+    case ADD:
+    case AND:
+        translate_alu(e, instruction, state);
+        break;
+    case NOT:
+        if (dr != sr) {
+            emit_mov32_rr(e, dr, sr);
+        }
+        emit_not16(e, dr);
+        state->cc_reg = REG1_INSTRU(instruction);
+        break;
+    case LEA:
+        emit_mov32_ri(e, dr, (uint16_t)(next_pc + pc_offset9));
+        state->cc_reg = REG1_INSTRU(instruction);
+        break;
+    case LD:
+        emit_mov32_ri(e, RCX, (uint16_t)(next_pc + pc_offset9));
+        emit_load(e, jit);
+        emit_mov32_rr(e, dr, RAX);
+        state->cc_reg = REG1_INSTRU(instruction);
+        break;
+    case LDI:
+        emit_mov32_ri(e, RCX, (uint16_t)(next_pc + pc_offset9));
+        emit_load(e, jit);
+        emit_mov32_rr(e, RCX, RAX);
+        emit_load(e, jit);
+        emit_mov32_rr(e, dr, RAX);
+        state->cc_reg = REG1_INSTRU(instruction);
+        break;
+    case LDR:
+        emit_mov32_rr(e, RCX, sr);
+        emit_op16_ri(e, 0, RCX, sign_extend(OFFSET6(instruction), 6));
+        emit_load(e, jit);
+        emit_mov32_rr(e, dr, RAX);
+        state->cc_reg = REG1_INSTRU(instruction);
+        break;
+    case ST:
+        emit_mov32_ri(e, RCX, (uint16_t)(next_pc + pc_offset9));
+        emit_store(e, jit, dr, next_pc, state);
+        break;
+    case STI:
+        emit_mov32_ri(e, RCX, (uint16_t)(next_pc + pc_offset9));
+        emit_load(e, jit);
+        emit_mov32_rr(e, RCX, RAX);
+        emit_store(e, jit, dr, next_pc, state);
+        break;
+    case STR:
+        emit_mov32_rr(e, RCX, sr);
+        emit_op16_ri(e, 0, RCX, sign_extend(OFFSET6(instruction), 6));
+        emit_store(e, jit, dr, next_pc, state);
+        break;
+    case BR:
+        if (is_block_end(instruction)) {
+            translate_br(e, jit, instruction, next_pc, state);
+        }
+        break;
+    case JMP_RET:
+        emit_materialize_cc(e, state->cc_reg);
+        emit_ctx_store16_r(e, JIT_REG_DISP(REG_PC), sr);
+        emit_exit_dispatch(e, jit);
+        break;
+    case JSR_JSRR:
+        emit_materialize_cc(e, state->cc_reg);
+        if (IS_JSR(instruction)) {
+            emit_mov32_ri(e, GUEST(REG_R7), next_pc);
+            emit_exit_chain(e, jit, next_pc + sign_extend(PCOFFSET11(instruction), 11));
+        } else {
+            emit_mov32_rr(e, RAX, sr);
+            emit_op16_ri(e, 0, RAX, next_pc);
+            emit_mov32_ri(e, GUEST(REG_R7), next_pc);
+            emit_ctx_store16_r(e, JIT_REG_DISP(REG_PC), RAX);
+            emit_exit_dispatch(e, jit);
+        }
+        break;
+    case TRAP:
+        emit_materialize_cc(e, state->cc_reg);
+        emit_mov32_ri(e, RCX, TRAPVECT8(instruction));
+        emit_load(e, jit);
+        emit_ctx_store16_r(e, JIT_REG_DISP(REG_PC), RAX);
+        emit_mov32_ri(e, GUEST(REG_R7), next_pc);
+        emit_exit_dispatch(e, jit);
+        break;
+    }
+}
+
+static uint16_t *jit_memory_word(Jit *jit, uint16_t address) {
+    return &jit->host.memory[address];
+}
+
+static int jit_is_device_register(Jit *jit, uint16_t address) {
+    return jit->host.special_pages[address >> jit->host.page_bits] != 0;
+}
+
+static void jit_flush(Jit *jit) {
+    int i, j;
+    for (i = 0; i < JIT_NUM_PAGES; ++i) {
+        free(jit->blocks[i]);
+        jit->blocks[i] = NULL;
+        if (!jit->watched_pages[i]) {
+            continue;
+        }
+        for (j = i * JIT_PAGE_SIZE; j < (i + 1) * JIT_PAGE_SIZE; ++j) {
+            jit->watch[j] &= ~JIT_WATCH_TRANSLATED;
+        }
+    }
+    jit->code_used = jit->code_fixed;
+    jit->flush_pending = 0;
+    ++jit->generation;
+}
+
+static unsigned char *jit_lookup(Jit *jit, uint16_t pc) {
+    unsigned char **page;
+    page = jit->blocks[JIT_PAGE(pc)];
+    return page == NULL ? NULL : page[JIT_OFFSET(pc)];
+}
+
+static void jit_add_block(Jit *jit, uint16_t pc, unsigned char *code) {
+    unsigned char **page;
+    page = jit->blocks[JIT_PAGE(pc)];
+    if (page == NULL) {
+        page = safe_malloc(sizeof(unsigned char *) * JIT_PAGE_SIZE);
+        memset(page, 0, sizeof(unsigned char *) * JIT_PAGE_SIZE);
+        jit->blocks[JIT_PAGE(pc)] = page;
+    }
+    page[JIT_OFFSET(pc)] = code;
+}
+
+/* Polling loops are left to the interpreter, which notices when they stop making progress */
+static int is_poll_loop(Jit *jit, uint16_t pc) {
+    uint16_t instruction;
+    instruction = *jit_memory_word(jit, pc);
+    if (IS_POLL_BRANCH(instruction)) {
+        return IS_LOAD(*jit_memory_word(jit, (uint16_t)(pc - 1)));
+    }
+    return IS_LOAD(instruction) && IS_POLL_BRANCH(*jit_memory_word(jit, (uint16_t)(pc + 1)));
+}
+
+/* Translates the basic block starting at pc. NULL if its first instruction has to be interpreted */
+static unsigned char *jit_translate(Jit *jit, uint16_t start_pc) {
+    uint16_t instructions[JIT_MAX_BLOCK_LEN];
+    struct jit_block_state state;
+    struct emitter e;
+    uint16_t pc;
+    size_t enough_budget;
+    int i, length, ends_in_branch;
+    length = 0;
+    ends_in_branch = 0;
+    pc = start_pc;
+    while (length < JIT_MAX_BLOCK_LEN && !jit_is_device_register(jit, pc)) {
+        uint16_t instruction;
+        instruction = *jit_memory_word(jit, pc);
+        if (!is_translatable(instruction) || (jit->leave_traps && OPCODE(instruction) == TRAP) ||
+            is_poll_loop(jit, pc) || (jit->watch[pc] & JIT_WATCH_BREAKPOINT)) {
+            break;
+        }
+        instructions[length++] = instruction;
+        ++pc;
+        if (is_block_end(instruction)) {
+            ends_in_branch = 1;
+            break;
+        }
+    }
+    if (length == 0) {
+        return NULL;
+    }
+    if (JIT_CODE_CACHE_SIZE - jit->code_used < JIT_CODE_CACHE_RESERVE) {
+        jit_flush(jit);
+    }
+    e.buf = jit->code;
+    e.pos = jit->code_used;
+    state.cc_reg = -1;
+    state.length = length;
+    emit_ctx_op64_i(&e, 7, JIT_BUDGET_DISP, length);
+    enough_budget = emit_jcc(&e, CC_GE);
+    emit_exit_leave(&e, jit, start_pc, 0);
+    patch_here(&e, enough_budget);
+    emit_ctx_op64_i(&e, 5, JIT_BUDGET_DISP, length);
+    for (i = 0; i < length; ++i) {
+        state.index = i;
+        translate_instruction(&e, jit, instructions[i], start_pc + i, &state);
+        jit->watch[(uint16_t)(start_pc + i)] |= JIT_WATCH_TRANSLATED;
+        jit->watched_pages[JIT_PAGE((uint16_t)(start_pc + i))] = 1;
+    }
+    if (!ends_in_branch) {
+        emit_materialize_cc(&e, state.cc_reg);
+        if (length == JIT_MAX_BLOCK_LEN) {
+            emit_exit_chain(&e, jit, pc);
+        } else {
+            emit_exit_leave(&e, jit, pc, 0);
+        }
+    }
+    jit_add_block(jit, start_pc, jit->code + jit->code_used);
+    jit->code_used = e.pos;
+    return jit_lookup(jit, start_pc);
+}
+
+/* entry saves the host's callee saved registers and loads the guest registers, exit undoes it */
+static void jit_emit_trampolines(Jit *jit) {
+    struct emitter e;
+    int reg;
+    e.buf = jit->code;
+    e.pos = 0;
+    jit->entry = (jit_entry)(uintptr_t)e.buf;
+    emit8(&e, 0x53);                                 /* push rbx */
+    emit8(&e, 0x55);                                 /* push rbp */
+    for (reg = 12; reg <= 15; ++reg) {
+        emit8(&e, 0x41); emit8(&e, 0x50 + (reg & 7));
+    }
+    emit8(&e, 0x48); emit8(&e, 0x83); emit8(&e, 0xEC); emit8(&e, 0x08); /* sub rsp, 8 */
+    emit8(&e, 0x48); emit8(&e, 0x89); emit8(&e, 0xFB);                  /* mov rbx, rdi */
+    emit8(&e, 0x48); emit8(&e, 0x8B);                                   /* mov rbp, [rbx + memory] */
+    emit_ctx_modrm(&e, RBP, JIT_MEMORY_DISP);
+    for (reg = REG_R0; reg <= REG_R7; ++reg) {
+        emit_ctx_load16(&e, GUEST(reg), JIT_REG_DISP(reg));
+    }
+    emit8(&e, 0xFF); emit8(&e, 0xE6);                                   /* jmp rsi */
+    jit->exit = e.buf + e.pos;
+    for (reg = REG_R0; reg <= REG_R7; ++reg) {
+        emit_ctx_store16_r(&e, JIT_REG_DISP(reg), GUEST(reg));
+    }
+    emit8(&e, 0x48); emit8(&e, 0x83); emit8(&e, 0xC4); emit8(&e, 0x08); /* add rsp, 8 */
+    for (reg = 15; reg >= 12; --reg) {
+        emit8(&e, 0x41); emit8(&e, 0x58 + (reg & 7));
+    }
+    emit8(&e, 0x5D);                                 /* pop rbp */
+    emit8(&e, 0x5B);                                 /* pop rbx */
+    emit8(&e, 0xC3);                                 /* ret */
+    jit->code_fixed = e.pos;
+    jit->code_used = e.pos;
+}
+
+Jit *jit_new(struct jit_host *host) {
+    Jit *jit;
+    ptrdiff_t special_disp, dirty_disp;
+    void *code;
+    if (host->memory == NULL) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+    /* translated code reaches all three through the one base register */
+    special_disp = (const unsigned char *)host->special_pages - (const unsigned char *)host->memory;
+    dirty_disp = host->dirty_pages - (unsigned char *)host->memory;
+    if (special_disp < INT32_MIN || special_disp > INT32_MAX || dirty_disp < INT32_MIN || dirty_disp > INT32_MAX) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+    code = mmap(NULL, JIT_CODE_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        return NULL;
+    }
+    /* mapped so the parts of watch for pages never watched take no space */
+    jit = mmap(NULL, sizeof(Jit), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit == MAP_FAILED) {
+        munmap(code, JIT_CODE_CACHE_SIZE);
+        return NULL;
+    }
+    jit->host = *host;
+    jit->special_disp = special_disp;
+    jit->dirty_disp = dirty_disp;
+    jit->code = code;
+    jit_emit_trampolines(jit);
+    return jit;
+}
+
+void jit_free(Jit *jit) {
+    int i;
+    if (jit == NULL) {
+        return;
+    }
+    for (i = 0; i < JIT_NUM_PAGES; ++i) {
+        free(jit->blocks[i]);
+    }
+    munmap(jit->code, JIT_CODE_CACHE_SIZE);
+    munmap(jit, sizeof(Jit));
+}
+
+/* Runs translated code for at most budget instructions and returns how many were executed.
+ * Returns early when the next instruction has to be interpreted or the host asked to stop. */
+long long jit_run(Jit *jit, uint16_t *registers, long long budget) {
+    unsigned char *code, *chain_site;
+    unsigned long generation;
+    uintptr_t result;
+    memcpy(jit->regs, registers, sizeof(jit->regs));
+    jit->budget = budget;
+    chain_site = NULL;
+    for (;;) {
+        if (jit->flush_pending) {
+            jit_flush(jit);
+            chain_site = NULL;
+        }
+        generation = jit->generation;
+        code = jit_lookup(jit, jit->regs[REG_PC]);
+        if (code == NULL && (code = jit_translate(jit, jit->regs[REG_PC])) == NULL) {
+            break;
+        }
+        if (chain_site != NULL && generation == jit->generation) {
+            patch_rel32(chain_site, code);
+        }
+        result = jit->entry(jit, code);
+        if (result == JIT_EXIT_LEAVE) {
+            break;
+        }
+        chain_site = result == JIT_EXIT_DISPATCH ? NULL : (unsigned char *)result;
+    }
+    memcpy(registers, jit->regs, sizeof(jit->regs));
+    return budget - jit->budget;
+}
+
+void jit_watch(Jit *jit, uint16_t address) {
+    jit->watch[address] |= JIT_WATCH_HOST;
+    jit->watched_pages[JIT_PAGE(address)] = 1;
+}
+
+void jit_invalidate(Jit *jit, uint16_t address) {
+    if (jit->watch[address] & JIT_WATCH_TRANSLATED) {
+        jit->flush_pending = 1;
+    }
+}
+
+/* Drops all translations and watched addresses, as if the jit was new */
+void jit_reset(Jit *jit) {
+    int i;
+    jit_flush(jit);
+    for (i = 0; i < JIT_NUM_PAGES; ++i) {
+        if (jit->watched_pages[i]) {
+            memset(&jit->watch[i * JIT_PAGE_SIZE], 0, JIT_PAGE_SIZE);
+            jit->watched_pages[i] = 0;
+        }
+    }
+}
+
+void jit_leave_traps(Jit *jit, int leave) {
+    if (jit->leave_traps != leave) {
+        jit->leave_traps = leave;
+        jit_flush(jit);
+    }
+}
+
+/* Code at a breakpoint is never translated so the interpreter gets to stop there */
+void jit_set_breakpoint(Jit *jit, uint16_t address, int set) {
+    if (set) {
+        jit->watch[address] |= JIT_WATCH_BREAKPOINT;
+        jit->watched_pages[JIT_PAGE(address)] = 1;
+    } else {
+        jit->watch[address] &= ~JIT_WATCH_BREAKPOINT;
+    }
+    jit_invalidate(jit, address);
+}
+
+#else
+
+Jit *jit_new(struct jit_host *host) {
+    errno = ENOTSUP;
+    return NULL;
+}
+
+void jit_free(Jit *jit) {
+}
+
+long long jit_run(Jit *jit, uint16_t *registers, long long budget) {
+    return 0;
+}
+
+void jit_watch(Jit *jit, uint16_t address) {
+}
+
+void jit_invalidate(Jit *jit, uint16_t address) {
+}
+
+void jit_reset(Jit *jit) {
+}
+
+void jit_set_breakpoint(Jit *jit, uint16_t address, int set) {
+}
+
+void jit_leave_traps(Jit *jit, int leave) {
+}
+
+#endif
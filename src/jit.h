@@ -0,0 +1,34 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+
+#include "lc3_reg.h"
+
+struct jit;
+typedef struct jit Jit;
+
+/* How translated code reaches the rest of the machine. read and write are used
+ * for device registers and for stores that hit watched addresses. write returns
+ * nonzero when translated code has to give control back to the cpu. */
+struct jit_host {
+    void *data;
+    uint16_t (*read)(void *, uint16_t);
+    int (*write)(void *, uint16_t, uint16_t);
+    /* plain memory, see struct bus_direct_map */
+    uint16_t *memory;
+    const unsigned char *special_pages;
+    unsigned char *dirty_pages;
+    unsigned page_bits;
+};
+
+Jit *jit_new(struct jit_host *);
+void jit_free(Jit *);
+long long jit_run(Jit *, uint16_t *, long long);
+void jit_watch(Jit *, uint16_t);
+void jit_invalidate(Jit *, uint16_t);
+void jit_reset(Jit *);
+void jit_set_breakpoint(Jit *, uint16_t, int);
+void jit_leave_traps(Jit *, int);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef LC3_INSTRUCTION_H
+#define LC3_INSTRUCTION_H
+
+#define ADD      0x1
+#define AND      0x5
+#define BR       0x0
+#define JMP_RET  0xC
+#define JSR_JSRR 0x4
+#define LD       0x2
+#define LDI      0xA
+#define LDR      0x6
+#define LEA      0xE
+#define NOT      0x9
+#define RTI      0x8
+#define ST       0x3
+#define STI      0xB
+#define STR      0x7
+#define RESERVED 0xD
+#define TRAP     0xF
+
+#define OPCODE(instruction)      ((instruction) >> 12)
+#define REG1_INSTRU(instruction) (((instruction) >> 9) & 0x0007)
+#define REG2_INSTRU(instruction) (((instruction) >> 6) & 0x0007)
+#define REG3_INSTRU(instruction) ((instruction) & 0x0007)
+#define IMM5(instruction)        ((instruction) & 0x001F)
+#define PCOFFSET9(instruction)   ((instruction) & 0x01FF)
+#define PCOFFSET11(instruction)  ((instruction) & 0x07FF)
+#define OFFSET6(instruction)     ((instruction) & 0x003F)
+#define N_INSTRU(instruction)    ((instruction) & 0x0800)
+#define Z_INSTRU(instruction)    ((instruction) & 0x0400)
+#define P_INSTRU(instruction)    ((instruction) & 0x0200)
+#define NZP_INSTRU(instruction)  ((instruction) >> 9)
+#define TRAPVECT8(instruction)   ((instruction) & 0x00FF)
+
+#define IS_IMM5(instruction) (((instruction) >> 5) & 0x0001)
+#define IS_JSR(instruction)  (((instruction) >> 11) & 0x0001)
+
+#define IS_LOAD(instruction) \
+    (OPCODE(instruction) == LD || OPCODE(instruction) == LDI || OPCODE(instruction) == LDR)
+/* a conditional branch back to the instruction right before it, as in LDI R0, KBSR / BRzp */
+#define IS_POLL_BRANCH(instruction) \
+    (OPCODE(instruction) == BR && ((instruction) & 0x0E00) && PCOFFSET9(instruction) == 0x01FE)
+
+#endif
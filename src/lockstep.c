@@ -0,0 +1,549 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lockstep.h"
+#include "cpu.h"
+#include "lc3_instruction.h"
+#include "lc3_reg.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(LOCKSTEP_NO_AVX2)
+#define LOCKSTEP_AVX2
+#include <immintrin.h>
+#endif
+
+#define LOCKSTEP_VECTOR_LANES 16 /* 16 bit lanes in a 256 bit vector */
+#define LOCKSTEP_IN_GROUP     0xFFFF
+#define LOCKSTEP_MAX_STEPS    0xFFFF /* steps[] is settled before it can wrap */
+#define LOCKSTEP_NUM_WORDS    (UINT16_MAX + 1)
+
+#define IS_UNIFORM(ls, address)    ((ls)->uniform[(address) >> 3] & (1 << ((address) & 7)))
+#define SET_UNIFORM(ls, address)   ((ls)->uniform[(address) >> 3] |= (1 << ((address) & 7)))
+#define CLEAR_UNIFORM(ls, address) ((ls)->uniform[(address) >> 3] &= ~(1 << ((address) & 7)))
+
+#define NZP_PSR(value)     ((value) & 0x0007)
+#define NZP_PSR_CLEAR_MASK 0xFFF8
+#define SET_PSR_P_MASK     0x0001
+#define SET_PSR_Z_MASK     0x0002
+#define SET_PSR_N_MASK     0x0004
+
+enum lockstep_alu {LOCKSTEP_ADD, LOCKSTEP_AND, LOCKSTEP_NOT, LOCKSTEP_MOV};
+
+/* The lanes' registers as a structure of arrays, so that one instruction is applied to
+ * every lane in the group at once. nzp holds each lane's condition code. Budgets are only
+ * settled every settle_in group steps, when the first lane could run out. */
+struct lockstep {
+    int num_lanes;
+    int use_avx2;
+    long long settle_in;
+    uint16_t regs[num_registers][LOCKSTEP_MAX_LANES];
+    uint16_t nzp[LOCKSTEP_MAX_LANES];
+    uint16_t running[LOCKSTEP_MAX_LANES]; /* LOCKSTEP_IN_GROUP for lanes that haven't stopped */
+    uint16_t group[LOCKSTEP_MAX_LANES];   /* LOCKSTEP_IN_GROUP for lanes executing the current instruction */
+    uint16_t steps[LOCKSTEP_MAX_LANES];   /* group steps since the last settle */
+    uint16_t scratch[LOCKSTEP_MAX_LANES];
+    unsigned long long executed[LOCKSTEP_MAX_LANES]; /* not counting the ones the cpu ran itself */
+    uint8_t uniform[LOCKSTEP_NUM_WORDS / 8]; /* words known to be the same plain memory in every running lane */
+};
+
+static uint16_t sign_extend(uint16_t value, int num_bits) {
+    uint16_t mask = ~(0xFFFF << num_bits);
+    uint16_t sign_bit = 1 << (num_bits - 1);
+    if (value & sign_bit) {
+        return (~((value^mask) + 1)) + 1;
+    }
+    return value;
+}
+
+static uint16_t condition_code(uint16_t result) {
+    int16_t val = result;
+    if (val > 0) {
+        return SET_PSR_P_MASK;
+    } else if (val < 0) {
+        return SET_PSR_N_MASK;
+    }
+    return SET_PSR_Z_MASK;
+}
+
+/* Plain memory only, returns 0 when the access has to go through the cpu */
+static int lockstep_read(const struct bus_direct_map *memory, uint16_t address, uint16_t *value) {
+    if (memory->memory == NULL || memory->special_pages[address >> memory->page_bits]) {
+        return 0;
+    }
+    *value = memory->memory[address];
+    return 1;
+}
+
+static int lockstep_write(struct lockstep *ls, struct lockstep_lane *lane, uint16_t address, uint16_t value) {
+    if (lane->memory->special_pages[address >> lane->memory->page_bits]) {
+        return 0;
+    }
+    lane->memory->memory[address] = value;
+    lane->memory->dirty_pages[address >> lane->memory->page_bits] = 1;
+    CLEAR_UNIFORM(ls, address);
+    cpu_invalidate(lane->cpu, address);
+    return 1;
+}
+
+static void lockstep_alu_scalar(struct lockstep *ls, enum lockstep_alu op, uint16_t *dst,
+                                const uint16_t *a, const uint16_t *b, uint16_t imm, int set_nzp) {
+    int i;
+    uint16_t operand, result;
+    for (i = 0; i < ls->num_lanes; ++i) {
+        if (!ls->group[i]) {
+            continue;
+        }
+        operand = b == NULL ? imm : b[i];
+        switch (op) {
+        case LOCKSTEP_ADD:
+            result = a[i] + operand;
+            break;
+        case LOCKSTEP_AND:
+            result = a[i] & operand;
+            break;
+        case LOCKSTEP_NOT:
+            result = ~a[i];
+            break;
+        default:
+            result = operand;
+            break;
+        }
+        dst[i] = result;
+        if (set_nzp) {
+            ls->nzp[i] = condition_code(result);
+        }
+    }
+}
+
+static void lockstep_branch_scalar(struct lockstep *ls, uint16_t nzp, uint16_t target, uint16_t next) {
+    int i;
+    for (i = 0; i < ls->num_lanes; ++i) {
+        if (ls->group[i]) {
+            ls->regs[REG_PC][i] = (ls->nzp[i] & nzp) ? target : next;
+        }
+    }
+}
+
+/* Puts the running lanes at the lowest pc in the group, returns 0 if there are none */
+static int lockstep_match_scalar(struct lockstep *ls, uint16_t *pc) {
+    int i, found;
+    found = 0;
+    for (i = 0; i < ls->num_lanes; ++i) {
+        if (ls->running[i] && (!found || ls->regs[REG_PC][i] < *pc)) {
+            *pc = ls->regs[REG_PC][i];
+            found = 1;
+        }
+    }
+    for (i = 0; i < ls->num_lanes; ++i) {
+        ls->group[i] = ls->running[i] && ls->regs[REG_PC][i] == *pc ? LOCKSTEP_IN_GROUP : 0;
+    }
+    return found;
+}
+
+static void lockstep_count_scalar(struct lockstep *ls) {
+    int i;
+    for (i = 0; i < ls->num_lanes; ++i) {
+        if (ls->group[i]) {
+            ++ls->steps[i];
+        }
+    }
+}
+
+#ifdef LOCKSTEP_AVX2
+#define LOAD(p)      _mm256_loadu_si256((const __m256i *)(p))
+#define STORE(p, v)  _mm256_storeu_si256((__m256i *)(p), (v))
+
+__attribute__((target("avx2")))
+static void lockstep_alu_avx2(struct lockstep *ls, enum lockstep_alu op, uint16_t *dst,
+                              const uint16_t *a, const uint16_t *b, uint16_t imm, int set_nzp) {
+    __m256i zero, group, operand, result, nzp;
+    int i;
+    zero = _mm256_setzero_si256();
+    for (i = 0; i < ls->num_lanes; i += LOCKSTEP_VECTOR_LANES) {
+        group = LOAD(&ls->group[i]);
+        operand = b == NULL ? _mm256_set1_epi16(imm) : LOAD(&b[i]);
+        switch (op) {
+        case LOCKSTEP_ADD:
+            result = _mm256_add_epi16(LOAD(&a[i]), operand);
+            break;
+        case LOCKSTEP_AND:
+            result = _mm256_and_si256(LOAD(&a[i]), operand);
+            break;
+        case LOCKSTEP_NOT:
+            result = _mm256_xor_si256(LOAD(&a[i]), _mm256_set1_epi16(-1));
+            break;
+        default:
+            result = operand;
+            break;
+        }
+        STORE(&dst[i], _mm256_blendv_epi8(LOAD(&dst[i]), result, group));
+        if (set_nzp) {
+            nzp = _mm256_or_si256(
+                _mm256_and_si256(_mm256_cmpgt_epi16(zero, result), _mm256_set1_epi16(SET_PSR_N_MASK)),
+                _mm256_or_si256(
+                    _mm256_and_si256(_mm256_cmpeq_epi16(result, zero), _mm256_set1_epi16(SET_PSR_Z_MASK)),
+                    _mm256_and_si256(_mm256_cmpgt_epi16(result, zero), _mm256_set1_epi16(SET_PSR_P_MASK))));
+            STORE(&ls->nzp[i], _mm256_blendv_epi8(LOAD(&ls->nzp[i]), nzp, group));
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void lockstep_branch_avx2(struct lockstep *ls, uint16_t nzp, uint16_t target, uint16_t next) {
+    __m256i not_taken, new_pc;
+    int i;
+    for (i = 0; i < ls->num_lanes; i += LOCKSTEP_VECTOR_LANES) {
+        not_taken = _mm256_cmpeq_epi16(_mm256_and_si256(LOAD(&ls->nzp[i]), _mm256_set1_epi16(nzp)),
+                                       _mm256_setzero_si256());
+        new_pc = _mm256_blendv_epi8(_mm256_set1_epi16(target), _mm256_set1_epi16(next), not_taken);
+        STORE(&ls->regs[REG_PC][i], _mm256_blendv_epi8(LOAD(&ls->regs[REG_PC][i]), new_pc, LOAD(&ls->group[i])));
+    }
+}
+
+__attribute__((target("avx2")))
+static int lockstep_match_avx2(struct lockstep *ls, uint16_t *pc) {
+    __m256i low, group, any;
+    __m128i half;
+    int i;
+    /* stopped lanes read as 0xFFFF, a running lane there still matches below */
+    low = _mm256_set1_epi16(-1);
+    for (i = 0; i < ls->num_lanes; i += LOCKSTEP_VECTOR_LANES) {
+        low = _mm256_min_epu16(low, _mm256_or_si256(LOAD(&ls->regs[REG_PC][i]),
+                                                    _mm256_andnot_si256(LOAD(&ls->running[i]), _mm256_set1_epi16(-1))));
+    }
+    half = _mm_min_epu16(_mm256_castsi256_si128(low), _mm256_extracti128_si256(low, 1));
+    *pc = _mm_extract_epi16(_mm_minpos_epu16(half), 0);
+    any = _mm256_setzero_si256();
+    for (i = 0; i < ls->num_lanes; i += LOCKSTEP_VECTOR_LANES) {
+        group = _mm256_and_si256(LOAD(&ls->running[i]), _mm256_cmpeq_epi16(LOAD(&ls->regs[REG_PC][i]), _mm256_set1_epi16(*pc)));
+        STORE(&ls->group[i], group);
+        any = _mm256_or_si256(any, group);
+    }
+    return !_mm256_testz_si256(any, any);
+}
+
+__attribute__((target("avx2")))
+static void lockstep_count_avx2(struct lockstep *ls) {
+    int i;
+    for (i = 0; i < ls->num_lanes; i += LOCKSTEP_VECTOR_LANES) {
+        /* group lanes are all ones, that is -1 */
+        STORE(&ls->steps[i], _mm256_sub_epi16(LOAD(&ls->steps[i]), LOAD(&ls->group[i])));
+    }
+}
+
+#undef LOAD
+#undef STORE
+#endif
+
+/* dst = a op b, or a op imm when b is NULL, for every lane in the group */
+static void lockstep_alu(struct lockstep *ls, enum lockstep_alu op, uint16_t *dst,
+                         const uint16_t *a, const uint16_t *b, uint16_t imm, int set_nzp) {
+#ifdef LOCKSTEP_AVX2
+    if (ls->use_avx2) {
+        lockstep_alu_avx2(ls, op, dst, a, b, imm, set_nzp);
+        return;
+    }
+#endif
+    lockstep_alu_scalar(ls, op, dst, a, b, imm, set_nzp);
+}
+
+static void lockstep_branch(struct lockstep *ls, uint16_t nzp, uint16_t target, uint16_t next) {
+#ifdef LOCKSTEP_AVX2
+    if (ls->use_avx2) {
+        lockstep_branch_avx2(ls, nzp, target, next);
+        return;
+    }
+#endif
+    lockstep_branch_scalar(ls, nzp, target, next);
+}
+
+static int lockstep_match(struct lockstep *ls, uint16_t *pc) {
+#ifdef LOCKSTEP_AVX2
+    if (ls->use_avx2) {
+        return lockstep_match_avx2(ls, pc);
+    }
+#endif
+    return lockstep_match_scalar(ls, pc);
+}
+
+static void lockstep_count(struct lockstep *ls) {
+#ifdef LOCKSTEP_AVX2
+    if (ls->use_avx2) {
+        lockstep_count_avx2(ls);
+        return;
+    }
+#endif
+    lockstep_count_scalar(ls);
+}
+
+static void lockstep_set_pc(struct lockstep *ls, uint16_t pc) {
+    lockstep_alu(ls, LOCKSTEP_MOV, ls->regs[REG_PC], NULL, NULL, pc, 0);
+}
+
+static void lockstep_load_lane(struct lockstep *ls, struct lockstep_lane *lane, int i) {
+    int reg;
+    for (reg = 0; reg < num_registers; ++reg) {
+        ls->regs[reg][i] = cpu_read_register(lane->cpu, reg);
+    }
+    ls->nzp[i] = NZP_PSR(ls->regs[REG_PSR][i]);
+}
+
+static void lockstep_store_lane(struct lockstep *ls, struct lockstep_lane *lane, int i) {
+    int reg;
+    ls->regs[REG_PSR][i] = (ls->regs[REG_PSR][i] & NZP_PSR_CLEAR_MASK) | ls->nzp[i];
+    for (reg = 0; reg < num_registers; ++reg) {
+        cpu_write_register(lane->cpu, reg, ls->regs[reg][i]);
+    }
+}
+
+/* Folds the lane's group steps into its budget */
+static void lockstep_settle_lane(struct lockstep *ls, struct lockstep_lane *lane, int i) {
+    lane->budget -= ls->steps[i];
+    ls->executed[i] += ls->steps[i];
+    ls->steps[i] = 0;
+    if (lane->budget <= 0) {
+        ls->running[i] = 0;
+    }
+}
+
+static void lockstep_settle(struct lockstep *ls, struct lockstep_lane *lanes) {
+    int i;
+    ls->settle_in = LOCKSTEP_MAX_STEPS;
+    for (i = 0; i < ls->num_lanes; ++i) {
+        lockstep_settle_lane(ls, &lanes[i], i);
+        if (ls->running[i] && lanes[i].budget < ls->settle_in) {
+            ls->settle_in = lanes[i].budget;
+        }
+    }
+}
+
+/* Has the lane's own cpu run its next instruction, for everything that needs more than
+ * registers and plain memory */
+static void lockstep_step_lane(struct lockstep *ls, struct lockstep_lane *lane, int i) {
+    unsigned long long retired;
+    enum cpu_status status;
+    lockstep_settle_lane(ls, lane, i);
+    retired = cpu_retired(lane->cpu);
+    lockstep_store_lane(ls, lane, i);
+    status = cpu_run(lane->cpu, 1);
+    lockstep_load_lane(ls, lane, i);
+    lane->budget -= cpu_retired(lane->cpu) - retired;
+    if (status != CPU_BUDGET) {
+        lane->status = status;
+        ls->running[i] = 0;
+    } else if (lane->budget <= 0) {
+        ls->running[i] = 0;
+    }
+    /* its budget is now short of settle_in */
+    ls->settle_in = 0;
+}
+
+static void lockstep_step_group(struct lockstep *ls, struct lockstep_lane *lanes) {
+    int i;
+    for (i = 0; i < ls->num_lanes; ++i) {
+        if (ls->group[i]) {
+            ls->group[i] = 0;
+            lockstep_step_lane(ls, &lanes[i], i);
+        }
+    }
+}
+
+/* Loads, stores and traps touch each lane's own memory. Lanes that hit a page with a device
+ * register or the mcr leave the group and are stepped by their cpu. */
+static void lockstep_memory(struct lockstep *ls, struct lockstep_lane *lanes, uint16_t instruction, uint16_t next) {
+    uint16_t direct_address, base_offset, address, value;
+    int i, dr, base, ok;
+    direct_address = next + sign_extend(PCOFFSET9(instruction), 9);
+    base_offset = sign_extend(OFFSET6(instruction), 6);
+    dr = REG1_INSTRU(instruction);
+    base = REG2_INSTRU(instruction);
+    value = 0;
+    for (i = 0; i < ls->num_lanes; ++i) {
+        const struct bus_direct_map *memory;
+        if (!ls->group[i]) {
+            continue;
+        }
+        memory = lanes[i].memory;
+        switch (OPCODE(instruction)) {
+        case LD:
+            ok = lockstep_read(memory, direct_address, &value);
+            break;
+        case LDI:
+            ok = lockstep_read(memory, direct_address, &address) && lockstep_read(memory, address, &value);
+            break;
+        case LDR:
+            ok = lockstep_read(memory, ls->regs[base][i] + base_offset, &value);
+            break;
+        case ST:
+            ok = lockstep_write(ls, &lanes[i], direct_address, ls->regs[dr][i]);
+            break;
+        case STI:
+            ok = lockstep_read(memory, direct_address, &address) &&
+                 lockstep_write(ls, &lanes[i], address, ls->regs[dr][i]);
+            break;
+        case STR:
+            ok = lockstep_write(ls, &lanes[i], ls->regs[base][i] + base_offset, ls->regs[dr][i]);
+            break;
+        default:
+            /* accelerated traps run the whole service routine in the cpu */
+            ok = !cpu_trap_acceleration(lanes[i].cpu) && lockstep_read(memory, TRAPVECT8(instruction), &value);
+            break;
+        }
+        if (!ok) {
+            ls->group[i] = 0;
+            lockstep_step_lane(ls, &lanes[i], i);
+            if (OPCODE(instruction) == STI || OPCODE(instruction) == TRAP) {
+                /* the pointer may have come from a device, or the routine stored anywhere */
+                memset(ls->uniform, 0, sizeof(ls->uniform));
+            }
+            continue;
+        }
+        if (IS_LOAD(instruction)) {
+            ls->regs[dr][i] = value;
+            ls->nzp[i] = condition_code(value);
+        } else if (OPCODE(instruction) == TRAP) {
+            ls->regs[REG_R7][i] = next;
+            ls->regs[REG_PC][i] = value;
+        }
+    }
+    if (OPCODE(instruction) != TRAP) {
+        lockstep_set_pc(ls, next);
+    }
+}
+
+static void lockstep_execute(struct lockstep *ls, struct lockstep_lane *lanes, uint16_t instruction, uint16_t pc) {
+    enum lockstep_alu op;
+    uint16_t next, *dr, *sr1, *sr2;
+    next = pc + 1;
+    dr = ls->regs[REG1_INSTRU(instruction)];
+    sr1 = ls->regs[REG2_INSTRU(instruction)];
+    sr2 = ls->regs[REG3_INSTRU(instruction)];
+    switch (OPCODE(instruction)) {
+    case ADD:
+    case AND:
+        op = OPCODE(instruction) == ADD ? LOCKSTEP_ADD : LOCKSTEP_AND;
+        if (IS_IMM5(instruction)) {
+            lockstep_alu(ls, op, dr, sr1, NULL, sign_extend(IMM5(instruction), 5), 1);
+        } else {
+            lockstep_alu(ls, op, dr, sr1, sr2, 0, 1);
+        }
+        lockstep_set_pc(ls, next);
+        break;
+    case NOT:
+        lockstep_alu(ls, LOCKSTEP_NOT, dr, sr1, NULL, 0, 1);
+        lockstep_set_pc(ls, next);
+        break;
+    case LEA:
+        lockstep_alu(ls, LOCKSTEP_MOV, dr, NULL, NULL, next + sign_extend(PCOFFSET9(instruction), 9), 1);
+        lockstep_set_pc(ls, next);
+        break;
+    case BR:
+        /* the cpu notices a lane polling an idle device */
+        if (IS_POLL_BRANCH(instruction)) {
+            lockstep_step_group(ls, lanes);
+            break;
+        }
+        lockstep_branch(ls, NZP_PSR(NZP_INSTRU(instruction)), next + sign_extend(PCOFFSET9(instruction), 9), next);
+        break;
+    case JMP_RET:
+        lockstep_alu(ls, LOCKSTEP_MOV, ls->regs[REG_PC], NULL, sr1, 0, 0);
+        break;
+    case JSR_JSRR:
+        if (IS_JSR(instruction)) {
+            lockstep_alu(ls, LOCKSTEP_MOV, ls->regs[REG_R7], NULL, NULL, next, 0);
+            lockstep_set_pc(ls, next + sign_extend(PCOFFSET11(instruction), 11));
+        } else {
+            lockstep_alu(ls, LOCKSTEP_ADD, ls->scratch, sr1, NULL, next, 0);
+            lockstep_alu(ls, LOCKSTEP_MOV, ls->regs[REG_R7], NULL, NULL, next, 0);
+            lockstep_alu(ls, LOCKSTEP_MOV, ls->regs[REG_PC], NULL, ls->scratch, 0, 0);
+        }
+        break;
+    case LD:
+    case LDI:
+    case LDR:
+    case ST:
+    case STI:
+    case STR:
+    case TRAP:
+        lockstep_memory(ls, lanes, instruction, next);
+        break;
+    default:
+        /* rti and illegal opcodes can push onto the stack */
+        lockstep_step_group(ls, lanes);
+        memset(ls->uniform, 0, sizeof(ls->uniform));
+        break;
+    }
+}
+
+/* Groups the running lanes that are at the same pc as the one furthest behind and have the
+ * same instruction there. Returns 0 once no lane is running. */
+static int lockstep_form_group(struct lockstep *ls, struct lockstep_lane *lanes, uint16_t *pc, uint16_t *instruction) {
+    int i, leader, same;
+    uint16_t word;
+    for (;;) {
+        if (!lockstep_match(ls, pc)) {
+            return 0;
+        }
+        for (leader = 0; !ls->group[leader]; ++leader) {
+            ;
+        }
+        if (lockstep_read(lanes[leader].memory, *pc, instruction)) {
+            break;
+        }
+        lockstep_step_lane(ls, &lanes[leader], leader);
+        /* no telling what an instruction fetched from a device did */
+        memset(ls->uniform, 0, sizeof(ls->uniform));
+    }
+    if (IS_UNIFORM(ls, *pc)) {
+        return 1;
+    }
+    same = 1;
+    for (i = 0; i < ls->num_lanes; ++i) {
+        if (ls->running[i] && !(lockstep_read(lanes[i].memory, *pc, &word) && word == *instruction)) {
+            ls->group[i] = 0;
+            same = 0;
+        }
+    }
+    if (same) {
+        SET_UNIFORM(ls, *pc);
+    }
+    return 1;
+}
+
+/* Runs every lane for up to its budget, or until its cpu stops, executing lanes that are at
+ * the same instruction together. On return budget is what is left of it. Lanes are expected
+ * to run copies of the same program. Breakpoints aren't checked. */
+void lockstep_run(struct lockstep_lane *lanes, int num_lanes) {
+    struct lockstep ls;
+    uint16_t pc = 0, instruction = 0;
+    int i;
+    ls.num_lanes = num_lanes;
+#ifdef LOCKSTEP_AVX2
+    ls.use_avx2 = __builtin_cpu_supports("avx2");
+#else
+    ls.use_avx2 = 0;
+#endif
+    memset(ls.running, 0, sizeof(ls.running));
+    memset(ls.group, 0, sizeof(ls.group));
+    memset(ls.steps, 0, sizeof(ls.steps));
+    memset(ls.uniform, 0, sizeof(ls.uniform));
+    for (i = 0; i < num_lanes; ++i) {
+        lanes[i].status = cpu_run(lanes[i].cpu, 0);
+        ls.running[i] = lanes[i].status == CPU_BUDGET && lanes[i].budget > 0 ? LOCKSTEP_IN_GROUP : 0;
+        ls.executed[i] = 0;
+        lockstep_load_lane(&ls, &lanes[i], i);
+    }
+    lockstep_settle(&ls, lanes);
+    while (lockstep_form_group(&ls, lanes, &pc, &instruction)) {
+        lockstep_execute(&ls, lanes, instruction, pc);
+        lockstep_count(&ls);
+        if (--ls.settle_in <= 0) {
+            lockstep_settle(&ls, lanes);
+        }
+    }
+    lockstep_settle(&ls, lanes);
+    for (i = 0; i < num_lanes; ++i) {
+        lockstep_store_lane(&ls, &lanes[i], i);
+        cpu_retire(lanes[i].cpu, ls.executed[i]);
+    }
+}
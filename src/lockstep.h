@@ -0,0 +1,17 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include "cpu.h"
+
+#define LOCKSTEP_MAX_LANES 64
+
+struct lockstep_lane {
+    Cpu *cpu;
+    const struct bus_direct_map *memory;
+    long long budget;       /* instructions the lane may run */
+    enum cpu_status status; /* set by lockstep_run */
+};
+
+void lockstep_run(struct lockstep_lane *, int);
+
+#endif
@@ -9,6 +9,8 @@ int main(int argc, char **argv) {
         exit(1);
     }
     exit(0);*/
-    start(argv[0]);
+    if (start(argc, argv) < 0) {
+        return 1;
+    }
     return 0;
 }
@@ -28,6 +28,7 @@ struct plugin_manager_entry {
     char *name;
     char *path;
     struct device *device;
+    struct device *(*init)(void);
 };
 
 struct plugin_manager_iterator {
@@ -35,6 +36,8 @@ struct plugin_manager_iterator {
 };
 
 static const char *func_null_error_string = "init_device_plugin is null";
+static const char *abi_version_error_string = "plugin was built for a newer device abi";
+static const char *registers_error_string = "REGISTERS devices need device_abi_version 2";
 
 static void pm_on_error(PluginManager *plugin_manager, const char *path, const char *error_string, enum pm_error error_type) {
     if (plugin_manager->on_error != NULL) {
@@ -65,11 +68,26 @@ static int check_extension(const char *path, const char *extension) {
     return strcmp(path_ext, extension) == 0;
 }
 
-static struct device *pm_init_plugin(PluginManager *plugin_manager, void *dlhandle, const char *path) {
+/* Plugins from before device_abi_version existed are version 1 */
+static int pm_abi_version(struct plugin_manager_entry *entry) {
+    const int *abi_version;
+    abi_version = dlsym(entry->dlhandle, "device_abi_version");
+    return abi_version == NULL ? 1 : *abi_version;
+}
+
+static struct device *pm_init_plugin(PluginManager *plugin_manager, struct plugin_manager_entry *entry) {
     struct device *(*init_device_plugin)(void);
     struct device *plugin;
     char *dl_error_string;
-    init_device_plugin = dlsym(dlhandle, "init_device_plugin");
+    const char *path;
+    int abi_version;
+    path = entry->path;
+    abi_version = pm_abi_version(entry);
+    if (abi_version > DEVICE_ABI_VERSION) {
+        pm_on_error(plugin_manager, path, abi_version_error_string, PM_ERROR_PLUGIN_LOAD);
+        return NULL;
+    }
+    init_device_plugin = dlsym(entry->dlhandle, "init_device_plugin");
     if (init_device_plugin == NULL) {
         const char *final_error_string;
         dl_error_string = dlerror();
@@ -77,11 +95,18 @@ static struct device *pm_init_plugin(PluginManager *plugin_manager, void *dlhand
         pm_on_error(plugin_manager, path, final_error_string, PM_ERROR_PLUGIN_LOAD);
         return NULL;
     }
+    entry->init = init_device_plugin;
     plugin = init_device_plugin();
     if (plugin == NULL) {
         pm_on_error(plugin_manager, path, strerror(errno), PM_ERROR_PLUGIN_LOAD);
         return NULL;
     }
+    /* a version 1 struct device has no get_registers to call */
+    if (abi_version < 2 && plugin->get_address_method(plugin) == REGISTERS) {
+        plugin->free(plugin);
+        pm_on_error(plugin_manager, path, registers_error_string, PM_ERROR_PLUGIN_LOAD);
+        return NULL;
+    }
     return plugin;
 }
 
@@ -91,7 +116,7 @@ static int pm_load_plugin_lib(PluginManager *plugin_manager, struct plugin_manag
         pm_on_error(plugin_manager, entry->path, dlerror(), PM_ERROR_PLUGIN_LOAD);
         return -1;
     }
-    entry->device = pm_init_plugin(plugin_manager, entry->dlhandle, entry->path);
+    entry->device = pm_init_plugin(plugin_manager, entry);
     if (entry->device == NULL) {
         dlclose(entry->dlhandle);
         return -1;
@@ -236,6 +261,7 @@ struct pm_device_data *pm_iterator_next(PluginManagerIterator *iterator, struct
     device_data->name = entry->name;
     device_data->path = entry->path;
     device_data->device = entry->device;
+    device_data->init = entry->init;
     return device_data;
 }
 
@@ -16,6 +16,8 @@ struct pm_device_data {
     const char *name;
     const char *path;
     struct device *device;
+    /* makes another instance of the device, NULL on failure */
+    struct device *(*init)(void);
 };
 
 PluginManager *pm_new(void (*on_error)(const char *, const char *, enum pm_error, void *), void *);
@@ -14,12 +14,16 @@
 
 static const uint16_t display_addresses[] = {DSR, DDR};
 static const size_t display_num_addresses = 2;
-static const enum address_method display_method = SEPERATE;
+static const enum address_method display_method = REGISTERS;
+
+const int device_abi_version = DEVICE_ABI_VERSION;
 
 struct display_data {
     struct host *host;
     uint16_t dsr;
     uint16_t ddr;
+    /* both are read in place, writes keep dsr's ready bit and send ddr to the host */
+    struct device_register registers[2];
 };
 
 static uint16_t display_read_register(struct device *display_device, uint16_t address) {
@@ -73,10 +77,23 @@ static enum address_method display_get_address_method(struct device *display_dev
     return display_method;
 }
 
+static const struct device_register *display_get_registers(struct device *display_device, size_t *num_registers) {
+    struct display_data *display_data;
+    display_data = display_device->data;
+    *num_registers = display_num_addresses;
+    return display_data->registers;
+}
+
 static void init_display_device(struct device *display_device, struct display_data *data) {
     data->host = NULL;
     data->ddr = INIT_DDR;
     data->dsr = INIT_DSR;
+    data->registers[0].address = DSR;
+    data->registers[0].flags = DEVICE_REGISTER_WRITE_HOOK;
+    data->registers[0].value = &data->dsr;
+    data->registers[1].address = DDR;
+    data->registers[1].flags = DEVICE_REGISTER_WRITE_HOOK;
+    data->registers[1].value = &data->ddr;
     display_device->data = data;
     display_device->read_register = display_read_register;
     display_device->write_register = display_write_register;
@@ -85,6 +102,7 @@ static void init_display_device(struct device *display_device, struct display_da
     display_device->start = display_start;
     display_device->get_addresses = display_get_addresses;
     display_device->get_address_method = display_get_address_method;
+    display_device->get_registers = display_get_registers;
     display_device->free = display_free;
 }
 
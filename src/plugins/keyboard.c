@@ -20,12 +20,16 @@
 
 static const uint16_t keyboard_addresses[] = {KBSR, KBDR};
 static const size_t keyboard_num_addresses = 2;
-static const enum address_method keyboard_method = SEPERATE;
+static const enum address_method keyboard_method = REGISTERS;
+
+const int device_abi_version = DEVICE_ABI_VERSION;
 
 struct keyboard_data {
     struct host *host;
     uint16_t kbsr;
     uint16_t kbdr;
+    /* kbsr is read in place, writes keep the ready bit and reading kbdr clears it */
+    struct device_register registers[2];
 };
 
 static uint16_t keyboard_read_register(struct device *keyboard_device, uint16_t address) {
@@ -83,6 +87,13 @@ static enum address_method keyboard_get_address_method(struct device *keyboard_d
     return keyboard_method;
 }
 
+static const struct device_register *keyboard_get_registers(struct device *keyboard_device, size_t *num_registers) {
+    struct keyboard_data *keyboard_data;
+    keyboard_data = keyboard_device->data;
+    *num_registers = keyboard_num_addresses;
+    return keyboard_data->registers;
+}
+
 static void keyboard_start(struct device *keyboard_device, struct host *host) {
     struct keyboard_data *keyboard_data;
     keyboard_data = keyboard_device->data;
@@ -93,6 +104,12 @@ static void init_keyboard_device(struct device *keyboard_device, struct keyboard
     keyboard_data->host = NULL;
     keyboard_data->kbdr = KBDR_INIT;
     keyboard_data->kbsr = KBSR_INIT;
+    keyboard_data->registers[0].address = KBSR;
+    keyboard_data->registers[0].flags = DEVICE_REGISTER_WRITE_HOOK;
+    keyboard_data->registers[0].value = &keyboard_data->kbsr;
+    keyboard_data->registers[1].address = KBDR;
+    keyboard_data->registers[1].flags = DEVICE_REGISTER_READ_HOOK | DEVICE_REGISTER_WRITE_HOOK;
+    keyboard_data->registers[1].value = &keyboard_data->kbdr;
     keyboard_device->data = keyboard_data;
     keyboard_device->read_register = keyboard_read_register;
     keyboard_device->write_register = keyboard_write_register;
@@ -102,6 +119,7 @@ static void init_keyboard_device(struct device *keyboard_device, struct keyboard
     keyboard_device->free = keyboard_free;
     keyboard_device->get_addresses = keyboard_get_addresses;
     keyboard_device->get_address_method = keyboard_get_address_method;
+    keyboard_device->get_registers = keyboard_get_registers;
 }
 
 struct device *init_device_plugin(void) {
@@ -1,11 +1,19 @@
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <stdio.h>
 
 #include "cpu.h"
+#include "lockstep.h"
 #include "interrupt_controller.h"
+#include "tick_queue.h"
+#include "history.h"
 #include "bus.h"
 #include "list.h"
 #include "simulator.h"
@@ -14,15 +22,87 @@
 #include "lc3_reg.h"
 #include "util.h"
 
+/* default number of instructions between checks for input, device ticks and interrupts */
+#define SIMULATOR_SERVICE_INTERVAL 1024
+
+/* Snapshot files are a header page, then memory starting on the next page, then a record
+ * for every attached device in attach order. Everything is in host byte order. */
+#define SNAPSHOT_MAGIC      "LC3SNAP"
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+#define SNAPSHOT_PAGE_SIZE  4096
+#define SNAPSHOT_MEMORY_SIZE (BUS_NUM_ADDRESSES * sizeof(uint16_t))
+#define SNAPSHOT_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+/* snapshot_device tick values */
+#define SNAPSHOT_TICK_NONE     0
+#define SNAPSHOT_TICK_SERVICE  1 /* ticked at every service */
+#define SNAPSHOT_TICK_DEADLINE 2
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t page_size;
+    uint32_t num_devices;
+    uint64_t memory_offset;
+    uint64_t memory_size;
+    uint64_t devices_offset;
+    uint64_t devices_size;
+    uint64_t retired;
+    uint64_t accelerated_traps;
+    uint16_t registers[num_registers];
+    uint8_t interrupts[INTERRUPT_NUM_VECTORS];
+};
+
+/* Followed by num_registers address, value pairs of REGISTERS devices' registers, then
+ * state_size bytes from the device's save hook */
+struct snapshot_device {
+    uint32_t size; /* the whole record, a multiple of 8 */
+    uint32_t num_registers;
+    uint32_t state_size;
+    uint32_t tick;
+    uint64_t deadline;
+};
+
+/* What simulator_reset_to_baseline goes back to, besides the bus's copy of memory */
+struct simulator_baseline {
+    struct cpu_state cpu;
+    uint8_t interrupts[INTERRUPT_NUM_VECTORS];
+    char *devices; /* records as in a snapshot */
+    size_t devices_size;
+    size_t num_devices;
+};
+
+/* A loaded machine many simulators can start from, sharing memory they don't write */
+struct simulator_image {
+    BusImage *memory;
+    struct cpu_state cpu;
+};
+
+/* An attached device and the hooks it gave set_state_hooks, if any */
+struct simulator_device {
+    struct device *device;
+    size_t (*save)(struct device *, void *, size_t);
+    int (*restore)(struct device *, const void *, size_t);
+};
+
 struct simulator {
     struct bus_accessor bus_accessor;
     struct host host;
     Cpu *cpu;
     Bus *bus;
     InterruptController *inter_cont;
+    const uint8_t *pending_interrupt_levels;
     struct device_io *device_io;
+    List *devices; /* struct simulator_device, in attach order */
     List *on_input_devices;
-    List *on_tick_devices;
+    List *on_tick_devices; /* devices ticked at every service, they never scheduled a tick */
+    TickQueue *tick_queue;
+    struct simulator_baseline *baseline; /* NULL until simulator_set_baseline */
+    History *history; /* NULL unless simulator_set_history turned recording on */
+    enum simulator_engine engine;
+    long long service_interval;
 };
 
 static uint16_t simulator_bus_read(struct bus_accessor *bus_access, uint16_t address) {
@@ -33,10 +113,67 @@ static void simulator_bus_write(struct bus_accessor *bus_access, uint16_t addres
     bus_write((Bus *)bus_access->data, address, value);
 }
 
+static int simulator_bus_is_device_register(struct bus_accessor *bus_access, uint16_t address) {
+    return bus_is_device_register((Bus *)bus_access->data, address);
+}
+
 static void init_bus_accessor(Bus *bus, struct bus_accessor *bus_access) {
     bus_access->data = bus;
     bus_access->read = simulator_bus_read;
     bus_access->write = simulator_bus_write;
+    bus_access->is_device_register = simulator_bus_is_device_register;
+    bus_get_direct_map(bus, &bus_access->direct_map.memory, &bus_access->direct_map.special_pages,
+        &bus_access->direct_map.dirty_pages, &bus_access->direct_map.page_bits);
+}
+
+static void simulator_mcr_written(void *data, uint16_t address, uint16_t value) {
+    cpu_write_mcr((Cpu *)data, value);
+}
+
+/* Writes that don't come from the cpu must still drop its decoded copy of the address */
+static void simulator_store(Simulator *simulator, uint16_t address, uint16_t value) {
+    bus_write(simulator->bus, address, value);
+    cpu_invalidate(simulator->cpu, address);
+}
+
+static void simulator_history_record(void *data, const struct cpu_state *before) {
+    history_add_step((History *)data, before);
+}
+
+static void simulator_history_log_write(void *data, uint16_t address, uint16_t old) {
+    history_log_write((History *)data, address, old);
+}
+
+static void simulator_history_restore(void *data, uint16_t address, uint16_t value) {
+    Simulator *simulator;
+    simulator = data;
+    bus_write_memory(simulator->bus, address, value);
+    cpu_invalidate(simulator->cpu, address);
+}
+
+/* Records the machine before a change that doesn't come from an instruction, so it can be
+ * undone like one */
+static void simulator_history_mark(Simulator *simulator) {
+    struct cpu_state state;
+    if (simulator->history != NULL) {
+        cpu_get_state(simulator->cpu, &state);
+        history_add_step(simulator->history, &state);
+    }
+}
+
+static void simulator_history_clear(Simulator *simulator) {
+    if (simulator->history != NULL) {
+        history_clear(simulator->history);
+    }
+}
+
+static void simulator_history_checkpoint(Simulator *simulator) {
+    struct cpu_state state;
+    if (simulator->history != NULL &&
+        cpu_retired(simulator->cpu) >= history_checkpoint_deadline(simulator->history)) {
+        cpu_get_state(simulator->cpu, &state);
+        history_checkpoint(simulator->history, &state);
+    }
 }
 
 void simulator_update_devices_input(Simulator *simulator, uint16_t input) {
@@ -51,34 +188,67 @@ void simulator_update_devices_input(Simulator *simulator, uint16_t input) {
     }
 }
 
-static void simulator_check_input(Simulator *simulator) {
+static int simulator_check_input(Simulator *simulator) {
     char input;
-    if (simulator->device_io->get_char(simulator->device_io, &input)) {
+    int result;
+    result = simulator->device_io->get_char(simulator->device_io, &input);
+    if (result > 0) {
         simulator_update_devices_input(simulator, input);
     }
+    return result;
 }
 
 static void simulator_update_devices_on_tick(Simulator *simulator) {
     size_t i, num_on_tick_devices;
     List *on_tick_devices;
-    if (simulator->on_tick_devices == NULL) return;
-    on_tick_devices = simulator->on_tick_devices;
-    num_on_tick_devices = list_num_elements(on_tick_devices);
-    for (i = 0; i < num_on_tick_devices; ++i) {
+    unsigned long long deadline, retired;
+    if (simulator->on_tick_devices != NULL) {
+        on_tick_devices = simulator->on_tick_devices;
+        num_on_tick_devices = list_num_elements(on_tick_devices);
+        for (i = 0; i < num_on_tick_devices; ++i) {
+            struct device *cur_device;
+            cur_device = *(struct device **)list_get(on_tick_devices, i);
+            cur_device->on_tick(cur_device);
+        }
+    }
+    retired = cpu_retired(simulator->cpu);
+    while (tick_queue_peek(simulator->tick_queue, &deadline) && deadline <= retired) {
         struct device *cur_device;
-        cur_device = list_get(on_tick_devices, i);
+        cur_device = tick_queue_take(simulator->tick_queue);
         cur_device->on_tick(cur_device);
     }
 }
 
-static void simulator_check_interrupts(Simulator *simulator) {
-    uint8_t vec, priority;
+static int simulator_check_interrupts(Simulator *simulator) {
+    uint8_t vec, priority, levels;
+    levels = *simulator->pending_interrupt_levels;
+    if (levels == 0 ||
+        !INTERRUPT_PENDING_ABOVE(levels, 0x7 & (cpu_read_register(simulator->cpu, REG_PSR) >> 8))) {
+        return 0;
+    }
     if (!interrupt_controller_peek(simulator->inter_cont, &vec, &priority)) {
-        return;
+        return 0;
     }
+    simulator_history_mark(simulator);
     if (cpu_signal_interrupt(simulator->cpu, vec, priority)) {
         interrupt_controller_take(simulator->inter_cont);
+        return 1;
     }
+    return 0;
+}
+
+/* The program is polling a device that can't change until input arrives, unless a device
+ * ticks or an interrupt can be taken, so block instead of spinning */
+static void simulator_wait_idle(Simulator *simulator) {
+    unsigned long long deadline;
+    if ((simulator->on_tick_devices != NULL && list_num_elements(simulator->on_tick_devices) > 0) ||
+        tick_queue_peek(simulator->tick_queue, &deadline) || simulator->device_io->wait_input == NULL) {
+        return;
+    }
+    if (simulator_check_interrupts(simulator)) {
+        return;
+    }
+    simulator->device_io->wait_input(simulator->device_io);
 }
 
 enum simulator_address_status simulator_read_address(Simulator *simulator, uint16_t address, uint16_t *value) {
@@ -97,39 +267,203 @@ uint16_t simulator_read_register(Simulator *simulator, enum lc3_reg reg) {
 }
 
 void simulator_write_register(Simulator *simulator, enum lc3_reg reg, uint16_t value) {
+    simulator_history_mark(simulator);
     cpu_write_register(simulator->cpu, reg, value);
 }
 
-int simulator_run_until_end(Simulator *simulator) {
-    if (simulator->device_io->start(simulator->device_io) < 0) {
+int simulator_set_engine(Simulator *simulator, enum simulator_engine engine) {
+    enum cpu_engine cpu_engine;
+    cpu_engine = engine == SIMULATOR_ENGINE_JIT ? CPU_ENGINE_JIT : CPU_ENGINE_INTERP;
+    if (cpu_set_engine(simulator->cpu, cpu_engine) < 0) {
         return -1;
     }
-    while (cpu_tick(simulator->cpu)) {
-        simulator_check_input(simulator);
-        simulator_update_devices_on_tick(simulator);
-        simulator_check_interrupts(simulator);
+    simulator->engine = engine;
+    return 0;
+}
+
+static enum simulator_stop_reason simulator_stop_reason(enum cpu_status status) {
+    switch (status) {
+    case CPU_BREAKPOINT:
+        return SIMULATOR_STOP_BREAKPOINT;
+    case CPU_ILLEGAL_OPCODE:
+        return SIMULATOR_STOP_ILLEGAL_OPCODE;
+    default:
+        return SIMULATOR_STOP_HALTED;
     }
-    if (simulator->device_io->end(simulator->device_io) < 0) {
+}
+
+/* Instructions to run before the next service, 0 once the budget that ends at end is used up.
+ * A slice never runs past the next scheduled device tick or history checkpoint. */
+static long long simulator_slice(Simulator *simulator, long long max_instructions, unsigned long long end) {
+    unsigned long long retired, deadline;
+    long long slice;
+    retired = cpu_retired(simulator->cpu);
+    slice = simulator->service_interval;
+    if (max_instructions != SIMULATOR_NO_LIMIT) {
+        if (retired >= end) {
+            return 0;
+        }
+        if (end - retired < (unsigned long long)slice) {
+            slice = end - retired;
+        }
+    }
+    if (tick_queue_peek(simulator->tick_queue, &deadline) && deadline > retired &&
+        deadline - retired < (unsigned long long)slice) {
+        slice = deadline - retired;
+    }
+    if (simulator->history != NULL) {
+        deadline = history_checkpoint_deadline(simulator->history);
+        if (deadline > retired && deadline - retired < (unsigned long long)slice) {
+            slice = deadline - retired;
+        }
+    }
+    return slice;
+}
+
+/* Deals with why cpu_run returned, then services input, device ticks and interrupts. Returns 1
+ * if the program can go on, otherwise 0, or -1 if device io failed, with *reason set. */
+static int simulator_service(Simulator *simulator, enum cpu_status status, enum simulator_stop_reason *reason) {
+    if (status != CPU_BUDGET && status != CPU_IDLE) {
+        *reason = simulator_stop_reason(status);
+        return 0;
+    }
+    if (status == CPU_IDLE) {
+        simulator_wait_idle(simulator);
+    }
+    if (simulator_check_input(simulator) < 0) {
+        *reason = SIMULATOR_STOP_IO_ERROR;
         return -1;
     }
-    return 0;
+    simulator_update_devices_on_tick(simulator);
+    simulator_check_interrupts(simulator);
+    return 1;
 }
 
-int simulator_step(Simulator *simulator, long long amt) {
-    int tick_status;
-    long long i;
+/* Runs until the program halts or stops, or max_instructions have executed when it isn't
+ * SIMULATOR_NO_LIMIT. Input, device ticks and interrupts are serviced every service_interval
+ * instructions. Returns -1 with *reason set to SIMULATOR_STOP_IO_ERROR if device io fails. */
+int simulator_run(Simulator *simulator, long long max_instructions, enum simulator_stop_reason *reason) {
+    unsigned long long end;
+    long long slice;
+    int result;
     if (simulator->device_io->start(simulator->device_io) < 0) {
+        *reason = SIMULATOR_STOP_IO_ERROR;
         return -1;
     }
-    for (i = 0; i < amt && (tick_status = cpu_tick(simulator->cpu) != 0); ++i);
+    end = cpu_retired(simulator->cpu) + max_instructions;
+    simulator_history_checkpoint(simulator);
+    for (;;) {
+        slice = simulator_slice(simulator, max_instructions, end);
+        if (slice == 0) {
+            *reason = SIMULATOR_STOP_BUDGET;
+            result = 0;
+            break;
+        }
+        result = simulator_service(simulator, cpu_run(simulator->cpu, slice), reason);
+        simulator_history_checkpoint(simulator);
+        if (result <= 0) {
+            break;
+        }
+    }
     if (simulator->device_io->end(simulator->device_io) < 0) {
+        *reason = SIMULATOR_STOP_IO_ERROR;
+        return -1;
+    }
+    return result;
+}
+
+/* Runs each simulator as simulator_run would, with instructions that are at the same address
+ * in several of them executed together. Meant for copies of one program on different input, on
+ * device io that doesn't block. Breakpoints aren't checked and nothing is recorded, the history
+ * is dropped. reasons gets why each one stopped. Returns -1 if device io failed for any of them. */
+int simulator_run_lockstep(Simulator **simulators, int num_simulators, long long max_instructions,
+                           enum simulator_stop_reason *reasons) {
+    struct lockstep_lane lanes[LOCKSTEP_MAX_LANES];
+    unsigned long long end[LOCKSTEP_MAX_LANES];
+    int started[LOCKSTEP_MAX_LANES], running[LOCKSTEP_MAX_LANES], lane_simulator[LOCKSTEP_MAX_LANES];
+    int i, num_lanes, result;
+    if (num_simulators > LOCKSTEP_MAX_LANES) {
+        errno = EINVAL;
         return -1;
     }
-    return tick_status;
+    result = 0;
+    for (i = 0; i < num_simulators; ++i) {
+        started[i] = simulators[i]->device_io->start(simulators[i]->device_io) >= 0;
+        running[i] = started[i];
+        if (!started[i]) {
+            reasons[i] = SIMULATOR_STOP_IO_ERROR;
+            result = -1;
+        }
+        simulator_history_clear(simulators[i]);
+        end[i] = cpu_retired(simulators[i]->cpu) + max_instructions;
+    }
+    for (;;) {
+        num_lanes = 0;
+        for (i = 0; i < num_simulators; ++i) {
+            long long slice;
+            if (!running[i]) {
+                continue;
+            }
+            slice = simulator_slice(simulators[i], max_instructions, end[i]);
+            if (slice == 0) {
+                reasons[i] = SIMULATOR_STOP_BUDGET;
+                running[i] = 0;
+                continue;
+            }
+            lanes[num_lanes].cpu = simulators[i]->cpu;
+            lanes[num_lanes].memory = &simulators[i]->bus_accessor.direct_map;
+            lanes[num_lanes].budget = slice;
+            lane_simulator[num_lanes++] = i;
+        }
+        if (num_lanes == 0) {
+            break;
+        }
+        lockstep_run(lanes, num_lanes);
+        for (i = 0; i < num_lanes; ++i) {
+            int service_result;
+            service_result = simulator_service(simulators[lane_simulator[i]], lanes[i].status, &reasons[lane_simulator[i]]);
+            if (service_result <= 0) {
+                running[lane_simulator[i]] = 0;
+            }
+            if (service_result < 0) {
+                result = -1;
+            }
+        }
+    }
+    for (i = 0; i < num_simulators; ++i) {
+        if (started[i] && simulators[i]->device_io->end(simulators[i]->device_io) < 0) {
+            reasons[i] = SIMULATOR_STOP_IO_ERROR;
+            result = -1;
+        }
+    }
+    return result;
+}
+
+void simulator_set_service_interval(Simulator *simulator, long long interval) {
+    simulator->service_interval = interval < 1 ? 1 : interval;
+}
+
+/* Services traps to os.obj's own routines natively, see cpu_set_trap_acceleration */
+void simulator_set_trap_acceleration(Simulator *simulator, int enable) {
+    cpu_set_trap_acceleration(simulator->cpu, enable);
+}
+
+void simulator_get_stats(Simulator *simulator, struct simulator_stats *stats) {
+    stats->instructions = cpu_retired(simulator->cpu);
+    stats->accelerated_traps = cpu_accelerated_traps(simulator->cpu);
+}
+
+void simulator_set_breakpoint(Simulator *simulator, uint16_t address, int set) {
+    cpu_set_breakpoint(simulator->cpu, address, set);
+}
+
+int simulator_breakpoint(Simulator *simulator, uint16_t address) {
+    return cpu_breakpoint(simulator->cpu, address);
 }
 
 void simulator_write_address(Simulator *simulator, uint16_t address, uint16_t value) {
-    bus_write(simulator->bus, address, value);
+    simulator_history_mark(simulator);
+    simulator_store(simulator, address, value);
 }
 
 int simulator_load_program(Simulator *simulator, int (*callback)(void *, uint16_t *), void *data) {
@@ -140,9 +474,10 @@ int simulator_load_program(Simulator *simulator, int (*callback)(void *, uint16_
     if (callback_result < 1) {
         return callback_result;
     }
+    simulator_history_mark(simulator);
     cur_address = starting_address;
     while ((callback_result = callback(data, &cur_word)) > 0) {
-        bus_write(simulator->bus, cur_address, cur_word);
+        simulator_store(simulator, cur_address, cur_word);
         ++cur_address;
     }
     cpu_write_register(simulator->cpu, REG_PC, starting_address);
@@ -163,40 +498,579 @@ static void simulator_add_on_tick_subscription(Simulator *simulator, struct devi
     list_add(simulator->on_tick_devices, &device);
 }
 
+static int simulator_find_on_tick_subscription(Simulator *simulator, struct device *device, size_t *index) {
+    size_t i, num_on_tick_devices;
+    if (simulator->on_tick_devices == NULL) {
+        return 0;
+    }
+    num_on_tick_devices = list_num_elements(simulator->on_tick_devices);
+    for (i = 0; i < num_on_tick_devices; ++i) {
+        if (*(struct device **)list_get(simulator->on_tick_devices, i) == device) {
+            *index = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void simulator_remove_on_tick_subscription(Simulator *simulator, struct device *device) {
+    size_t index;
+    if (simulator_find_on_tick_subscription(simulator, device, &index)) {
+        list_remove(simulator->on_tick_devices, index);
+    }
+}
+
 static void simulator_check_device_subscriptions(Simulator *simulator, struct device *device) {
     if (device->on_input != NULL) {
         simulator_add_on_input_subscription(simulator, device);
     }
-    if (device->on_tick != NULL) {
+    /* a device that scheduled a tick from start is only ticked when it asks */
+    if (device->on_tick != NULL && !tick_queue_contains(simulator->tick_queue, device)) {
         simulator_add_on_tick_subscription(simulator, device);
     }      
 }
 
 int simulator_attach_device(Simulator *simulator, struct device *device) {
+    struct simulator_device entry;
     if (bus_attach(simulator->bus, device) < 0) {
         return -1;
     }
+    entry.device = device;
+    entry.save = NULL;
+    entry.restore = NULL;
+    list_add(simulator->devices, &entry);
     device->start(device, &simulator->host);
     simulator_check_device_subscriptions(simulator, device);
     return 0;
 }
 
+/* Captures memory and the cpu registers, usually right after the programs were loaded, for
+ * simulator_use_image. Devices and pending interrupts aren't part of it. Returns NULL with
+ * errno set on failure. */
+SimulatorImage *simulator_image_new(Simulator *simulator) {
+    SimulatorImage *image;
+    BusImage *memory;
+    memory = bus_image_new(simulator->bus);
+    if (memory == NULL) {
+        return NULL;
+    }
+    image = safe_malloc(sizeof(SimulatorImage));
+    image->memory = memory;
+    cpu_get_state(simulator->cpu, &image->cpu);
+    return image;
+}
+
+/* Simulators using the image keep their memory */
+void simulator_image_free(SimulatorImage *image) {
+    bus_image_free(image->memory);
+    free(image);
+}
+
+/* Gives the simulator the image's memory, copy on write, and cpu registers. Pages the program
+ * never writes stay shared with every other simulator using the image. Returns -1 with errno
+ * set on failure. */
+int simulator_use_image(Simulator *simulator, SimulatorImage *image) {
+    if (bus_map_image(simulator->bus, image->memory) < 0) {
+        return -1;
+    }
+    cpu_invalidate_all(simulator->cpu);
+    cpu_set_state(simulator->cpu, &image->cpu);
+    simulator_history_clear(simulator);
+    return 0;
+}
+
+static void simulator_free_baseline(Simulator *simulator) {
+    if (simulator->baseline != NULL) {
+        free(simulator->baseline->devices);
+        free(simulator->baseline);
+        simulator->baseline = NULL;
+    }
+}
+
+/* Detaches every device and puts memory, the cpu and the interrupt controller back in their
+ * initial state. The devices aren't freed, they still belong to whoever attached them. The
+ * baseline and history are dropped. */
+void simulator_reset(Simulator *simulator) {
+    bus_remove_all_attachments(simulator->bus);
+    bus_clear_memory(simulator->bus);
+    list_clear(simulator->devices);
+    if (simulator->on_input_devices != NULL) {
+        list_clear(simulator->on_input_devices);
+    }
+    if (simulator->on_tick_devices != NULL) {
+        list_clear(simulator->on_tick_devices);
+    }
+    tick_queue_reset(simulator->tick_queue);
+    interrupt_controller_reset(simulator->inter_cont);
+    cpu_reset(simulator->cpu);
+    simulator_free_baseline(simulator);
+    simulator_history_clear(simulator);
+}
+
+static size_t simulator_device_registers(struct device *device, const struct device_register **registers) {
+    size_t num_registers;
+    if (device->get_address_method(device) != REGISTERS) {
+        *registers = NULL;
+        return 0;
+    }
+    *registers = device->get_registers(device, &num_registers);
+    return num_registers;
+}
+
+static uint32_t simulator_device_tick(Simulator *simulator, struct device *device, unsigned long long *deadline) {
+    size_t index;
+    *deadline = 0;
+    if (tick_queue_deadline(simulator->tick_queue, device, deadline)) {
+        return SNAPSHOT_TICK_DEADLINE;
+    }
+    if (simulator_find_on_tick_subscription(simulator, device, &index)) {
+        return SNAPSHOT_TICK_SERVICE;
+    }
+    return SNAPSHOT_TICK_NONE;
+}
+
+/* Every device's record back to back, *size gets their total size. NULL with errno set to
+ * EINVAL if a save hook gave less than it asked for, or a RANGE or SEPERATE device has no save
+ * hook, since nothing of its state would make it into the record. */
+static char *simulator_save_devices(Simulator *simulator, size_t *size) {
+    char *records;
+    size_t i, j, num_devices;
+    records = NULL;
+    *size = 0;
+    num_devices = list_num_elements(simulator->devices);
+    for (i = 0; i < num_devices; ++i) {
+        struct simulator_device *entry;
+        struct snapshot_device *record;
+        const struct device_register *registers;
+        size_t num_registers, state_size, record_size;
+        unsigned long long deadline;
+        uint16_t *pairs;
+        entry = list_get(simulator->devices, i);
+        if (entry->save == NULL && entry->device->get_address_method(entry->device) != REGISTERS) {
+            free(records);
+            errno = EINVAL;
+            return NULL;
+        }
+        num_registers = simulator_device_registers(entry->device, &registers);
+        state_size = entry->save == NULL ? 0 : entry->save(entry->device, NULL, 0);
+        record_size = SNAPSHOT_ALIGN(sizeof(struct snapshot_device) + sizeof(uint16_t) * 2 * num_registers + state_size);
+        records = safe_realloc(records, *size + record_size);
+        memset(records + *size, 0, record_size);
+        record = (struct snapshot_device *)(records + *size);
+        record->size = record_size;
+        record->num_registers = num_registers;
+        record->state_size = state_size;
+        record->tick = simulator_device_tick(simulator, entry->device, &deadline);
+        record->deadline = deadline;
+        pairs = (uint16_t *)(record + 1);
+        for (j = 0; j < num_registers; ++j) {
+            pairs[2 * j] = registers[j].address;
+            pairs[2 * j + 1] = *registers[j].value;
+        }
+        if (state_size != 0 && entry->save(entry->device, pairs + 2 * num_registers, state_size) > state_size) {
+            free(records);
+            errno = EINVAL;
+            return NULL;
+        }
+        *size += record_size;
+    }
+    return records;
+}
+
+static void simulator_fill_snapshot_header(Simulator *simulator, struct snapshot_header *header,
+                                           size_t devices_size) {
+    struct cpu_state state;
+    cpu_get_state(simulator->cpu, &state);
+    memset(header, 0, SNAPSHOT_PAGE_SIZE);
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header->version = SNAPSHOT_VERSION;
+    header->byte_order = SNAPSHOT_BYTE_ORDER;
+    header->page_size = SNAPSHOT_PAGE_SIZE;
+    header->num_devices = list_num_elements(simulator->devices);
+    header->memory_offset = SNAPSHOT_PAGE_SIZE;
+    header->memory_size = SNAPSHOT_MEMORY_SIZE;
+    header->devices_offset = SNAPSHOT_PAGE_SIZE + SNAPSHOT_MEMORY_SIZE;
+    header->devices_size = devices_size;
+    header->retired = state.retired;
+    header->accelerated_traps = state.accelerated_traps;
+    memcpy(header->registers, state.registers, sizeof(header->registers));
+    interrupt_controller_get_pending(simulator->inter_cont, header->interrupts);
+}
+
+/* Writes the whole machine, cpu, memory, pending interrupts, device registers and ticks and
+ * whatever the devices' save hooks give, to path. Breakpoints, the engine and device io
+ * aren't part of it. Returns -1 with errno set on failure, EINVAL if an attached device's
+ * state can't be saved. */
+int simulator_save_snapshot(Simulator *simulator, const char *path) {
+    struct snapshot_header *header;
+    uint16_t *memory;
+    char *devices;
+    size_t devices_size;
+    int fd, result, saved_errno;
+    devices = simulator_save_devices(simulator, &devices_size);
+    if (devices == NULL && list_num_elements(simulator->devices) > 0) {
+        return -1;
+    }
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(devices);
+        return -1;
+    }
+    header = safe_malloc(SNAPSHOT_PAGE_SIZE);
+    simulator_fill_snapshot_header(simulator, header, devices_size);
+    memory = safe_malloc(SNAPSHOT_MEMORY_SIZE);
+    bus_copy_memory(simulator->bus, memory);
+    result = 0;
+    if (safe_write(fd, header, SNAPSHOT_PAGE_SIZE) != SNAPSHOT_PAGE_SIZE ||
+        safe_write(fd, memory, SNAPSHOT_MEMORY_SIZE) != SNAPSHOT_MEMORY_SIZE ||
+        safe_write(fd, devices, devices_size) != devices_size) {
+        result = -1;
+    }
+    saved_errno = errno;
+    if (close(fd) < 0 && result == 0) {
+        saved_errno = errno;
+        result = -1;
+    }
+    free(header);
+    free(memory);
+    free(devices);
+    errno = saved_errno;
+    return result;
+}
+
+/* The record at *pos if it fits in the device section and matches device, moving *pos past it */
+static const struct snapshot_device *simulator_check_device_record(struct simulator_device *entry, const char *records,
+                                                                   size_t records_size, size_t *pos) {
+    const struct snapshot_device *record;
+    const struct device_register *registers;
+    const uint16_t *pairs;
+    size_t num_registers, i;
+    if (records_size - *pos < sizeof(struct snapshot_device)) {
+        return NULL;
+    }
+    record = (const struct snapshot_device *)(records + *pos);
+    num_registers = simulator_device_registers(entry->device, &registers);
+    if (record->size % 8 != 0 || record->size > records_size - *pos || record->num_registers != num_registers ||
+        record->tick > SNAPSHOT_TICK_DEADLINE ||
+        record->size < sizeof(struct snapshot_device) + sizeof(uint16_t) * 2 * num_registers + (size_t)record->state_size ||
+        (record->state_size != 0 && entry->restore == NULL)) {
+        return NULL;
+    }
+    pairs = (const uint16_t *)(record + 1);
+    for (i = 0; i < num_registers; ++i) {
+        if (pairs[2 * i] != registers[i].address) {
+            return NULL;
+        }
+    }
+    *pos += record->size;
+    return record;
+}
+
+/* Whether there is a record that fits for every attached device */
+static int simulator_check_device_records(Simulator *simulator, const char *records, size_t records_size) {
+    size_t i, pos, num_devices;
+    num_devices = list_num_elements(simulator->devices);
+    pos = 0;
+    for (i = 0; i < num_devices; ++i) {
+        if (simulator_check_device_record(list_get(simulator->devices, i), records, records_size, &pos) == NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Checks that the snapshot was made by this version, on a machine like this one, with the same
+ * devices attached in the same order */
+static int simulator_check_snapshot(Simulator *simulator, const char *image, size_t image_size) {
+    const struct snapshot_header *header;
+    header = (const struct snapshot_header *)image;
+    if (image_size < SNAPSHOT_PAGE_SIZE || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        header->version != SNAPSHOT_VERSION || header->byte_order != SNAPSHOT_BYTE_ORDER ||
+        header->page_size != SNAPSHOT_PAGE_SIZE || header->memory_size != SNAPSHOT_MEMORY_SIZE ||
+        header->memory_offset % SNAPSHOT_PAGE_SIZE != 0 || header->devices_offset % 8 != 0 ||
+        header->memory_offset > image_size || image_size - header->memory_offset < header->memory_size ||
+        header->devices_offset > image_size || image_size - header->devices_offset < header->devices_size ||
+        header->num_devices != list_num_elements(simulator->devices)) {
+        return 0;
+    }
+    return simulator_check_device_records(simulator, image + header->devices_offset, header->devices_size);
+}
+
+static void simulator_restore_device_tick(Simulator *simulator, struct device *device,
+                                          const struct snapshot_device *record) {
+    tick_queue_cancel(simulator->tick_queue, device);
+    simulator_remove_on_tick_subscription(simulator, device);
+    if (device->on_tick == NULL) {
+        return;
+    }
+    if (record->tick == SNAPSHOT_TICK_DEADLINE) {
+        tick_queue_schedule(simulator->tick_queue, device, record->deadline);
+    } else if (record->tick == SNAPSHOT_TICK_SERVICE) {
+        simulator_add_on_tick_subscription(simulator, device);
+    }
+}
+
+static int simulator_restore_devices(Simulator *simulator, const char *records) {
+    size_t i, j, num_devices;
+    num_devices = list_num_elements(simulator->devices);
+    for (i = 0; i < num_devices; ++i) {
+        struct simulator_device *entry;
+        const struct snapshot_device *record;
+        const struct device_register *registers;
+        const uint16_t *pairs;
+        entry = list_get(simulator->devices, i);
+        record = (const struct snapshot_device *)records;
+        pairs = (const uint16_t *)(record + 1);
+        simulator_device_registers(entry->device, &registers);
+        for (j = 0; j < record->num_registers; ++j) {
+            *registers[j].value = pairs[2 * j + 1];
+        }
+        if (record->state_size != 0 &&
+            entry->restore(entry->device, pairs + 2 * record->num_registers, record->state_size) < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        simulator_restore_device_tick(simulator, entry->device, record);
+        records += record->size;
+    }
+    return 0;
+}
+
+/* Puts the machine back in the state simulator_save_snapshot found it in. The same devices
+ * have to be attached in the same order. The file is mapped and memory restored with one copy.
+ * Returns -1 with errno set on failure, EINVAL if the file isn't a snapshot this simulator
+ * can use, which leaves the simulator as it was. If a device's restore hook fails the state is
+ * only partly restored. */
+int simulator_load_snapshot(Simulator *simulator, const char *path) {
+    const struct snapshot_header *header;
+    struct cpu_state state;
+    struct stat file_stat;
+    char *image;
+    int fd, result, saved_errno;
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &file_stat) < 0) {
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    if (file_stat.st_size < SNAPSHOT_PAGE_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    image = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    saved_errno = errno;
+    close(fd);
+    if (image == MAP_FAILED) {
+        errno = saved_errno;
+        return -1;
+    }
+    result = -1;
+    header = (const struct snapshot_header *)image;
+    if (!simulator_check_snapshot(simulator, image, file_stat.st_size)) {
+        errno = EINVAL;
+    } else if (simulator_restore_devices(simulator, image + header->devices_offset) == 0) {
+        bus_set_memory(simulator->bus, (const uint16_t *)(image + header->memory_offset));
+        interrupt_controller_set_pending(simulator->inter_cont, header->interrupts);
+        memcpy(state.registers, header->registers, sizeof(state.registers));
+        state.retired = header->retired;
+        state.accelerated_traps = header->accelerated_traps;
+        cpu_invalidate_all(simulator->cpu);
+        cpu_set_state(simulator->cpu, &state);
+        simulator_history_clear(simulator);
+        result = 0;
+    }
+    saved_errno = errno;
+    munmap(image, file_stat.st_size);
+    errno = saved_errno;
+    return result;
+}
+
+/* Remembers the machine as it is now, usually right after the programs were loaded, for
+ * simulator_reset_to_baseline. It holds what a snapshot would. Returns -1 with errno set if a
+ * device's save hook fails, EINVAL if an attached device's state can't be saved, in which case
+ * the devices have to be attached anew instead. */
+int simulator_set_baseline(Simulator *simulator) {
+    struct simulator_baseline *baseline;
+    char *devices;
+    size_t devices_size;
+    devices = simulator_save_devices(simulator, &devices_size);
+    if (devices == NULL && list_num_elements(simulator->devices) > 0) {
+        return -1;
+    }
+    simulator_free_baseline(simulator);
+    baseline = safe_malloc(sizeof(struct simulator_baseline));
+    cpu_get_state(simulator->cpu, &baseline->cpu);
+    interrupt_controller_get_pending(simulator->inter_cont, baseline->interrupts);
+    baseline->devices = devices;
+    baseline->devices_size = devices_size;
+    baseline->num_devices = list_num_elements(simulator->devices);
+    bus_set_baseline(simulator->bus);
+    simulator->baseline = baseline;
+    return 0;
+}
+
+static void simulator_baseline_restored(void *data, uint16_t address, size_t num_words) {
+    Simulator *simulator;
+    size_t i;
+    simulator = data;
+    for (i = 0; i < num_words; ++i) {
+        cpu_invalidate(simulator->cpu, address + i);
+    }
+}
+
+/* Puts the machine back the way simulator_set_baseline found it. Only the memory pages written
+ * since are copied, and the cpu keeps what it decoded from the others. Returns -1 with errno
+ * set to EINVAL if there is no baseline or the attached devices changed since. */
+int simulator_reset_to_baseline(Simulator *simulator) {
+    struct simulator_baseline *baseline;
+    baseline = simulator->baseline;
+    if (baseline == NULL || baseline->num_devices != list_num_elements(simulator->devices) ||
+        !simulator_check_device_records(simulator, baseline->devices, baseline->devices_size)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (simulator_restore_devices(simulator, baseline->devices) < 0) {
+        return -1;
+    }
+    bus_restore_baseline(simulator->bus, simulator_baseline_restored, simulator);
+    interrupt_controller_set_pending(simulator->inter_cont, baseline->interrupts);
+    cpu_set_state(simulator->cpu, &baseline->cpu);
+    simulator_history_clear(simulator);
+    return 0;
+}
+
+/* Records what the program does from here so it can be run backwards with simulator_reverse.
+ * Each instruction's registers and memory writes are kept for the last log_size of them, and
+ * every checkpoint_interval instructions the pages written since are copied, up to
+ * max_checkpoints times before the oldest are merged. A log_size of 0 stops recording. The
+ * program runs on the interpreter while recording, whatever the engine. */
+void simulator_set_history(Simulator *simulator, size_t log_size, unsigned long long checkpoint_interval,
+                           size_t max_checkpoints) {
+    if (simulator->history != NULL) {
+        cpu_set_recorder(simulator->cpu, NULL, NULL);
+        bus_set_write_log(simulator->bus, NULL, NULL);
+        history_free(simulator->history);
+        simulator->history = NULL;
+    }
+    if (log_size == 0) {
+        return;
+    }
+    simulator->history = history_new(simulator->bus_accessor.direct_map.memory, log_size, checkpoint_interval,
+                                     max_checkpoints);
+    cpu_set_recorder(simulator->cpu, simulator_history_record, simulator->history);
+    bus_set_write_log(simulator->bus, simulator_history_log_write, simulator->history);
+}
+
+/* Runs the program backwards max_instructions, or until the pc is at a breakpoint when it is
+ * SIMULATOR_NO_LIMIT, undoing interrupts and edits made in between as well. Only memory and
+ * the cpu go back, devices, pending interrupts and what was input or output stay as they are.
+ * Once the per instruction log runs out a step can only go back as far as the latest
+ * checkpoint at or before where it was headed. *reason is SIMULATOR_STOP_NO_HISTORY if it
+ * stopped short for lack of history. */
+void simulator_reverse(Simulator *simulator, long long max_instructions, enum simulator_stop_reason *reason) {
+    struct cpu_state before;
+    unsigned long long retired, target;
+    if (simulator->history == NULL) {
+        *reason = SIMULATOR_STOP_NO_HISTORY;
+        return;
+    }
+    retired = cpu_retired(simulator->cpu);
+    target = max_instructions == SIMULATOR_NO_LIMIT || (unsigned long long)max_instructions > retired
+             ? 0 : retired - max_instructions;
+    *reason = SIMULATOR_STOP_NO_HISTORY;
+    while (max_instructions == SIMULATOR_NO_LIMIT || retired > target) {
+        if (!history_undo_step(simulator->history, simulator_history_restore, simulator, &before)) {
+            if (max_instructions != SIMULATOR_NO_LIMIT &&
+                history_rewind(simulator->history, target, simulator_history_restore, simulator, &before)) {
+                cpu_set_state(simulator->cpu, &before);
+                retired = before.retired;
+            }
+            break;
+        }
+        cpu_set_state(simulator->cpu, &before);
+        if (max_instructions == SIMULATOR_NO_LIMIT && before.retired < retired &&
+            cpu_breakpoint(simulator->cpu, before.registers[REG_PC])) {
+            *reason = SIMULATOR_STOP_BREAKPOINT;
+            break;
+        }
+        retired = before.retired;
+    }
+    if (max_instructions != SIMULATOR_NO_LIMIT && retired <= target) {
+        *reason = SIMULATOR_STOP_BUDGET;
+    }
+    /* going forward again starts with the instruction it stopped at */
+    cpu_pass_breakpoint(simulator->cpu);
+}
+
 static void simulator_host_write_output(struct host *host, char output) {
     Simulator *simulator;
     simulator = host->data;
     simulator->device_io->write_char(simulator->device_io, output);
 }
 
+static void simulator_host_write_output_buf(struct host *host, const char *output, size_t len) {
+    Simulator *simulator;
+    size_t i;
+    simulator = host->data;
+    if (simulator->device_io->write_buf != NULL) {
+        simulator->device_io->write_buf(simulator->device_io, output, len);
+    } else {
+        for (i = 0; i < len; ++i) {
+            simulator->device_io->write_char(simulator->device_io, output[i]);
+        }
+    }
+}
+
 static void simulator_host_alert_interrupt(struct host *host, uint8_t vec, uint8_t priority) {
     Simulator *simulator;
     simulator = host->data;
     interrupt_controller_alert(simulator->inter_cont, vec, priority);
 }
 
+static void simulator_host_schedule_tick(struct host *host, struct device *device, unsigned long long instructions) {
+    Simulator *simulator;
+    simulator = host->data;
+    simulator_remove_on_tick_subscription(simulator, device);
+    tick_queue_schedule(simulator->tick_queue, device,
+                        cpu_retired(simulator->cpu) + (instructions < 1 ? 1 : instructions));
+}
+
+static struct simulator_device *simulator_find_device(Simulator *simulator, struct device *device) {
+    size_t i, num_devices;
+    num_devices = list_num_elements(simulator->devices);
+    for (i = 0; i < num_devices; ++i) {
+        struct simulator_device *entry;
+        entry = list_get(simulator->devices, i);
+        if (entry->device == device) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void simulator_host_set_state_hooks(struct host *host, struct device *device,
+                                           size_t (*save)(struct device *, void *, size_t),
+                                           int (*restore)(struct device *, const void *, size_t)) {
+    struct simulator_device *entry;
+    entry = simulator_find_device(host->data, device);
+    if (entry != NULL) {
+        entry->save = save;
+        entry->restore = restore;
+    }
+}
+
 static void init_host(Simulator *simulator) {
     simulator->host.data = simulator;
     simulator->host.write_output = simulator_host_write_output;
+    simulator->host.write_output_buf = simulator_host_write_output_buf;
     simulator->host.alert_interrupt = simulator_host_alert_interrupt;
+    simulator->host.schedule_tick = simulator_host_schedule_tick;
+    simulator->host.set_state_hooks = simulator_host_set_state_hooks;
 }
 
 Simulator *simulator_new(struct device_io *device_io) {
@@ -204,12 +1078,20 @@ Simulator *simulator_new(struct device_io *device_io) {
     simulator = safe_malloc(sizeof(Simulator));
     simulator->bus = bus_new();
     simulator->inter_cont = interrupt_controller_new();
+    simulator->pending_interrupt_levels = interrupt_controller_pending_levels(simulator->inter_cont);
     init_bus_accessor(simulator->bus, &simulator->bus_accessor);
     simulator->cpu = new_Cpu(&simulator->bus_accessor);
+    bus_add_write_hook(simulator->bus, MCR_ADDR, simulator_mcr_written, simulator->cpu);
     init_host(simulator);
     simulator->device_io = device_io;
+    simulator->devices = list_new(sizeof(struct simulator_device), 2, 2.0, &util_list_allocator);
     simulator->on_input_devices = NULL;
     simulator->on_tick_devices = NULL;
+    simulator->tick_queue = tick_queue_new();
+    simulator->baseline = NULL;
+    simulator->history = NULL;
+    simulator->engine = SIMULATOR_ENGINE_INTERP;
+    simulator->service_interval = SIMULATOR_SERVICE_INTERVAL;
     return simulator;            
 }
 
@@ -217,7 +1099,13 @@ void simulator_free(Simulator *simulator) {
     bus_free(simulator->bus);
     interrupt_controller_free(simulator->inter_cont);
     free_cpu(simulator->cpu);
+    list_free(simulator->devices);
     list_free(simulator->on_input_devices);
     list_free(simulator->on_tick_devices);
+    tick_queue_free(simulator->tick_queue);
+    simulator_free_baseline(simulator);
+    if (simulator->history != NULL) {
+        history_free(simulator->history);
+    }
     free(simulator);
 }
\ No newline at end of file
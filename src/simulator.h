@@ -2,6 +2,7 @@
 #define SIMULATOR_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include "device.h"
 #include "device_io.h"
@@ -16,19 +17,64 @@
 #define HIGH_PRIORITY        7
 
 enum simulator_address_status {OUT_OF_BOUNDS, DEVICE_REGISTER, VALUE};
+enum simulator_engine {SIMULATOR_ENGINE_INTERP, SIMULATOR_ENGINE_JIT};
+enum simulator_stop_reason {
+    SIMULATOR_STOP_HALTED,
+    SIMULATOR_STOP_BUDGET,
+    SIMULATOR_STOP_BREAKPOINT,
+    SIMULATOR_STOP_ILLEGAL_OPCODE,
+    SIMULATOR_STOP_IO_ERROR,
+    SIMULATOR_STOP_NO_HISTORY /* simulator_reverse ran out of recorded history */
+};
 
+#define SIMULATOR_NO_LIMIT -1
+
+struct simulator_stats {
+    unsigned long long instructions; /* retired since the last reset */
+    unsigned long long accelerated_traps; /* of those, traps whose service routine ran natively */
+};
+
+/* A Simulator keeps all of its state, cpu, bus and interrupt controller included, to itself.
+ * Different instances can run on different threads at the same time, but one instance must
+ * only be used by one thread at a time, and the devices and device_io attached to it have to
+ * belong to it alone. Raw mode on a shared terminal is reference counted, and a
+ * SimulatorImage can be used by any number of instances on any thread. make check runs
+ * tests/thread_stress.c against this, make check-tsan does so under ThreadSanitizer. */
 struct simulator;
 typedef struct simulator Simulator;
 
+struct simulator_image;
+typedef struct simulator_image SimulatorImage;
+
 void simulator_update_devices_input(Simulator *, uint16_t);
 enum simulator_address_status simulator_read_address(Simulator *, uint16_t, uint16_t *);
 uint16_t simulator_read_register(Simulator *, enum lc3_reg);
 void simulator_write_register(Simulator *, enum lc3_reg, uint16_t);
-int simulator_run_until_end(Simulator *);
-int simulator_step(Simulator *, long long);
+int simulator_set_engine(Simulator *, enum simulator_engine);
+int simulator_run(Simulator *, long long, enum simulator_stop_reason *);
+int simulator_run_lockstep(Simulator **, int, long long, enum simulator_stop_reason *);
+void simulator_set_service_interval(Simulator *, long long);
+void simulator_set_trap_acceleration(Simulator *, int);
+void simulator_get_stats(Simulator *, struct simulator_stats *);
+void simulator_set_breakpoint(Simulator *, uint16_t, int);
+int simulator_breakpoint(Simulator *, uint16_t);
 void simulator_write_address(Simulator *, uint16_t, uint16_t);
 int simulator_load_program(Simulator *, int (*)(void *, uint16_t *), void *);
 int simulator_attach_device(Simulator *, struct device *);
+void simulator_reset(Simulator *);
+/* A snapshot holds a device's registers if it is a REGISTERS device and whatever its
+ * set_state_hooks save hook gives. Saving fails with EINVAL while a RANGE or SEPERATE device
+ * without a save hook is attached. A REGISTERS device with state besides its registers has
+ * to set state hooks, or that state isn't saved or restored. */
+int simulator_save_snapshot(Simulator *, const char *);
+int simulator_load_snapshot(Simulator *, const char *);
+int simulator_set_baseline(Simulator *);
+int simulator_reset_to_baseline(Simulator *);
+void simulator_set_history(Simulator *, size_t, unsigned long long, size_t);
+void simulator_reverse(Simulator *, long long, enum simulator_stop_reason *);
+SimulatorImage *simulator_image_new(Simulator *);
+void simulator_image_free(SimulatorImage *);
+int simulator_use_image(Simulator *, SimulatorImage *);
 int simulator_load_program(Simulator *, int (*)(void *, uint16_t *), void *);
 
 Simulator *simulator_new(struct device_io *);
@@ -2,24 +2,39 @@
 #include <errno.h>
 #include <termios.h>
 #include <stdlib.h>
+#include <pthread.h>
 
+/* The terminal belongs to the whole process, so every simulator running at once shares one
+ * raw mode. The first init_terminal saves the settings and the last reset_terminal puts them back. */
+static pthread_mutex_t terminal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t atexit_once = PTHREAD_ONCE_INIT;
 static struct termios saved_termios;
+static int num_users = 0;
 
 static void termios_atexit(void) {
-   tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_termios);
+   pthread_mutex_lock(&terminal_lock);
+   if (num_users > 0) {
+      tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_termios);
+   }
+   pthread_mutex_unlock(&terminal_lock);
+}
+
+static void register_atexit(void) {
+   atexit(termios_atexit);
 }
 
 void reset_terminal(void) {
-   termios_atexit();
+   pthread_mutex_lock(&terminal_lock);
+   if (num_users > 0 && --num_users == 0) {
+      tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_termios);
+   }
+   pthread_mutex_unlock(&terminal_lock);
 }
 
-int init_terminal(void) {
+static int set_raw_mode(void) {
    int err;
    struct termios buf;
 
-   if (!isatty(STDIN_FILENO)) {
-      return 0;
-   }
    if (tcgetattr(STDIN_FILENO, &buf) < 0) {
       return -1;
    }
@@ -45,6 +60,23 @@ int init_terminal(void) {
       errno = EINVAL;
       return -1;
    }
-   atexit(termios_atexit);
    return 0;
 }
+
+/* Returns 1 if the terminal is now raw and reset_terminal has to be called, 0 if stdin isn't a terminal */
+int init_terminal(void) {
+   int status;
+   if (!isatty(STDIN_FILENO)) {
+      return 0;
+   }
+   pthread_once(&atexit_once, register_atexit);
+   pthread_mutex_lock(&terminal_lock);
+   status = 1;
+   if (num_users == 0 && set_raw_mode() < 0) {
+      status = -1;
+   } else {
+      ++num_users;
+   }
+   pthread_mutex_unlock(&terminal_lock);
+   return status;
+}
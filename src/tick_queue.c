@@ -0,0 +1,145 @@
+#include <stdlib.h>
+
+#include "tick_queue.h"
+#include "util.h"
+
+#define TICK_QUEUE_SIZE_INIT 4
+
+struct tick_event {
+    unsigned long long deadline; /* retired instruction count the device wants its tick at */
+    struct device *device;
+};
+
+/* min heap of events on deadline, a device is in it at most once */
+struct tick_queue {
+    struct tick_event *heap;
+    size_t size;
+    size_t capacity;
+};
+
+TickQueue *tick_queue_new(void) {
+    TickQueue *queue;
+    queue = safe_malloc(sizeof(TickQueue));
+    queue->heap = safe_malloc(sizeof(struct tick_event) * TICK_QUEUE_SIZE_INIT);
+    queue->capacity = TICK_QUEUE_SIZE_INIT;
+    queue->size = 0;
+    return queue;
+}
+
+void tick_queue_free(TickQueue *queue) {
+    free(queue->heap);
+    free(queue);
+}
+
+/* Drops every scheduled tick */
+void tick_queue_reset(TickQueue *queue) {
+    queue->size = 0;
+}
+
+static void tick_queue_swap(TickQueue *queue, size_t index_1, size_t index_2) {
+    struct tick_event temp;
+    temp = queue->heap[index_1];
+    queue->heap[index_1] = queue->heap[index_2];
+    queue->heap[index_2] = temp;
+}
+
+static void tick_queue_percolate_up(TickQueue *queue, size_t index) {
+    while (index != 0) {
+        size_t parent_i;
+        parent_i = (index - 1) / 2;
+        if (queue->heap[parent_i].deadline <= queue->heap[index].deadline) {
+            break;
+        }
+        tick_queue_swap(queue, index, parent_i);
+        index = parent_i;
+    }
+}
+
+static void tick_queue_percolate_down(TickQueue *queue, size_t index) {
+    for (;;) {
+        size_t smallest_i, left_i, right_i;
+        smallest_i = index;
+        left_i = 2 * index + 1;
+        right_i = 2 * index + 2;
+        if (left_i < queue->size && queue->heap[left_i].deadline < queue->heap[smallest_i].deadline) {
+            smallest_i = left_i;
+        }
+        if (right_i < queue->size && queue->heap[right_i].deadline < queue->heap[smallest_i].deadline) {
+            smallest_i = right_i;
+        }
+        if (smallest_i == index) {
+            break;
+        }
+        tick_queue_swap(queue, index, smallest_i);
+        index = smallest_i;
+    }
+}
+
+static size_t tick_queue_find(TickQueue *queue, struct device *device) {
+    size_t i;
+    for (i = 0; i < queue->size && queue->heap[i].device != device; ++i);
+    return i;
+}
+
+static void tick_queue_remove(TickQueue *queue, size_t index) {
+    queue->heap[index] = queue->heap[--queue->size];
+    if (index < queue->size) {
+        tick_queue_percolate_up(queue, index);
+        tick_queue_percolate_down(queue, index);
+    }
+}
+
+void tick_queue_cancel(TickQueue *queue, struct device *device) {
+    size_t index;
+    index = tick_queue_find(queue, device);
+    if (index < queue->size) {
+        tick_queue_remove(queue, index);
+    }
+}
+
+/* Replaces the device's deadline if it already has one */
+void tick_queue_schedule(TickQueue *queue, struct device *device, unsigned long long deadline) {
+    tick_queue_cancel(queue, device);
+    if (queue->size == queue->capacity) {
+        queue->capacity *= 2;
+        queue->heap = safe_realloc(queue->heap, sizeof(struct tick_event) * queue->capacity);
+    }
+    queue->heap[queue->size].deadline = deadline;
+    queue->heap[queue->size].device = device;
+    tick_queue_percolate_up(queue, queue->size++);
+}
+
+int tick_queue_contains(TickQueue *queue, struct device *device) {
+    return tick_queue_find(queue, device) < queue->size;
+}
+
+/* Gives the device's deadline, returns 0 if it has none */
+int tick_queue_deadline(TickQueue *queue, struct device *device, unsigned long long *deadline) {
+    size_t index;
+    index = tick_queue_find(queue, device);
+    if (index == queue->size) {
+        return 0;
+    }
+    *deadline = queue->heap[index].deadline;
+    return 1;
+}
+
+/* Gives the earliest deadline, returns 0 if nothing is scheduled */
+int tick_queue_peek(TickQueue *queue, unsigned long long *deadline) {
+    if (queue->size == 0) {
+        return 0;
+    }
+    *deadline = queue->heap[0].deadline;
+    return 1;
+}
+
+/* Removes the event with the earliest deadline and gives its device, NULL if there is none */
+struct device *tick_queue_take(TickQueue *queue) {
+    struct device *device;
+    if (queue->size == 0) {
+        return NULL;
+    }
+    device = queue->heap[0].device;
+    tick_queue_remove(queue, 0);
+    return device;
+}
@@ -0,0 +1,18 @@
+#ifndef TICK_QUEUE_H
+#define TICK_QUEUE_H
+
+#include "device.h"
+
+struct tick_queue;
+typedef struct tick_queue TickQueue;
+
+TickQueue *tick_queue_new(void);
+void tick_queue_free(TickQueue *);
+void tick_queue_reset(TickQueue *);
+void tick_queue_schedule(TickQueue *, struct device *, unsigned long long);
+int tick_queue_contains(TickQueue *, struct device *);
+int tick_queue_deadline(TickQueue *, struct device *, unsigned long long *);
+void tick_queue_cancel(TickQueue *, struct device *);
+int tick_queue_peek(TickQueue *, unsigned long long *);
+struct device *tick_queue_take(TickQueue *);
+#endif
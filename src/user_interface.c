@@ -14,6 +14,7 @@
 #include "list.h"
 #include "device_io_impl.h"
 #include "lc3_reg.h"
+#include "batch.h"
 
 #ifdef __linux__
 #define EXTENSION "so"
@@ -37,10 +38,40 @@
 
 #define UI_STEP_AMT_INDEX 1
 
+#define UI_BREAK_ADDRESS_INDEX 1
+
 #define UI_INPUT_VALUE_INDEX 1
 
 #define UI_LOAD_FILENAME_INDEX 1
 
+#define UI_SNAPSHOT_MODE_INDEX     1
+#define UI_SNAPSHOT_FILENAME_INDEX 2
+
+#define UI_ENGINE_OPTION     "--engine="
+#define UI_BATCH_OPTION      "--batch"
+#define UI_THREADS_OPTION    "--threads="
+#define UI_LANES_OPTION      "--lanes="
+#define UI_FLUSH_OPTION      "--flush="
+#define UI_FAST_TRAPS_OPTION "--fast-traps"
+#define UI_HISTORY_OPTION    "--history"
+
+#define UI_HISTORY_NUM_VALUES   3 /* log size, checkpoint interval, checkpoints */
+#define UI_HISTORY_LOG_SIZE     65536
+#define UI_HISTORY_INTERVAL     65536
+#define UI_HISTORY_CHECKPOINTS  64
+
+struct ui_options {
+    enum simulator_engine engine;
+    const char *batch_path; /* NULL when interactive */
+    int num_threads; /* 0 for one per cpu */
+    int num_lanes; /* batch jobs run in lockstep */
+    int flush_policy; /* IO_IMPL_FLUSH_* */
+    int fast_traps;
+    size_t history_log_size; /* 0 when not recording */
+    unsigned long long history_interval;
+    size_t history_checkpoints;
+};
+
 struct ui {
     Simulator *simulator;
     PluginManager *device_plugins;
@@ -65,6 +96,11 @@ static enum ui_status ui_reg(struct ui *, List *);
 static enum ui_status ui_load(struct ui *, List *);
 static enum ui_status ui_input(struct ui *, List *);
 static enum ui_status ui_quit(struct ui *, List *);
+static enum ui_status ui_break(struct ui *, List *);
+static enum ui_status ui_stats(struct ui *, List *);
+static enum ui_status ui_snapshot(struct ui *, List *);
+static enum ui_status ui_rstep(struct ui *, List *);
+static enum ui_status ui_rcontinue(struct ui *, List *);
 
 static const char *help_string = "help - print this message\n"
                                   "mem read [address], (optional)[address] - display all mem between the two addresses\n"
@@ -73,16 +109,27 @@ static const char *help_string = "help - print this message\n"
                                   "reg write [value] [register] - write register\n"
                                   "run - execute LC-3 program to the end\n"
                                   "step [low] [high] - step LC-3 program between low and high\n"
+                                  "rstep [amount] - step LC-3 program backwards, needs --history\n"
+                                  "rcontinue - run LC-3 program backwards to the last breakpoint, needs --history\n"
+                                  "break [address] - set or clear a breakpoint at address\n"
                                   "load [file] - load lc3 program\n"
                                   "input [16 bit value]\n"
+                                  "stats - display instruction counts\n"
+                                  "snapshot save|load [file] - save the machine to file or restore it\n"
                                   "quit - close simulator\n";
 
 static const struct command commands[] = {{"step", ui_step}, {"help", ui_help}, {"run", ui_run}, {"mem", ui_mem}, 
-                                        {"reg", ui_reg}, {"load", ui_load}, {"input", ui_input}, {"quit", ui_quit}}; 
-static const int num_commands = 8;
+                                        {"reg", ui_reg}, {"load", ui_load}, {"input", ui_input}, {"quit", ui_quit},
+                                        {"break", ui_break}, {"stats", ui_stats}, {"snapshot", ui_snapshot},
+                                        {"rstep", ui_rstep}, {"rcontinue", ui_rcontinue}};
+static const int num_commands = 13;
+
+static const char *usage_string = "usage: %s [--engine=jit|interp] [--flush=char|line|full] [--fast-traps] [--history[=log_size[,interval[,checkpoints]]]] [--batch jobs_file [--threads=n] [--lanes=n]]\n";
 
 static const char *REG_MEM_WRITE_MODE_STR = "write";
 static const char *REG_MEM_READ_MODE_STR  = "read";
+static const char *SNAPSHOT_SAVE_MODE_STR = "save";
+static const char *SNAPSHOT_LOAD_MODE_STR = "load";
 
 static int get_user_input(char *buffer) {
     printf("\ncommand> ");
@@ -121,11 +168,31 @@ static enum ui_status ui_help(struct ui *user_interface, List *input_tokens) {
     return CONTINUE;
 }
 
+static void ui_print_stop_reason(struct ui *user_interface, enum simulator_stop_reason reason) {
+    uint16_t pc;
+    pc = simulator_read_register(user_interface->simulator, REG_PC);
+    switch (reason) {
+    case SIMULATOR_STOP_BREAKPOINT:
+        printf("\nbreakpoint at 0X%04X\n", pc);
+        break;
+    case SIMULATOR_STOP_ILLEGAL_OPCODE:
+        printf("\nillegal opcode, continuing at 0X%04X\n", pc);
+        break;
+    case SIMULATOR_STOP_NO_HISTORY:
+        printf("\nno recorded history before 0X%04X\n", pc);
+        break;
+    default:
+        break;
+    }
+}
+
 static enum ui_status ui_run(struct ui *user_interface, List *input_tokens) {
+    enum simulator_stop_reason reason;
     if (list_num_elements(input_tokens) == 1) {
-        if (simulator_run_until_end(user_interface->simulator) < 0) {
+        if (simulator_run(user_interface->simulator, SIMULATOR_NO_LIMIT, &reason) < 0) {
             return ERROR;
         }
+        ui_print_stop_reason(user_interface, reason);
     }
     return CONTINUE;
 }
@@ -425,14 +492,91 @@ static enum ui_status ui_input(struct ui *user_interface, List *input_tokens) {
 }
 
 static enum ui_status ui_step(struct ui *user_interface, List *input_tokens) {
+    enum simulator_stop_reason reason;
     long long step_amt;
-    int step_status;
     if (!ui_step_get_amt(input_tokens, &step_amt)) {
         return CONTINUE;
     }   
-    step_status = simulator_step(user_interface->simulator, step_amt);
+    if (simulator_run(user_interface->simulator, step_amt, &reason) < 0) {
+        return ERROR;
+    }
+    ui_print_stop_reason(user_interface, reason);
+    ui_reg_print(user_interface);
+    return CONTINUE;
+}
+
+static enum ui_status ui_rstep(struct ui *user_interface, List *input_tokens) {
+    enum simulator_stop_reason reason;
+    long long step_amt;
+    if (!ui_step_get_amt(input_tokens, &step_amt)) {
+        return CONTINUE;
+    }
+    simulator_reverse(user_interface->simulator, step_amt, &reason);
+    ui_print_stop_reason(user_interface, reason);
     ui_reg_print(user_interface);
-    return step_status < 0 ? ERROR : CONTINUE;
+    return CONTINUE;
+}
+
+static enum ui_status ui_rcontinue(struct ui *user_interface, List *input_tokens) {
+    enum simulator_stop_reason reason;
+    if (list_num_elements(input_tokens) == 1) {
+        simulator_reverse(user_interface->simulator, SIMULATOR_NO_LIMIT, &reason);
+        ui_print_stop_reason(user_interface, reason);
+    }
+    return CONTINUE;
+}
+
+static void ui_break_print_usage(void) {
+    printf("break usage: break [address]\n");
+}
+
+static enum ui_status ui_break(struct ui *user_interface, List *input_tokens) {
+    char *address_token;
+    uint16_t address;
+    int set;
+    if (!ui_get_token(input_tokens, UI_BREAK_ADDRESS_INDEX, &address_token) ||
+        !ui_convert_address_token(address_token, &address)) {
+        ui_break_print_usage();
+        return CONTINUE;
+    }
+    set = !simulator_breakpoint(user_interface->simulator, address);
+    simulator_set_breakpoint(user_interface->simulator, address, set);
+    printf("breakpoint %s at 0X%04X\n", set ? "set" : "cleared", address);
+    return CONTINUE;
+}
+
+static enum ui_status ui_stats(struct ui *user_interface, List *input_tokens) {
+    struct simulator_stats stats;
+    simulator_get_stats(user_interface->simulator, &stats);
+    printf("instructions: %llu\naccelerated traps: %llu\n", stats.instructions, stats.accelerated_traps);
+    return CONTINUE;
+}
+
+static void ui_snapshot_print_usage(void) {
+    printf("snapshot usage: snapshot save|load [filename]\n");
+}
+
+/* Restoring needs the devices that are attached now to be the ones the snapshot was saved with */
+static enum ui_status ui_snapshot(struct ui *user_interface, List *input_tokens) {
+    char *mode_token, *filename;
+    int result;
+    if (!ui_get_token(input_tokens, UI_SNAPSHOT_MODE_INDEX, &mode_token) ||
+        !ui_get_token(input_tokens, UI_SNAPSHOT_FILENAME_INDEX, &filename)) {
+        ui_snapshot_print_usage();
+        return CONTINUE;
+    }
+    if (strcmp(mode_token, SNAPSHOT_SAVE_MODE_STR) == 0) {
+        result = simulator_save_snapshot(user_interface->simulator, filename);
+    } else if (strcmp(mode_token, SNAPSHOT_LOAD_MODE_STR) == 0) {
+        result = simulator_load_snapshot(user_interface->simulator, filename);
+    } else {
+        ui_snapshot_print_usage();
+        return CONTINUE;
+    }
+    if (result < 0) {
+        printf("%s: %s\n", filename, strerror(errno));
+    }
+    return CONTINUE;
 }
 
 static void tokenize_input(char *input, List *tokens) {
@@ -550,14 +694,165 @@ List *get_plugin_dir_names(void) {
     return plugin_dir_names;
 }
 
-int start(void) {
+static int ui_convert_engine(const char *engine_str, enum simulator_engine *engine) {
+    int result;
+    result = 1;
+    if (strcmp(engine_str, "jit") == 0) {
+        *engine = SIMULATOR_ENGINE_JIT;
+    } else if (strcmp(engine_str, "interp") == 0) {
+        *engine = SIMULATOR_ENGINE_INTERP;
+    } else {
+        result = 0;
+    }
+    return result;
+}
+
+static int ui_convert_flush(const char *flush_str, int *policy) {
+    int result;
+    result = 1;
+    if (strcmp(flush_str, "char") == 0) {
+        *policy = IO_IMPL_FLUSH_EACH;
+    } else if (strcmp(flush_str, "line") == 0) {
+        *policy = IO_IMPL_FLUSH_DEFAULT;
+    } else if (strcmp(flush_str, "full") == 0) {
+        *policy = IO_IMPL_FLUSH_INPUT | IO_IMPL_FLUSH_END;
+    } else {
+        result = 0;
+    }
+    return result;
+}
+
+static int ui_parse_count(const char *str, int *count) {
+    char *end;
+    *count = strtol(str, &end, 10);
+    return *end == '\0' && *count > 0;
+}
+
+/* log_size[,interval[,checkpoints]], the ones left out keep their defaults */
+static int ui_parse_history(const char *str, struct ui_options *options) {
+    unsigned long long values[UI_HISTORY_NUM_VALUES];
+    char *end;
+    int i;
+    values[0] = UI_HISTORY_LOG_SIZE;
+    values[1] = UI_HISTORY_INTERVAL;
+    values[2] = UI_HISTORY_CHECKPOINTS;
+    for (i = 0; i < UI_HISTORY_NUM_VALUES; ++i) {
+        values[i] = strtoull(str, &end, 10);
+        if (end == str || values[i] == 0 || (*end != '\0' && *end != ',')) {
+            return 0;
+        }
+        if (*end == '\0') {
+            break;
+        }
+        str = end + 1;
+    }
+    if (i == UI_HISTORY_NUM_VALUES) {
+        return 0;
+    }
+    options->history_log_size = values[0];
+    options->history_interval = values[1];
+    options->history_checkpoints = values[2];
+    return 1;
+}
+
+static int ui_parse_option(int argc, char **argv, int *i, struct ui_options *options) {
+    size_t engine_option_len, threads_option_len, lanes_option_len, flush_option_len;
+    engine_option_len = strlen(UI_ENGINE_OPTION);
+    threads_option_len = strlen(UI_THREADS_OPTION);
+    lanes_option_len = strlen(UI_LANES_OPTION);
+    flush_option_len = strlen(UI_FLUSH_OPTION);
+    if (strncmp(argv[*i], UI_ENGINE_OPTION, engine_option_len) == 0) {
+        return ui_convert_engine(argv[*i] + engine_option_len, &options->engine);
+    }
+    if (strncmp(argv[*i], UI_THREADS_OPTION, threads_option_len) == 0) {
+        return ui_parse_count(argv[*i] + threads_option_len, &options->num_threads);
+    }
+    if (strncmp(argv[*i], UI_LANES_OPTION, lanes_option_len) == 0) {
+        return ui_parse_count(argv[*i] + lanes_option_len, &options->num_lanes);
+    }
+    if (strncmp(argv[*i], UI_FLUSH_OPTION, flush_option_len) == 0) {
+        return ui_convert_flush(argv[*i] + flush_option_len, &options->flush_policy);
+    }
+    if (strcmp(argv[*i], UI_FAST_TRAPS_OPTION) == 0) {
+        options->fast_traps = 1;
+        return 1;
+    }
+    if (strcmp(argv[*i], UI_HISTORY_OPTION) == 0) {
+        options->history_log_size = UI_HISTORY_LOG_SIZE;
+        return 1;
+    }
+    if (strncmp(argv[*i], UI_HISTORY_OPTION "=", strlen(UI_HISTORY_OPTION "=")) == 0) {
+        return ui_parse_history(argv[*i] + strlen(UI_HISTORY_OPTION "="), options);
+    }
+    if (strcmp(argv[*i], UI_BATCH_OPTION) == 0 && *i + 1 < argc) {
+        options->batch_path = argv[++*i];
+        return 1;
+    }
+    return 0;
+}
+
+static int ui_parse_options(int argc, char **argv, struct ui_options *options) {
+    int i;
+    options->engine = SIMULATOR_ENGINE_INTERP;
+    options->batch_path = NULL;
+    options->num_threads = 0;
+    options->num_lanes = 1;
+    options->flush_policy = IO_IMPL_FLUSH_DEFAULT;
+    options->fast_traps = 0;
+    options->history_log_size = 0;
+    options->history_interval = UI_HISTORY_INTERVAL;
+    options->history_checkpoints = UI_HISTORY_CHECKPOINTS;
+    for (i = 1; i < argc; ++i) {
+        if (!ui_parse_option(argc, argv, &i, options)) {
+            fprintf(stderr, usage_string, argv[0]);
+            return 0;
+        }
+    }
+    if ((options->num_threads != 0 || options->num_lanes != 1) && options->batch_path == NULL) {
+        fprintf(stderr, usage_string, argv[0]);
+        return 0;
+    }
+    if (options->history_log_size != 0 && options->batch_path != NULL) {
+        fprintf(stderr, usage_string, argv[0]);
+        return 0;
+    }
+    return 1;
+}
+
+static void ui_set_engine(struct ui *user_interface, enum simulator_engine engine) {
+    if (simulator_set_engine(user_interface->simulator, engine) < 0) {
+        fprintf(stderr, "Can't start the jit engine: %s. Using the interpreter.\n", strerror(errno));
+    }
+}
+
+static int ui_batch(PluginManager *device_plugins, struct ui_options *options) {
+    int num_failed;
+    num_failed = batch_run(options->batch_path, device_plugins, options->engine, options->fast_traps,
+                           options->num_threads, options->num_lanes);
+    pm_free(device_plugins);
+    return num_failed == 0 ? 0 : -1;
+}
+
+int start(int argc, char **argv) {
     struct ui user_interface;
+    struct ui_options options;
     List *plugin_dir_paths;
+    if (!ui_parse_options(argc, argv, &options)) {
+        return -1;
+    }
     plugin_dir_paths = get_plugin_dir_names();
     user_interface.device_plugins = pm_new(on_load_plugin_error, NULL);
     pm_load_device_plugins(user_interface.device_plugins, plugin_dir_paths, EXTENSION);
+    if (options.batch_path != NULL) {
+        return ui_batch(user_interface.device_plugins, &options);
+    }
     user_interface.device_io_impl = create_device_io_impl(STDIN_FILENO, STDOUT_FILENO);
+    io_impl_set_flush_policy(user_interface.device_io_impl, options.flush_policy);
     user_interface.simulator = simulator_new(user_interface.device_io_impl);
+    ui_set_engine(&user_interface, options.engine);
+    simulator_set_trap_acceleration(user_interface.simulator, options.fast_traps);
+    simulator_set_history(user_interface.simulator, options.history_log_size, options.history_interval,
+                          options.history_checkpoints);
     attach_devices(&user_interface);
     if (ui_loop(&user_interface) < 0) {
         perror(NULL);
@@ -1,6 +1,6 @@
 #ifndef USER_INTERFACE_H
 #define USER_INTERFACE_H
 
-int start(char *);
+int start(int, char **);
 
 #endif
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "batch.h"
+#include "device.h"
+#include "device_io.h"
+#include "plugin_manager.h"
+#include "simulator.h"
+#include "list.h"
+#include "util.h"
+
+#ifdef __linux__
+#define EXTENSION "so"
+#endif
+#ifdef __APPLE__
+#define EXTENSION "dylib"
+#endif
+
+#define BASELINE_NUM_JOBS 16
+#define BASELINE_DIR_SIZ  224
+#define BASELINE_PATH_SIZ 256
+
+/* Runs the same job again and again through batch_run with tests/plugins/counter.c, a version
+ * 1 device whose state no baseline can hold, attached. Every job has to see a fresh device, so
+ * a lane that went back to a baseline instead of attaching its devices again prints B and
+ * fails. Also checks that simulator_set_baseline and simulator_save_snapshot refuse such a
+ * device. Exits with 1 if anything is off. */
+
+static const uint16_t baseline_program[] = {
+    0x3000, /* .ORIG x3000 */
+    0xA002, /* LDI R0, COUNTER */
+    0x5020, /* AND R0, R0, #0 */
+    0xB001, /* STI R0, MCR */
+    0xFE30, /* COUNTER .FILL xFE30 */
+    0xFFFE, /* MCR .FILL xFFFE */
+};
+
+static const size_t baseline_program_len = sizeof(baseline_program) / sizeof(uint16_t);
+
+static const char baseline_expected[] = "A";
+
+struct baseline_reader {
+    size_t pos;
+};
+
+struct baseline_files {
+    char dir[BASELINE_DIR_SIZ];
+    char program[BASELINE_PATH_SIZ];
+    char expected[BASELINE_PATH_SIZ];
+    char jobs[BASELINE_PATH_SIZ];
+    char snapshot[BASELINE_PATH_SIZ];
+};
+
+static int baseline_reader_next(void *data, uint16_t *word) {
+    struct baseline_reader *reader;
+    reader = data;
+    if (reader->pos == baseline_program_len) {
+        return 0;
+    }
+    *word = baseline_program[reader->pos++];
+    return 1;
+}
+
+static int baseline_io_get_char(struct device_io *io, char *c) {
+    return 0;
+}
+
+static int baseline_io_write_char(struct device_io *io, char c) {
+    return 1;
+}
+
+static int baseline_io_nop(struct device_io *io) {
+    return 0;
+}
+
+static void on_load_plugin_error(const char *path, const char *error_string, enum pm_error error_type, void *data) {
+    fprintf(stderr, "Error loading device plugins from %s: %s.\n", path, error_string);
+}
+
+static int baseline_write_files(struct baseline_files *files) {
+    FILE *file;
+    size_t i;
+    uint16_t word;
+    int result;
+    snprintf(files->program, sizeof(files->program), "%s/counter.obj", files->dir);
+    snprintf(files->expected, sizeof(files->expected), "%s/counter.out", files->dir);
+    snprintf(files->jobs, sizeof(files->jobs), "%s/jobs", files->dir);
+    snprintf(files->snapshot, sizeof(files->snapshot), "%s/snapshot", files->dir);
+    if ((file = fopen(files->program, "w")) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < baseline_program_len; ++i) {
+        word = htons(baseline_program[i]);
+        fwrite(&word, sizeof(word), 1, file);
+    }
+    result = ferror(file) ? -1 : 0;
+    fclose(file);
+    if (result < 0 || (file = fopen(files->expected, "w")) == NULL) {
+        return -1;
+    }
+    fputs(baseline_expected, file);
+    result = ferror(file) ? -1 : 0;
+    fclose(file);
+    if (result < 0 || (file = fopen(files->jobs, "w")) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < BASELINE_NUM_JOBS; ++i) {
+        fprintf(file, "%s - %s\n", files->program, files->expected);
+    }
+    result = ferror(file) ? -1 : 0;
+    fclose(file);
+    return result;
+}
+
+static void baseline_remove_files(struct baseline_files *files) {
+    unlink(files->program);
+    unlink(files->expected);
+    unlink(files->jobs);
+    unlink(files->snapshot);
+    rmdir(files->dir);
+}
+
+/* Returns 1 if a simulator with the devices attached refuses both a baseline and a snapshot */
+static int baseline_check_refused(List *device_inits, const char *snapshot_path) {
+    struct device_io io;
+    struct baseline_reader reader;
+    Simulator *simulator;
+    List *devices;
+    size_t i;
+    int refused;
+    io.data = NULL;
+    io.get_char = baseline_io_get_char;
+    io.write_char = baseline_io_write_char;
+    io.write_buf = NULL;
+    io.start = baseline_io_nop;
+    io.end = baseline_io_nop;
+    io.wait_input = NULL;
+    simulator = simulator_new(&io);
+    devices = list_new(sizeof(struct device *), 2, 2.0, &util_list_allocator);
+    for (i = 0; i < list_num_elements(device_inits); ++i) {
+        struct device *device;
+        device = (*(struct device *(**)(void))list_get(device_inits, i))();
+        if (device != NULL && simulator_attach_device(simulator, device) == 0) {
+            list_add(devices, &device);
+        }
+    }
+    reader.pos = 0;
+    simulator_load_program(simulator, baseline_reader_next, &reader);
+    refused = 1;
+    if (simulator_set_baseline(simulator) == 0 || errno != EINVAL) {
+        fprintf(stderr, "simulator_set_baseline took a device it can't restore\n");
+        refused = 0;
+    }
+    if (simulator_save_snapshot(simulator, snapshot_path) == 0 || errno != EINVAL) {
+        fprintf(stderr, "simulator_save_snapshot took a device it can't save\n");
+        refused = 0;
+    }
+    simulator_free(simulator);
+    for (i = 0; i < list_num_elements(devices); ++i) {
+        struct device *device;
+        device = *(struct device **)list_get(devices, i);
+        device->free(device);
+    }
+    list_free(devices);
+    return refused;
+}
+
+static List *baseline_device_inits(PluginManager *plugin_manager) {
+    PluginManagerIterator *iterator;
+    struct pm_device_data device_data;
+    List *device_inits;
+    device_inits = list_new(sizeof(struct device *(*)(void)), 2, 2.0, &util_list_allocator);
+    iterator = pm_get_iterator(plugin_manager);
+    while (pm_iterator_next(iterator, &device_data)) {
+        list_add(device_inits, &device_data.init);
+    }
+    pm_iterator_free(iterator);
+    return device_inits;
+}
+
+int main(int argc, char **argv) {
+    static struct baseline_files files;
+    PluginManager *plugin_manager;
+    List *plugin_dir_paths, *device_inits;
+    char *plugin_dir;
+    int failed, one_lane_failed, lockstep_failed;
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s plugin_dir\n", argv[0]);
+        return 2;
+    }
+    plugin_manager = pm_new(on_load_plugin_error, NULL);
+    plugin_dir_paths = list_new(sizeof(char *), 1, 2.0, &util_list_allocator);
+    plugin_dir = argv[1];
+    list_add(plugin_dir_paths, &plugin_dir);
+    pm_load_device_plugins(plugin_manager, plugin_dir_paths, EXTENSION);
+    device_inits = baseline_device_inits(plugin_manager);
+    if (list_num_elements(device_inits) == 0) {
+        fprintf(stderr, "No device plugins in %s\n", argv[1]);
+        return 2;
+    }
+    snprintf(files.dir, sizeof(files.dir), "%s/batch_baseline.XXXXXX", getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp");
+    if (mkdtemp(files.dir) == NULL || baseline_write_files(&files) < 0) {
+        fprintf(stderr, "Can't write the jobs in %s: %s\n", files.dir, strerror(errno));
+        return 2;
+    }
+
+    failed = !baseline_check_refused(device_inits, files.snapshot);
+    /* one thread and lane, so every job after the first lands on a simulator that ran it */
+    one_lane_failed = batch_run(files.jobs, plugin_manager, SIMULATOR_ENGINE_INTERP, 0, 1, 1);
+    lockstep_failed = batch_run(files.jobs, plugin_manager, SIMULATOR_ENGINE_INTERP, 0, 2, 4);
+    failed |= one_lane_failed != 0 || lockstep_failed != 0;
+    printf("batch_baseline: %d jobs one at a time, %d failed; %d jobs in lockstep, %d failed\n", BASELINE_NUM_JOBS,
+           one_lane_failed, BASELINE_NUM_JOBS, lockstep_failed);
+
+    baseline_remove_files(&files);
+    list_free(device_inits);
+    list_free(plugin_dir_paths);
+    pm_free(plugin_manager);
+    return failed;
+}
@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "bus.h"
+#include "cpu.h"
+#include "device_io.h"
+#include "lockstep.h"
+#include "lc3_reg.h"
+#include "simulator.h"
+
+#define BENCH_INSTRUCTIONS_DEFAULT 2000000LL
+#define BENCH_JOBS_DEFAULT         512
+#define BENCH_JOB_LANES            16
+/* what simulators run between services */
+#define BENCH_SLICE                1024
+#define BENCH_MAX_JOB_INSTRUCTIONS 100000000LL
+
+/* Throughput of lockstep_run against the same lanes run one after another with cpu_run,
+ * first on bare cpus for 1 to 64 lanes, then through simulators the way batch mode runs
+ * jobs, simulator_run for each job against simulator_run_lockstep over groups of them. Both
+ * sides run in slices of BENCH_SLICE and end up in the same state, which is checked. */
+
+/* A compute loop that never stops, ARR is different in every lane */
+static const uint16_t loop_program[] = {
+    0x3000, /* .ORIG x3000 */
+    0x220C, /* TOP LD R1, COUNT */
+    0xE80C, /* LEA R4, ARR */
+    0x6D00, /* LOOP LDR R6, R4, #0 */
+    0x1D81, /* ADD R6, R6, R1 */
+    0x5DAF, /* AND R6, R6, #15 */
+    0x7D00, /* STR R6, R4, #0 */
+    0x16C6, /* ADD R3, R3, R6 */
+    0x9CFF, /* NOT R6, R3 */
+    0x16C6, /* ADD R3, R3, R6 */
+    0x16E1, /* ADD R3, R3, #1 */
+    0x127F, /* ADD R1, R1, #-1 */
+    0x03F6, /* BRp LOOP */
+    0x0FF3, /* BR TOP */
+    0x7530, /* COUNT .FILL #30000 */
+    0x0000, /* ARR .FILL 0 */
+};
+
+/* The same loop once through, about 300000 instructions, then the clock is stopped */
+static const uint16_t job_program[] = {
+    0x3000, /* .ORIG x3000 */
+    0x220D, /* LD R1, COUNT */
+    0xE80E, /* LEA R4, ARR */
+    0x6D00, /* LOOP LDR R6, R4, #0 */
+    0x1D81, /* ADD R6, R6, R1 */
+    0x5DAF, /* AND R6, R6, #15 */
+    0x7D00, /* STR R6, R4, #0 */
+    0x16C6, /* ADD R3, R3, R6 */
+    0x9CFF, /* NOT R6, R3 */
+    0x16C6, /* ADD R3, R3, R6 */
+    0x16E1, /* ADD R3, R3, #1 */
+    0x127F, /* ADD R1, R1, #-1 */
+    0x03F6, /* BRp LOOP */
+    0x5020, /* AND R0, R0, #0 */
+    0xB001, /* STI R0, MCR */
+    0x7530, /* COUNT .FILL #30000 */
+    0xFFFE, /* MCR .FILL xFFFE */
+    0x0000, /* ARR .FILL 0 */
+};
+
+#define BENCH_PROGRAM_LEN(program) (sizeof(program) / sizeof(uint16_t))
+/* the last word of each program */
+#define BENCH_ARR(program) (0x3000 + BENCH_PROGRAM_LEN(program) - 2)
+
+static const int bench_lane_counts[] = {1, 4, 16, 64};
+
+/* A cpu on a bus of its own */
+struct bench_machine {
+    Bus *bus;
+    struct bus_accessor bus_access;
+    Cpu *cpu;
+};
+
+struct bench_reader {
+    const uint16_t *words;
+    size_t len;
+    size_t pos;
+};
+
+static double bench_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static uint16_t bench_bus_read(struct bus_accessor *bus_access, uint16_t address) {
+    return bus_read((Bus *)bus_access->data, address);
+}
+
+static void bench_bus_write(struct bus_accessor *bus_access, uint16_t address, uint16_t value) {
+    bus_write((Bus *)bus_access->data, address, value);
+}
+
+static int bench_bus_is_device_register(struct bus_accessor *bus_access, uint16_t address) {
+    return bus_is_device_register((Bus *)bus_access->data, address);
+}
+
+static void bench_mcr_written(void *data, uint16_t address, uint16_t value) {
+    cpu_write_mcr((Cpu *)data, value);
+}
+
+static void init_bench_machine(struct bench_machine *machine, int lane) {
+    size_t i;
+    machine->bus = bus_new();
+    machine->bus_access.data = machine->bus;
+    machine->bus_access.read = bench_bus_read;
+    machine->bus_access.write = bench_bus_write;
+    machine->bus_access.is_device_register = bench_bus_is_device_register;
+    bus_get_direct_map(machine->bus, &machine->bus_access.direct_map.memory,
+        &machine->bus_access.direct_map.special_pages, &machine->bus_access.direct_map.dirty_pages,
+        &machine->bus_access.direct_map.page_bits);
+    machine->cpu = new_Cpu(&machine->bus_access);
+    bus_add_write_hook(machine->bus, MCR_ADDR, bench_mcr_written, machine->cpu);
+    for (i = 1; i < BENCH_PROGRAM_LEN(loop_program); ++i) {
+        bus_write(machine->bus, loop_program[0] + i - 1, loop_program[i]);
+    }
+    bus_write(machine->bus, BENCH_ARR(loop_program), lane);
+    bus_write(machine->bus, MCR_ADDR, 0x8000);
+    cpu_write_register(machine->cpu, REG_PC, loop_program[0]);
+}
+
+static void free_bench_machine(struct bench_machine *machine) {
+    free_cpu(machine->cpu);
+    bus_free(machine->bus);
+}
+
+static int bench_same_machine(struct bench_machine *plain, struct bench_machine *lane) {
+    int reg;
+    for (reg = 0; reg < num_registers; ++reg) {
+        if (cpu_read_register(plain->cpu, reg) != cpu_read_register(lane->cpu, reg)) {
+            return 0;
+        }
+    }
+    return cpu_retired(plain->cpu) == cpu_retired(lane->cpu) &&
+           bus_read(plain->bus, BENCH_ARR(loop_program)) == bus_read(lane->bus, BENCH_ARR(loop_program));
+}
+
+/* Prints millions of lane instructions per second both ways, returns 0 if the lanes ended
+ * up differently */
+static int bench_lanes(int num_lanes, long long instructions) {
+    static struct bench_machine plain[LOCKSTEP_MAX_LANES], lockstep[LOCKSTEP_MAX_LANES];
+    struct lockstep_lane lanes[LOCKSTEP_MAX_LANES];
+    long long left;
+    double start, plain_seconds, lockstep_seconds;
+    int i, same;
+    for (i = 0; i < num_lanes; ++i) {
+        init_bench_machine(&plain[i], i);
+        init_bench_machine(&lockstep[i], i);
+    }
+    start = bench_now();
+    for (i = 0; i < num_lanes; ++i) {
+        for (left = instructions; left > 0; left -= BENCH_SLICE) {
+            cpu_run(plain[i].cpu, left < BENCH_SLICE ? left : BENCH_SLICE);
+        }
+    }
+    plain_seconds = bench_now() - start;
+    start = bench_now();
+    for (left = instructions; left > 0; left -= BENCH_SLICE) {
+        for (i = 0; i < num_lanes; ++i) {
+            lanes[i].cpu = lockstep[i].cpu;
+            lanes[i].memory = &lockstep[i].bus_access.direct_map;
+            lanes[i].budget = left < BENCH_SLICE ? left : BENCH_SLICE;
+        }
+        lockstep_run(lanes, num_lanes);
+    }
+    lockstep_seconds = bench_now() - start;
+    same = 1;
+    for (i = 0; i < num_lanes; ++i) {
+        same &= bench_same_machine(&plain[i], &lockstep[i]);
+        free_bench_machine(&plain[i]);
+        free_bench_machine(&lockstep[i]);
+    }
+    printf("%5d %14.1f %14.1f %8.2fx%s\n", num_lanes, num_lanes * instructions / plain_seconds / 1e6,
+           num_lanes * instructions / lockstep_seconds / 1e6, plain_seconds / lockstep_seconds,
+           same ? "" : "  lanes differ from plain cpus");
+    return same;
+}
+
+static int bench_io_get_char(struct device_io *io, char *c) {
+    return 0;
+}
+
+static int bench_io_write_char(struct device_io *io, char c) {
+    return 1;
+}
+
+static int bench_io_nop(struct device_io *io) {
+    return 0;
+}
+
+static int bench_reader_next(void *data, uint16_t *word) {
+    struct bench_reader *reader;
+    reader = data;
+    if (reader->pos == reader->len) {
+        return 0;
+    }
+    *word = reader->words[reader->pos++];
+    return 1;
+}
+
+/* Loads the job and makes it the simulator's baseline, as batch mode does for its lanes */
+static void bench_load_job(Simulator *simulator) {
+    struct bench_reader reader;
+    reader.words = job_program;
+    reader.len = BENCH_PROGRAM_LEN(job_program);
+    reader.pos = 0;
+    simulator_load_program(simulator, bench_reader_next, &reader);
+    simulator_set_baseline(simulator);
+}
+
+/* Runs num_jobs jobs on simulators, each by itself and then BENCH_JOB_LANES at a time, and
+ * prints how long each took. Returns 0 if any job didn't halt or the two disagree. */
+static int bench_jobs(int num_jobs) {
+    Simulator *simulators[BENCH_JOB_LANES];
+    enum simulator_stop_reason reasons[BENCH_JOB_LANES];
+    uint16_t plain_r3[BENCH_JOB_LANES];
+    struct device_io io;
+    double start, plain_seconds, lockstep_seconds;
+    int i, job, group, same;
+    io.data = NULL;
+    io.get_char = bench_io_get_char;
+    io.write_char = bench_io_write_char;
+    io.write_buf = NULL;
+    io.start = bench_io_nop;
+    io.end = bench_io_nop;
+    io.wait_input = NULL;
+    for (i = 0; i < BENCH_JOB_LANES; ++i) {
+        simulators[i] = simulator_new(&io);
+        bench_load_job(simulators[i]);
+    }
+    same = 1;
+    start = bench_now();
+    for (job = 0; job < num_jobs; ++job) {
+        i = job % BENCH_JOB_LANES;
+        simulator_reset_to_baseline(simulators[i]);
+        simulator_write_address(simulators[i], BENCH_ARR(job_program), job);
+        simulator_run(simulators[i], BENCH_MAX_JOB_INSTRUCTIONS, &reasons[i]);
+        same &= reasons[i] == SIMULATOR_STOP_HALTED;
+        plain_r3[i] = simulator_read_register(simulators[i], REG_R3);
+    }
+    plain_seconds = bench_now() - start;
+    start = bench_now();
+    for (job = 0; job < num_jobs; job += group) {
+        group = num_jobs - job < BENCH_JOB_LANES ? num_jobs - job : BENCH_JOB_LANES;
+        for (i = 0; i < group; ++i) {
+            simulator_reset_to_baseline(simulators[i]);
+            simulator_write_address(simulators[i], BENCH_ARR(job_program), job + i);
+        }
+        simulator_run_lockstep(simulators, group, BENCH_MAX_JOB_INSTRUCTIONS, reasons);
+        for (i = 0; i < group; ++i) {
+            same &= reasons[i] == SIMULATOR_STOP_HALTED;
+        }
+    }
+    lockstep_seconds = bench_now() - start;
+    /* the last group of each holds the same jobs when num_jobs is a multiple of the lanes */
+    for (i = 0; i < BENCH_JOB_LANES && num_jobs % BENCH_JOB_LANES == 0; ++i) {
+        same &= simulator_read_register(simulators[i], REG_R3) == plain_r3[i];
+    }
+    printf("%d jobs, %d at a time: simulator_run %.0f ms, simulator_run_lockstep %.0f ms, %.2fx%s\n", num_jobs,
+           BENCH_JOB_LANES, plain_seconds * 1e3, lockstep_seconds * 1e3, plain_seconds / lockstep_seconds,
+           same ? "" : ", results differ");
+    for (i = 0; i < BENCH_JOB_LANES; ++i) {
+        simulator_free(simulators[i]);
+    }
+    return same;
+}
+
+int main(int argc, char **argv) {
+    long long instructions;
+    int i, num_jobs, same;
+    instructions = argc > 1 ? atoll(argv[1]) : BENCH_INSTRUCTIONS_DEFAULT;
+    num_jobs = argc > 2 ? atoi(argv[2]) : BENCH_JOBS_DEFAULT;
+    if (instructions < 1 || num_jobs < 1) {
+        fprintf(stderr, "usage: %s [instructions_per_lane [jobs]]\n", argv[0]);
+        return 2;
+    }
+    printf("%lld instructions per lane in slices of %d, millions of lane instructions per second\n", instructions,
+           BENCH_SLICE);
+    printf("lanes     plain cpus       lockstep  speedup\n");
+    same = 1;
+    for (i = 0; i < (int)(sizeof(bench_lane_counts) / sizeof(bench_lane_counts[0])); ++i) {
+        same &= bench_lanes(bench_lane_counts[i], instructions);
+    }
+    same &= bench_jobs(num_jobs);
+    return !same;
+}
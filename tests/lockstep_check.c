@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bus.h"
+#include "cpu.h"
+#include "device.h"
+#include "lockstep.h"
+#include "lc3_reg.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(LOCKSTEP_NO_AVX2)
+#define CHECK_AVX2
+#endif
+
+#define CHECK_SEEDS_DEFAULT 100
+#define CHECK_CHUNKS        40
+#define CHECK_MAX_CHUNK     3000
+#define CHECK_CODE_LOW      0x3000
+#define CHECK_CODE_HIGH     0x3400
+#define CHECK_STACK         0x2F00
+
+/* Runs random programs on lanes of lockstep_run and on plain cpus side by side and compares
+ * them after every chunk: status, retired count, registers, all of memory and the state of
+ * a device whose reads have side effects. Built once as is and once with -DLOCKSTEP_NO_AVX2,
+ * so the vector code and the plain C loop are both checked against the interpreter. Exits
+ * with 1 on any difference. */
+
+/* Every read and write changes counter, so the order and number of device accesses show */
+struct check_device_data {
+    uint16_t counter;
+};
+
+/* A cpu on a bus of its own, with the device attached */
+struct check_machine {
+    Bus *bus;
+    struct bus_accessor bus_access;
+    Cpu *cpu;
+    struct device device;
+    struct check_device_data device_data;
+};
+
+static const uint16_t check_device_addresses[] = {0xFE00, 0xFE02, 0x4000};
+
+/* Opcodes random code is drawn from, weighted towards what lockstep does on vectors */
+static const uint16_t check_opcodes[] = {
+    0x1, 0x5, 0x0, 0x0, 0x2, 0x6, 0xE, 0x9, 0x3, 0x7, 0x1, 0x0, 0xC, 0x4, 0xA, 0xB
+};
+
+static uint64_t check_rng;
+
+static uint32_t check_random(void) {
+    check_rng ^= check_rng << 13;
+    check_rng ^= check_rng >> 7;
+    check_rng ^= check_rng << 17;
+    return check_rng >> 11;
+}
+
+static uint16_t check_device_read(struct device *device, uint16_t address) {
+    struct check_device_data *data;
+    data = device->data;
+    return (data->counter++) ^ address;
+}
+
+static void check_device_write(struct device *device, uint16_t address, uint16_t value) {
+    struct check_device_data *data;
+    data = device->data;
+    data->counter ^= value + address;
+}
+
+static const uint16_t *check_device_get_addresses(struct device *device, size_t *num_addresses) {
+    *num_addresses = sizeof(check_device_addresses) / sizeof(uint16_t);
+    return check_device_addresses;
+}
+
+static enum address_method check_device_get_address_method(struct device *device) {
+    return SEPERATE;
+}
+
+static uint16_t check_bus_read(struct bus_accessor *bus_access, uint16_t address) {
+    return bus_read((Bus *)bus_access->data, address);
+}
+
+static void check_bus_write(struct bus_accessor *bus_access, uint16_t address, uint16_t value) {
+    bus_write((Bus *)bus_access->data, address, value);
+}
+
+static int check_bus_is_device_register(struct bus_accessor *bus_access, uint16_t address) {
+    return bus_is_device_register((Bus *)bus_access->data, address);
+}
+
+static void check_mcr_written(void *data, uint16_t address, uint16_t value) {
+    cpu_write_mcr((Cpu *)data, value);
+}
+
+static void init_check_machine(struct check_machine *machine) {
+    memset(&machine->device, 0, sizeof(machine->device));
+    machine->device_data.counter = 0;
+    machine->device.data = &machine->device_data;
+    machine->device.read_register = check_device_read;
+    machine->device.write_register = check_device_write;
+    machine->device.get_addresses = check_device_get_addresses;
+    machine->device.get_address_method = check_device_get_address_method;
+    machine->bus = bus_new();
+    bus_attach(machine->bus, &machine->device);
+    machine->bus_access.data = machine->bus;
+    machine->bus_access.read = check_bus_read;
+    machine->bus_access.write = check_bus_write;
+    machine->bus_access.is_device_register = check_bus_is_device_register;
+    bus_get_direct_map(machine->bus, &machine->bus_access.direct_map.memory,
+        &machine->bus_access.direct_map.special_pages, &machine->bus_access.direct_map.dirty_pages,
+        &machine->bus_access.direct_map.page_bits);
+    machine->cpu = new_Cpu(&machine->bus_access);
+    bus_add_write_hook(machine->bus, MCR_ADDR, check_mcr_written, machine->cpu);
+}
+
+static void free_check_machine(struct check_machine *machine) {
+    free_cpu(machine->cpu);
+    bus_free(machine->bus);
+}
+
+static int check_is_device_address(uint32_t address) {
+    size_t i;
+    for (i = 0; i < sizeof(check_device_addresses) / sizeof(uint16_t); ++i) {
+        if (address == check_device_addresses[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Random words everywhere, random code with the odd TRAP, RTI and illegal opcode where the
+ * lanes start, and the clock running */
+static uint16_t check_random_word(uint32_t address) {
+    uint16_t word;
+    int opcode;
+    if (address == MCR_ADDR) {
+        return 0x8000;
+    }
+    if (address < CHECK_CODE_LOW || address >= CHECK_CODE_HIGH) {
+        return check_random();
+    }
+    opcode = check_opcodes[check_random() % (sizeof(check_opcodes) / sizeof(check_opcodes[0]))];
+    word = (opcode << 12) | (check_random() & 0x0FFF);
+    if (opcode == 0x6 || opcode == 0x7) {
+        /* LDR and STR near the base register, which is usually small */
+        word = (word & 0xFFC0) | (check_random() & 0x3F);
+    }
+    if (check_random() % 64 == 0) {
+        word = 0xF000 | (check_random() & 0xFF);
+    }
+    if (check_random() % 128 == 0) {
+        word = 0x8000;
+    }
+    if (check_random() % 128 == 0) {
+        word = 0xD000;
+    }
+    return word;
+}
+
+static int check_same_machine(struct check_machine *plain, struct check_machine *lane) {
+    int reg;
+    if (cpu_retired(plain->cpu) != cpu_retired(lane->cpu) ||
+        plain->device_data.counter != lane->device_data.counter) {
+        return 0;
+    }
+    for (reg = 0; reg < num_registers; ++reg) {
+        if (cpu_read_register(plain->cpu, reg) != cpu_read_register(lane->cpu, reg)) {
+            return 0;
+        }
+    }
+    return memcmp(plain->bus_access.direct_map.memory, lane->bus_access.direct_map.memory,
+                  sizeof(uint16_t) * BUS_NUM_ADDRESSES) == 0;
+}
+
+static void check_print_registers(struct check_machine *plain, struct check_machine *lane) {
+    int reg;
+    printf("  plain/lockstep registers:");
+    for (reg = 0; reg < num_registers; ++reg) {
+        printf(" %04X/%04X", cpu_read_register(plain->cpu, reg), cpu_read_register(lane->cpu, reg));
+    }
+    printf("\n  retired %llu/%llu\n", cpu_retired(plain->cpu), cpu_retired(lane->cpu));
+}
+
+/* Returns 1 if every lane of the seed matched its plain cpu */
+static int check_seed(unsigned long seed, int num_lanes) {
+    static struct check_machine plain[LOCKSTEP_MAX_LANES], lockstep[LOCKSTEP_MAX_LANES];
+    struct lockstep_lane lanes[LOCKSTEP_MAX_LANES];
+    int running[LOCKSTEP_MAX_LANES], lane_machine[LOCKSTEP_MAX_LANES];
+    enum cpu_status statuses[LOCKSTEP_MAX_LANES];
+    uint32_t address;
+    int i, chunk, num_running, same;
+    check_rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+    for (i = 0; i < num_lanes; ++i) {
+        init_check_machine(&plain[i]);
+        init_check_machine(&lockstep[i]);
+    }
+    for (address = 0; address < BUS_NUM_ADDRESSES; ++address) {
+        uint16_t word;
+        if (check_is_device_address(address)) {
+            continue;
+        }
+        word = check_random_word(address);
+        for (i = 0; i < num_lanes; ++i) {
+            bus_write(plain[i].bus, address, word);
+            bus_write(lockstep[i].bus, address, word);
+        }
+    }
+    /* lanes start from different registers and every third runs a different word somewhere */
+    for (i = 0; i < num_lanes; ++i) {
+        uint16_t psr, r0, r1, patch_address, patch_word;
+        struct check_machine *machines[2];
+        int j, patched;
+        psr = check_random() & 0x7;
+        r0 = check_random() & 0x3;
+        r1 = check_random() % 5 == 0 ? check_random() : 0;
+        machines[0] = &plain[i];
+        machines[1] = &lockstep[i];
+        patched = i % 3 == 0;
+        patch_address = CHECK_CODE_LOW + check_random() % (CHECK_CODE_HIGH - CHECK_CODE_LOW);
+        patch_word = (0x1 << 12) | (check_random() & 0x0FFF);
+        for (j = 0; j < 2; ++j) {
+            if (patched) {
+                bus_write(machines[j]->bus, patch_address, patch_word);
+            }
+            cpu_invalidate_all(machines[j]->cpu);
+            cpu_write_register(machines[j]->cpu, REG_PC, CHECK_CODE_LOW);
+            cpu_write_register(machines[j]->cpu, REG_R6, CHECK_STACK);
+            cpu_write_register(machines[j]->cpu, REG_PSR, psr);
+            cpu_write_register(machines[j]->cpu, REG_R0, r0);
+            cpu_write_register(machines[j]->cpu, REG_R1, r1);
+        }
+        running[i] = 1;
+    }
+    same = 1;
+    for (chunk = 0; chunk < CHECK_CHUNKS && same; ++chunk) {
+        long long amount;
+        amount = 1 + check_random() % CHECK_MAX_CHUNK;
+        num_running = 0;
+        for (i = 0; i < num_lanes; ++i) {
+            if (!running[i]) {
+                continue;
+            }
+            statuses[num_running] = cpu_run(plain[i].cpu, amount);
+            lanes[num_running].cpu = lockstep[i].cpu;
+            lanes[num_running].memory = &lockstep[i].bus_access.direct_map;
+            lanes[num_running].budget = amount;
+            lane_machine[num_running++] = i;
+        }
+        if (num_running == 0) {
+            break;
+        }
+        lockstep_run(lanes, num_running);
+        for (i = 0; i < num_running && same; ++i) {
+            int machine;
+            machine = lane_machine[i];
+            if (statuses[i] != lanes[i].status || !check_same_machine(&plain[machine], &lockstep[machine])) {
+                printf("seed %lu, %d lanes: lane %d differs after chunk %d, status %d/%d\n", seed, num_lanes,
+                       machine, chunk, statuses[i], lanes[i].status);
+                check_print_registers(&plain[machine], &lockstep[machine]);
+                same = 0;
+            }
+            if (statuses[i] == CPU_HALTED || statuses[i] == CPU_BREAKPOINT) {
+                running[machine] = 0;
+            }
+        }
+    }
+    for (i = 0; i < num_lanes; ++i) {
+        free_check_machine(&plain[i]);
+        free_check_machine(&lockstep[i]);
+    }
+    return same;
+}
+
+int main(int argc, char **argv) {
+    unsigned long seed, num_seeds, num_differ;
+    const char *path;
+    num_seeds = argc > 1 ? strtoul(argv[1], NULL, 10) : CHECK_SEEDS_DEFAULT;
+#ifdef CHECK_AVX2
+    path = __builtin_cpu_supports("avx2") ? "avx2" : "plain C, no avx2 on this cpu";
+#else
+    path = "plain C";
+#endif
+    num_differ = 0;
+    for (seed = 1; seed <= num_seeds; ++seed) {
+        /* mostly a vector or so of lanes, sometimes all of them or just one */
+        int num_lanes;
+        num_lanes = seed % 8 == 0 ? LOCKSTEP_MAX_LANES : seed % 8 == 1 ? 1 : 2 + seed * 7 % 31;
+        num_differ += !check_seed(seed, num_lanes);
+    }
+    printf("lockstep_check (%s): %lu seeds, %lu differ from plain cpus\n", path, num_seeds, num_differ);
+    return num_differ != 0;
+}
@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "device.h"
+
+/* A version 1 device, no device_abi_version, whose only state is a counter a snapshot can't
+ * see. Each read of COUNTER gives the count and prints it as a letter, A first. */
+
+#define COUNTER 0xFE30
+
+static const uint16_t counter_addresses[] = {COUNTER};
+static const size_t counter_num_addresses = 1;
+static const enum address_method counter_method = SEPERATE;
+
+struct counter_data {
+    struct host *host;
+    uint16_t count;
+};
+
+static uint16_t counter_read_register(struct device *counter_device, uint16_t address) {
+    struct counter_data *counter_data;
+    counter_data = counter_device->data;
+    counter_data->host->write_output(counter_data->host, 'A' + counter_data->count % 26);
+    return counter_data->count++;
+}
+
+static void counter_write_register(struct device *counter_device, uint16_t address, uint16_t value) {
+}
+
+static void counter_free(struct device *counter_device) {
+    free(counter_device->data);
+    free(counter_device);
+}
+
+static const uint16_t *counter_get_addresses(struct device *counter_device, size_t *num_addresses) {
+    *num_addresses = counter_num_addresses;
+    return counter_addresses;
+}
+
+static enum address_method counter_get_address_method(struct device *counter_device) {
+    return counter_method;
+}
+
+static void counter_start(struct device *counter_device, struct host *host) {
+    struct counter_data *counter_data;
+    counter_data = counter_device->data;
+    counter_data->host = host;
+}
+
+struct device *init_device_plugin(void) {
+    struct device *counter_device;
+    struct counter_data *counter_data;
+    counter_device = calloc(1, sizeof(struct device));
+    if (counter_device == NULL) {
+        return NULL;
+    }
+    counter_data = malloc(sizeof(struct counter_data));
+    if (counter_data == NULL) {
+        free(counter_device);
+        return NULL;
+    }
+    counter_data->host = NULL;
+    counter_data->count = 0;
+    counter_device->data = counter_data;
+    counter_device->start = counter_start;
+    counter_device->read_register = counter_read_register;
+    counter_device->write_register = counter_write_register;
+    counter_device->free = counter_free;
+    counter_device->get_addresses = counter_get_addresses;
+    counter_device->get_address_method = counter_get_address_method;
+    return counter_device;
+}
@@ -0,0 +1,479 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "device.h"
+#include "device_io.h"
+#include "plugin_manager.h"
+#include "simulator.h"
+#include "list.h"
+#include "util.h"
+
+#ifdef __linux__
+#define EXTENSION "so"
+#endif
+#ifdef __APPLE__
+#define EXTENSION "dylib"
+#endif
+
+#define STRESS_THREADS_DEFAULT  16
+#define STRESS_RUNS_DEFAULT     8
+#define STRESS_MAX_INSTRUCTIONS 10000000LL
+#define STRESS_MAX_OUTPUT       4096
+#define STRESS_MAX_OS_WORDS     65536
+#define STRESS_INPUT            "hello, world q"
+/* get_char calls per character handed over, so input arrives while the program is running */
+#define STRESS_INPUT_PACE       7
+
+/* Checks the guarantee in simulator.h. Every job, a program on one engine, is run once on
+ * this thread for a reference, then threads each run fresh simulators through the jobs at
+ * the same time. Each run's output, stop reason, registers and instruction count have to
+ * match the reference exactly. Exits with 1 on any difference. */
+
+/* Echoes what it reads with GETC until a q, polling the keyboard through os.obj */
+static const uint16_t echo_program[] = {
+    0x3000, /* .ORIG x3000 */
+    0xE00D, /* LEA R0, PROMPT */
+    0xF022, /* PUTS */
+    0x54A0, /* AND R2, R2, #0 */
+    0xF020, /* AGAIN GETC */
+    0x2208, /* LD R1, NEGQ */
+    0x1201, /* ADD R1, R0, R1 */
+    0x0403, /* BRz DONE */
+    0xF021, /* OUT */
+    0x14A1, /* ADD R2, R2, #1 */
+    0x0FF9, /* BR AGAIN */
+    0xE00A, /* DONE LEA R0, BYE */
+    0xF022, /* PUTS */
+    0xF025, /* HALT */
+    0xFF8F, /* NEGQ .FILL #-113 */
+    0x0065, 0x0063, 0x0068, 0x006F, 0x003A, 0x0020, 0x0000, /* PROMPT .STRINGZ "echo: " */
+    0x000A, 0x0062, 0x0079, 0x0065, 0x000A, 0x0000, /* BYE .STRINGZ "\nbye\n" */
+};
+
+/* Takes keyboard interrupts into BUF while it spins, until a q comes in. R6 is reloaded in
+ * the loop because RTI back to supervisor mode gives R6 the saved USP. */
+static const uint16_t interrupt_program[] = {
+    0x3000, /* .ORIG x3000 */
+    0xE626, /* LEA R3, BUF */
+    0xE011, /* LEA R0, HANDLER */
+    0xB017, /* STI R0, IVEC */
+    0x2017, /* LD R0, IE */
+    0xB017, /* STI R0, KBSRA */
+    0x2C13, /* WAIT LD R6, SSTACK */
+    0x1921, /* ADD R4, R4, #1 */
+    0x62FF, /* LDR R1, R3, #-1 */
+    0x2415, /* LD R2, NEGQ */
+    0x1242, /* ADD R1, R1, R2 */
+    0x0BFA, /* BRnp WAIT */
+    0x5020, /* AND R0, R0, #0 */
+    0xB00F, /* STI R0, KBSRA */
+    0x70FF, /* STR R0, R3, #-1 */
+    0xE011, /* LEA R0, GOT */
+    0xF022, /* PUTS */
+    0xE016, /* LEA R0, BUF */
+    0xF022, /* PUTS */
+    0xF025, /* HALT */
+    0x300B, /* HANDLER ST R0, SAVE0 */
+    0xA008, /* LDI R0, KBDRA */
+    0x70C0, /* STR R0, R3, #0 */
+    0x16E1, /* ADD R3, R3, #1 */
+    0x2007, /* LD R0, SAVE0 */
+    0x8000, /* RTI */
+    0x3000, /* SSTACK .FILL x3000 */
+    0x0180, /* IVEC .FILL x0180 */
+    0x4000, /* IE .FILL x4000 */
+    0xFE00, /* KBSRA .FILL xFE00 */
+    0xFE02, /* KBDRA .FILL xFE02 */
+    0xFF8F, /* NEGQ .FILL #-113 */
+    0x0000, /* SAVE0 .FILL 0 */
+    0x0067, 0x006F, 0x0074, 0x003A, 0x0020, 0x0000, /* GOT .STRINGZ "got: " */
+    0x0000, /* .FILL 0 */
+    /* BUF follows, memory there starts out zero */
+};
+
+/* Prints fib(15) computed recursively on a stack */
+static const uint16_t fib_program[] = {
+    0x3000, /* .ORIG x3000 */
+    0x2C36, /* LD R6, STACK */
+    0x5020, /* AND R0, R0, #0 */
+    0x102F, /* ADD R0, R0, #15 */
+    0x481A, /* JSR FIB */
+    0x3033, /* ST R0, RESULT */
+    0x2232, /* LD R1, RESULT */
+    0xE434, /* LEA R2, BUF */
+    0x56E0, /* DIGL AND R3, R3, #0 */
+    0x1276, /* DIVL ADD R1, R1, #-10 */
+    0x0802, /* BRn DIVD */
+    0x16E1, /* ADD R3, R3, #1 */
+    0x0FFC, /* BR DIVL */
+    0x126A, /* DIVD ADD R1, R1, #10 */
+    0x282B, /* LD R4, ASCII0 */
+    0x1244, /* ADD R1, R1, R4 */
+    0x7280, /* STR R1, R2, #0 */
+    0x14A1, /* ADD R2, R2, #1 */
+    0x12E0, /* ADD R1, R3, #0 */
+    0x03F4, /* BRp DIGL */
+    0xE827, /* LEA R4, BUF */
+    0x14BF, /* OUTL ADD R2, R2, #-1 */
+    0x6080, /* LDR R0, R2, #0 */
+    0xF021, /* OUT */
+    0x9B3F, /* NOT R5, R4 */
+    0x1B61, /* ADD R5, R5, #1 */
+    0x1B42, /* ADD R5, R5, R2 */
+    0x03F9, /* BRp OUTL */
+    0x201E, /* LD R0, NL */
+    0xF021, /* OUT */
+    0xF025, /* HALT */
+    0x1DBF, /* FIB ADD R6, R6, #-1 */
+    0x7F80, /* STR R7, R6, #0 */
+    0x1DBF, /* ADD R6, R6, #-1 */
+    0x7380, /* STR R1, R6, #0 */
+    0x123E, /* ADD R1, R0, #-2 */
+    0x080E, /* BRn FIBBASE */
+    0x1DBF, /* ADD R6, R6, #-1 */
+    0x7180, /* STR R0, R6, #0 */
+    0x103F, /* ADD R0, R0, #-1 */
+    0x4FF6, /* JSR FIB */
+    0x1220, /* ADD R1, R0, #0 */
+    0x6180, /* LDR R0, R6, #0 */
+    0x1DA1, /* ADD R6, R6, #1 */
+    0x103E, /* ADD R0, R0, #-2 */
+    0x1DBF, /* ADD R6, R6, #-1 */
+    0x7380, /* STR R1, R6, #0 */
+    0x4FEF, /* JSR FIB */
+    0x6380, /* LDR R1, R6, #0 */
+    0x1DA1, /* ADD R6, R6, #1 */
+    0x1001, /* ADD R0, R0, R1 */
+    0x6380, /* FIBBASE LDR R1, R6, #0 */
+    0x1DA1, /* ADD R6, R6, #1 */
+    0x6F80, /* LDR R7, R6, #0 */
+    0x1DA1, /* ADD R6, R6, #1 */
+    0xC1C0, /* RET */
+    0xFD00, /* STACK .FILL xFD00 */
+    0x0000, /* RESULT .FILL 0 */
+    0x0030, /* ASCII0 .FILL #48 */
+    0x000A, /* NL .FILL x0A */
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, /* BUF .BLKW 8 */
+};
+
+/* Patches its own code, an immediate it then runs and finally a HALT */
+static const uint16_t patch_program[] = {
+    0x3000, /* .ORIG x3000 */
+    0x5260, /* AND R1, R1, #0 */
+    0x1265, /* ADD R1, R1, #5 */
+    0xE010, /* LOOP LEA R0, CHAR */
+    0x6000, /* LDR R0, R0, #0 */
+    0x1020, /* PATCH ADD R0, R0, #0 */
+    0xF021, /* OUT */
+    0x25FD, /* LD R2, PATCH */
+    0x14A1, /* ADD R2, R2, #1 */
+    0x35FB, /* ST R2, PATCH */
+    0x127F, /* ADD R1, R1, #-1 */
+    0x03F7, /* BRp LOOP */
+    0x2008, /* LD R0, NL */
+    0xF021, /* OUT */
+    0x2607, /* LD R3, HALTI */
+    0x3600, /* ST R3, NEXT */
+    0x1020, /* NEXT ADD R0, R0, #0 */
+    0xE005, /* LEA R0, BAD */
+    0xF022, /* PUTS */
+    0xF025, /* HALT */
+    0x0041, /* CHAR .FILL x41 */
+    0x000A, /* NL .FILL x0A */
+    0xF025, /* HALTI .FILL xF025 */
+    /* BAD .STRINGZ "not reached\n" */
+    0x006E, 0x006F, 0x0074, 0x0020, 0x0072, 0x0065, 0x0061, 0x0063,
+    0x0068, 0x0065, 0x0064, 0x000A, 0x0000,
+};
+
+struct stress_program {
+    const char *name;
+    const uint16_t *words;
+    size_t len;
+};
+
+static const struct stress_program stress_programs[] = {
+    {"echo", echo_program, sizeof(echo_program) / sizeof(uint16_t)},
+    {"interrupt", interrupt_program, sizeof(interrupt_program) / sizeof(uint16_t)},
+    {"fib", fib_program, sizeof(fib_program) / sizeof(uint16_t)},
+    {"patch", patch_program, sizeof(patch_program) / sizeof(uint16_t)}
+};
+static const int stress_num_programs = sizeof(stress_programs) / sizeof(stress_programs[0]);
+
+static const enum simulator_engine stress_engines[] = {SIMULATOR_ENGINE_INTERP, SIMULATOR_ENGINE_JIT};
+static const char *const stress_engine_names[] = {"interp", "jit"};
+static const int stress_num_engines = sizeof(stress_engines) / sizeof(stress_engines[0]);
+
+/* What a run leaves behind */
+struct stress_result {
+    char output[STRESS_MAX_OUTPUT];
+    size_t output_len;
+    int run_result;
+    enum simulator_stop_reason reason;
+    uint16_t registers[num_registers];
+    unsigned long long instructions;
+    int jit_failed;
+};
+
+struct stress_io_data {
+    const char *input;
+    size_t input_pos;
+    int calls;
+    struct stress_result *result;
+};
+
+struct stress_reader {
+    const uint16_t *words;
+    size_t len;
+    size_t pos;
+};
+
+struct stress {
+    List *device_inits;
+    uint16_t os[STRESS_MAX_OS_WORDS];
+    size_t os_len;
+    struct stress_result *references; /* one per job */
+    int num_jobs;
+    int num_runs;
+};
+
+struct stress_thread {
+    struct stress *stress;
+    int id;
+    int num_differ;
+    pthread_t thread;
+};
+
+static int stress_io_get_char(struct device_io *io, char *c) {
+    struct stress_io_data *data;
+    data = io->data;
+    if (data->input[data->input_pos] == '\0' || ++data->calls < STRESS_INPUT_PACE) {
+        return 0;
+    }
+    data->calls = 0;
+    *c = data->input[data->input_pos++];
+    return 1;
+}
+
+static int stress_io_write_char(struct device_io *io, char c) {
+    struct stress_io_data *data;
+    data = io->data;
+    if (data->result->output_len < STRESS_MAX_OUTPUT) {
+        data->result->output[data->result->output_len++] = c;
+    }
+    return 1;
+}
+
+static int stress_io_nop(struct device_io *io) {
+    return 0;
+}
+
+static int stress_reader_next(void *data, uint16_t *word) {
+    struct stress_reader *reader;
+    reader = data;
+    if (reader->pos == reader->len) {
+        return 0;
+    }
+    *word = reader->words[reader->pos++];
+    return 1;
+}
+
+static void stress_load(Simulator *simulator, const uint16_t *words, size_t len) {
+    struct stress_reader reader;
+    reader.words = words;
+    reader.len = len;
+    reader.pos = 0;
+    simulator_load_program(simulator, stress_reader_next, &reader);
+}
+
+/* Runs job on a simulator of its own with its own devices */
+static void stress_run(struct stress *stress, int job, struct stress_result *result) {
+    const struct stress_program *program;
+    struct device_io io;
+    struct stress_io_data io_data;
+    struct simulator_stats stats;
+    Simulator *simulator;
+    List *devices;
+    size_t i, num_inits;
+    int reg;
+    program = &stress_programs[job % stress_num_programs];
+    result->output_len = 0;
+    io_data.input = STRESS_INPUT;
+    io_data.input_pos = 0;
+    io_data.calls = 0;
+    io_data.result = result;
+    io.data = &io_data;
+    io.get_char = stress_io_get_char;
+    io.write_char = stress_io_write_char;
+    io.write_buf = NULL;
+    io.start = stress_io_nop;
+    io.end = stress_io_nop;
+    io.wait_input = NULL;
+    simulator = simulator_new(&io);
+    devices = list_new(sizeof(struct device *), 2, 2.0, &util_list_allocator);
+    num_inits = list_num_elements(stress->device_inits);
+    for (i = 0; i < num_inits; ++i) {
+        struct device *device;
+        device = (*(struct device *(**)(void))list_get(stress->device_inits, i))();
+        if (device != NULL && simulator_attach_device(simulator, device) == 0) {
+            list_add(devices, &device);
+        } else if (device != NULL) {
+            device->free(device);
+        }
+    }
+    result->jit_failed = simulator_set_engine(simulator, stress_engines[job / stress_num_programs]) < 0;
+    stress_load(simulator, stress->os, stress->os_len);
+    stress_load(simulator, program->words, program->len);
+    result->run_result = simulator_run(simulator, STRESS_MAX_INSTRUCTIONS, &result->reason);
+    for (reg = 0; reg < num_registers; ++reg) {
+        result->registers[reg] = simulator_read_register(simulator, reg);
+    }
+    simulator_get_stats(simulator, &stats);
+    result->instructions = stats.instructions;
+    simulator_free(simulator);
+    for (i = 0; i < list_num_elements(devices); ++i) {
+        struct device *device;
+        device = *(struct device **)list_get(devices, i);
+        device->free(device);
+    }
+    list_free(devices);
+}
+
+static int stress_same_result(const struct stress_result *result, const struct stress_result *reference) {
+    return result->output_len == reference->output_len &&
+           memcmp(result->output, reference->output, result->output_len) == 0 &&
+           result->run_result == reference->run_result && result->reason == reference->reason &&
+           memcmp(result->registers, reference->registers, sizeof(result->registers)) == 0 &&
+           result->instructions == reference->instructions;
+}
+
+static void *stress_thread_main(void *arg) {
+    struct stress_thread *thread;
+    struct stress *stress;
+    struct stress_result *result;
+    int run, job;
+    thread = arg;
+    stress = thread->stress;
+    result = safe_malloc(sizeof(struct stress_result));
+    for (run = 0; run < stress->num_runs; ++run) {
+        job = (thread->id + run) % stress->num_jobs;
+        stress_run(stress, job, result);
+        if (!stress_same_result(result, &stress->references[job])) {
+            ++thread->num_differ;
+            printf("thread %d run %d: %s on %s differs from the sequential run\n", thread->id, run,
+                   stress_programs[job % stress_num_programs].name, stress_engine_names[job / stress_num_programs]);
+        }
+    }
+    free(result);
+    return NULL;
+}
+
+static int stress_read_os(struct stress *stress, const char *path) {
+    FILE *file;
+    uint16_t word;
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    stress->os_len = 0;
+    while (stress->os_len < STRESS_MAX_OS_WORDS && fread(&word, sizeof(uint16_t), 1, file) == 1) {
+        stress->os[stress->os_len++] = ntohs(word);
+    }
+    fclose(file);
+    return stress->os_len > 0 ? 0 : -1;
+}
+
+static void on_load_plugin_error(const char *path, const char *error_string, enum pm_error error_type, void *data) {
+    fprintf(stderr, "Error loading device plugins from %s: %s.\n", path, error_string);
+}
+
+static List *stress_device_inits(PluginManager *plugin_manager) {
+    PluginManagerIterator *iterator;
+    struct pm_device_data device_data;
+    List *device_inits;
+    device_inits = list_new(sizeof(struct device *(*)(void)), 2, 2.0, &util_list_allocator);
+    iterator = pm_get_iterator(plugin_manager);
+    while (pm_iterator_next(iterator, &device_data)) {
+        list_add(device_inits, &device_data.init);
+    }
+    pm_iterator_free(iterator);
+    return device_inits;
+}
+
+int main(int argc, char **argv) {
+    static struct stress stress;
+    struct stress_thread *threads;
+    PluginManager *plugin_manager;
+    List *plugin_dir_paths;
+    char *plugin_dir;
+    int i, num_threads, num_started, num_differ;
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr, "usage: %s plugin_dir os.obj [threads [runs]]\n", argv[0]);
+        return 2;
+    }
+    num_threads = argc > 3 ? atoi(argv[3]) : STRESS_THREADS_DEFAULT;
+    stress.num_runs = argc > 4 ? atoi(argv[4]) : STRESS_RUNS_DEFAULT;
+    if (num_threads < 1 || stress.num_runs < 1) {
+        fprintf(stderr, "threads and runs have to be at least 1\n");
+        return 2;
+    }
+    errno = 0;
+    if (stress_read_os(&stress, argv[2]) < 0) {
+        fprintf(stderr, "Can't read %s: %s\n", argv[2], errno != 0 ? strerror(errno) : "no words in it");
+        return 2;
+    }
+    plugin_manager = pm_new(on_load_plugin_error, NULL);
+    plugin_dir_paths = list_new(sizeof(char *), 1, 2.0, &util_list_allocator);
+    plugin_dir = argv[1];
+    list_add(plugin_dir_paths, &plugin_dir);
+    pm_load_device_plugins(plugin_manager, plugin_dir_paths, EXTENSION);
+    stress.device_inits = stress_device_inits(plugin_manager);
+    if (list_num_elements(stress.device_inits) == 0) {
+        fprintf(stderr, "No device plugins in %s\n", argv[1]);
+        return 2;
+    }
+
+    stress.num_jobs = stress_num_programs * stress_num_engines;
+    stress.references = safe_malloc(sizeof(struct stress_result) * stress.num_jobs);
+    for (i = 0; i < stress.num_jobs; ++i) {
+        stress_run(&stress, i, &stress.references[i]);
+        if (stress.references[i].jit_failed) {
+            fprintf(stderr, "No jit here, %s runs on the interpreter.\n", stress_programs[i % stress_num_programs].name);
+        }
+        if (stress.references[i].run_result < 0 || stress.references[i].reason != SIMULATOR_STOP_HALTED) {
+            fprintf(stderr, "%s on %s didn't halt on its own.\n", stress_programs[i % stress_num_programs].name,
+                    stress_engine_names[i / stress_num_programs]);
+            return 1;
+        }
+    }
+
+    threads = safe_malloc(sizeof(struct stress_thread) * num_threads);
+    for (num_started = 0; num_started < num_threads; ++num_started) {
+        threads[num_started].stress = &stress;
+        threads[num_started].id = num_started;
+        threads[num_started].num_differ = 0;
+        if (pthread_create(&threads[num_started].thread, NULL, stress_thread_main, &threads[num_started]) != 0) {
+            fprintf(stderr, "Can't start thread %d\n", num_started);
+            break;
+        }
+    }
+    num_differ = 0;
+    for (i = 0; i < num_started; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        num_differ += threads[i].num_differ;
+    }
+    printf("thread_stress: %d threads x %d runs, %d differ from the sequential runs\n", num_started, stress.num_runs,
+           num_differ);
+
+    free(threads);
+    free(stress.references);
+    list_free(stress.device_inits);
+    list_free(plugin_dir_paths);
+    pm_free(plugin_manager);
+    return num_differ != 0 || num_started < num_threads;
+}